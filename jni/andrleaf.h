@@ -4,18 +4,51 @@
 
 #ifndef LEAF_HEADER
 #define LEAF_HEADER
+
+// glibc only declares dl_iterate_phdr() and RTLD_DEFAULT with _GNU_SOURCE,
+// which has to be set before the first system header is included
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <elf.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <stdio.h>
+
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "andrleaf.h must be included before any system header, or with _GNU_SOURCE defined"
+#endif
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#else
+// Allows building Leaf on a desktop, e.g. for testing the loader
+#define ANDROID_LOG_INFO 4
+#define __android_log_print(prio, tag, ...) fprintf(stderr, __VA_ARGS__)
+#endif
 
 #if defined(__arm__) || defined(__i386__)
 #define LEAF_32BIT
 #endif
 
+#if defined(__aarch64__)
+#define LEAF_CURRENT_MACHINE EM_AARCH64
+#elif defined(__arm__)
+#define LEAF_CURRENT_MACHINE EM_ARM
+#elif defined(__x86_64__)
+#define LEAF_CURRENT_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define LEAF_CURRENT_MACHINE EM_386
+#endif
+
 #ifdef LEAF_32BIT
 #define LEAF_CURRENT_CLASS 1
 #define LeafEhdr Elf32_Ehdr
@@ -44,6 +77,39 @@
 #define LeafSymBind(i) (i >> 4)
 #define LeafSymType(i) (i & 0xf)
 
+// Map code aligned to and advised for transparent hugepages
+#define LEAF_FLAG_HUGEPAGES 1
+
+#define LEAF_HUGEPAGE_SIZE 0x200000
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+typedef struct LeafTimings {
+	uint64_t map_ns;
+	uint64_t copy_ns;
+	uint64_t deps_ns;
+	uint64_t imports_ns;
+	uint64_t symbols_ns;
+	uint64_t relocs_ns;
+	uint64_t init_ns;
+	uint64_t *init_func_ns;
+	size_t init_func_count;
+} LeafTimings;
+
+typedef struct LeafAddrIndexEntry {
+	LeafAddr addr;
+	LeafAddr size;
+	const char *name;
+} LeafAddrIndexEntry;
+
+typedef struct LeafInterpose {
+	char *symbol_name;
+	void *replacement;
+	void **orig;
+} LeafInterpose;
+
 typedef struct Leaf {
 	LeafEhdr *ehdr;
 	LeafPhdr **phdrs;
@@ -56,6 +122,20 @@ typedef struct Leaf {
 	size_t sym_count;
 	void **fini_array;
 	size_t fini_count;
+	LeafTimings timings;
+	LeafAddrIndexEntry *addr_index;
+	size_t addr_index_count;
+	int flags;
+	const uint32_t *prefault_pages;
+	size_t prefault_count;
+	void *relocs;
+	size_t reloc_count;
+	void *plt_relocs;
+	size_t plt_reloc_count;
+	bool relocs_are_rela;
+	bool relocated;
+	LeafInterpose *interposes;
+	size_t interpose_count;
 } Leaf;
 
 typedef struct LeafStream {
@@ -67,8 +147,13 @@ typedef struct LeafStream {
 Leaf *LeafInit(void);
 const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length);
 const char *LeafLoadFromFile(Leaf *self, const char *path);
+void LeafSetPrefaultPages(Leaf *self, const uint32_t *pages, size_t count);
+size_t LeafRecordHotPages(Leaf *self, uint32_t **pages);
 void *LeafSymbolAddr(Leaf *self, const char *symbol_name);
 LeafSym *LeafSymbolInfo(Leaf *self, const char *symbol_name);
+bool LeafInterposeImport(Leaf *self, const char *symbol_name, void *replacement, void **orig);
+bool LeafBuildAddrIndex(Leaf *self);
+const char *LeafSymbolForAddr(Leaf *self, void *addr, size_t *offset);
 void LeafFree(Leaf *self);
 
 #ifdef LEAF_IMPLEMENTATION
@@ -125,10 +210,6 @@ static void *LeafStreamRead(LeafStream *self, size_t count) {
 	return data;
 }
 
-static size_t LeafStreamGetpos(LeafStream *self) {
-	return self->pos;
-}
-
 static void *LeafStreamGetptr(LeafStream *self) {
 	return self->data + self->pos;
 }
@@ -149,6 +230,327 @@ static int Leaf__cxa_atexit(void (*func)(void *), void *arg, void *dso_handle) {
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Import resolution
+////////////////////
+
+static uint64_t LeafTimeNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct LeafExports {
+	size_t base;
+	const char *strtab;
+	LeafSym *symtab;
+	const uint16_t *versym;
+	const uint32_t *gnu_hash;
+	const uint32_t *sysv_hash;
+} LeafExports;
+
+typedef struct LeafExportsSearch {
+	const char *soname;
+	LeafExports *exports;
+} LeafExportsSearch;
+
+static uint32_t LeafGnuHash(const char *name) {
+	uint32_t hash = 5381;
+	
+	for (; *name; name++) {
+		hash = (hash << 5) + hash + (uint8_t) *name;
+	}
+	
+	return hash;
+}
+
+static uint32_t LeafSysvHash(const char *name) {
+	uint32_t hash = 0;
+	
+	for (; *name; name++) {
+		hash = (hash << 4) + (uint8_t) *name;
+		uint32_t high = hash & 0xf0000000;
+		hash ^= high >> 24;
+		hash &= ~high;
+	}
+	
+	return hash;
+}
+
+static size_t LeafGnuHashSymCount(const uint32_t *table) {
+	/**
+	 * DT_GNU_HASH doesn't store the number of symbols, so find the highest
+	 * bucket and walk its chain until the end marker.
+	 */
+	
+	uint32_t nbuckets = table[0];
+	uint32_t symoffset = table[1];
+	const LeafAddr *bloom = (const LeafAddr *) &table[4];
+	const uint32_t *buckets = (const uint32_t *) &bloom[table[2]];
+	const uint32_t *chain = &buckets[nbuckets];
+	
+	uint32_t last = 0;
+	
+	for (uint32_t i = 0; i < nbuckets; i++) {
+		if (buckets[i] > last) {
+			last = buckets[i];
+		}
+	}
+	
+	if (last < symoffset) {
+		return symoffset;
+	}
+	
+	while (!(chain[last - symoffset] & 1)) {
+		last++;
+	}
+	
+	return last + 1;
+}
+
+static int LeafFindExportsCallback(struct dl_phdr_info *info, size_t size, void *data) {
+	/**
+	 * dl_iterate_phdr() callback which fills in the export tables of the
+	 * library named by the LeafExportsSearch.
+	 */
+	
+	LeafExportsSearch *search = data;
+	
+	if (!info->dlpi_name) {
+		return 0;
+	}
+	
+	const char *basename = strrchr(info->dlpi_name, '/');
+	basename = basename ? basename + 1 : info->dlpi_name;
+	
+	if (strcmp(basename, search->soname)) {
+		return 0;
+	}
+	
+	const ElfW(Phdr) *dynamic = NULL;
+	
+	for (size_t i = 0; i < info->dlpi_phnum; i++) {
+		if (info->dlpi_phdr[i].p_type == PT_DYNAMIC) {
+			dynamic = &info->dlpi_phdr[i];
+		}
+	}
+	
+	if (!dynamic) {
+		return 0;
+	}
+	
+	LeafDyn *dyns = (LeafDyn *) (info->dlpi_addr + dynamic->p_vaddr);
+	size_t base = info->dlpi_addr;
+	LeafExports *exports = search->exports;
+	
+	// bionic and musl leave d_ptr as the unrelocated address. glibc adds the
+	// load bias in place, but only when the dynamic section is writable and
+	// never on MIPS or RISC-V, where it is always read only.
+#if defined(__GLIBC__) && !defined(__mips__) && !defined(__riscv)
+	size_t bias = (dynamic->p_flags & PF_W) ? 0 : base;
+#else
+	size_t bias = base;
+#endif
+	
+	#define LEAF_DYN_PTR(ptr) ((void *) (bias + (ptr)))
+	
+	for (size_t i = 0; dyns[i].d_tag != DT_NULL; i++) {
+		switch (dyns[i].d_tag) {
+			case DT_STRTAB: exports->strtab = LEAF_DYN_PTR(dyns[i].d_un.d_ptr); break;
+			case DT_SYMTAB: exports->symtab = LEAF_DYN_PTR(dyns[i].d_un.d_ptr); break;
+			case DT_VERSYM: exports->versym = LEAF_DYN_PTR(dyns[i].d_un.d_ptr); break;
+			case DT_GNU_HASH: exports->gnu_hash = LEAF_DYN_PTR(dyns[i].d_un.d_ptr); break;
+			case DT_HASH: exports->sysv_hash = LEAF_DYN_PTR(dyns[i].d_un.d_ptr); break;
+			default: break;
+		}
+	}
+	
+	#undef LEAF_DYN_PTR
+	
+	exports->base = base;
+	
+	return 1;
+}
+
+static LeafSym *LeafExportsCheck(LeafExports *self, size_t index, const char *symbol_name) {
+	/**
+	 * Return symbol `index` if it is a visible definition of `symbol_name`,
+	 * otherwise NULL.
+	 */
+	
+	LeafSym *sym = &self->symtab[index];
+	
+	if (sym->st_shndx == SHN_UNDEF || strcmp(self->strtab + sym->st_name, symbol_name)) {
+		return NULL;
+	}
+	
+	if (LeafSymBind(sym->st_info) != STB_GLOBAL && LeafSymBind(sym->st_info) != STB_WEAK) {
+		return NULL;
+	}
+	
+	// skip local and hidden (non-default) versions like dlsym() does
+	if (self->versym && (self->versym[index] == 0 || (self->versym[index] & 0x8000))) {
+		return NULL;
+	}
+	
+	return sym;
+}
+
+static LeafSym *LeafExportsLookup(LeafExports *self, const char *symbol_name, uint32_t gnu_hash, uint32_t sysv_hash) {
+	/**
+	 * Look up a symbol using the library's own hash tables, which is what the
+	 * dynamic linker would do for us minus the locking and namespace walking.
+	 * Returns the library's definition of the symbol, or NULL if it has none.
+	 */
+	
+	if (self->gnu_hash) {
+		const uint32_t *table = self->gnu_hash;
+		uint32_t nbuckets = table[0];
+		uint32_t symoffset = table[1];
+		uint32_t bloom_size = table[2];
+		uint32_t bloom_shift = table[3];
+		const LeafAddr *bloom = (const LeafAddr *) &table[4];
+		const uint32_t *buckets = (const uint32_t *) &bloom[bloom_size];
+		const uint32_t *chain = &buckets[nbuckets];
+		
+		const size_t word_bits = sizeof(LeafAddr) * 8;
+		LeafAddr word = bloom[(gnu_hash / word_bits) & (bloom_size - 1)];
+		LeafAddr mask = ((LeafAddr) 1 << (gnu_hash % word_bits)) | ((LeafAddr) 1 << ((gnu_hash >> bloom_shift) % word_bits));
+		
+		if ((word & mask) != mask) {
+			return NULL;
+		}
+		
+		uint32_t index = buckets[gnu_hash % nbuckets];
+		
+		if (index < symoffset) {
+			return NULL;
+		}
+		
+		for (;; index++) {
+			uint32_t hash = chain[index - symoffset];
+			
+			if ((hash | 1) == (gnu_hash | 1)) {
+				LeafSym *value = LeafExportsCheck(self, index, symbol_name);
+				
+				if (value) {
+					return value;
+				}
+			}
+			
+			if (hash & 1) {
+				return NULL;
+			}
+		}
+	}
+	else if (self->sysv_hash) {
+		uint32_t nbucket = self->sysv_hash[0];
+		const uint32_t *buckets = &self->sysv_hash[2];
+		const uint32_t *chain = &buckets[nbucket];
+		
+		for (uint32_t index = buckets[sysv_hash % nbucket]; index != STN_UNDEF; index = chain[index]) {
+			LeafSym *value = LeafExportsCheck(self, index, symbol_name);
+			
+			if (value) {
+				return value;
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+static void LeafResolveImports(Leaf *self, const char **sonames) {
+	/**
+	 * Resolve all SHN_UNDEF symbols in one pass. Each name is hashed once and
+	 * then checked against the export tables of every dependency, in DT_NEEDED
+	 * order so the first library to define a symbol wins. dlsym() is only
+	 * used for libraries without hash tables, IFUNC and TLS symbols, and
+	 * symbols that none of the dependencies define themselves.
+	 */
+	
+	uint64_t start = LeafTimeNs();
+	
+	LeafExports *exports = calloc(self->dl_handle_count, sizeof *exports);
+	
+	if (exports) {
+		for (size_t i = 0; i < self->dl_handle_count; i++) {
+			if (self->dl_handles[i]) {
+				LeafExportsSearch search = { .soname = sonames[i], .exports = &exports[i] };
+				dl_iterate_phdr(LeafFindExportsCallback, &search);
+			}
+		}
+	}
+	
+	size_t import_count = 0;
+	size_t unresolved_count = 0;
+	
+	for (size_t i = 1; i < self->sym_count; i++) {
+		LeafSym *sym = &self->symtab[i];
+		
+		if (sym->st_shndx != SHN_UNDEF) {
+			continue;
+		}
+		
+		const char *symbol_name = self->strtab + sym->st_name;
+		uint32_t gnu_hash = LeafGnuHash(symbol_name);
+		uint32_t sysv_hash = LeafSysvHash(symbol_name);
+		void *symbol_value = NULL;
+		
+		import_count++;
+		
+		for (size_t j = 0; j < self->dl_handle_count; j++) {
+			if (!self->dl_handles[j]) {
+				continue;
+			}
+			
+			if (exports && exports[j].symtab && (exports[j].gnu_hash || exports[j].sysv_hash)) {
+				LeafSym *def = LeafExportsLookup(&exports[j], symbol_name, gnu_hash, sysv_hash);
+				
+				if (!def) {
+					continue;
+				}
+				
+				// The first library to define it wins even if it needs the
+				// dynamic linker to work out the address, e.g. to run an
+				// IFUNC resolver
+				if (LeafSymType(def->st_info) == STT_GNU_IFUNC || LeafSymType(def->st_info) == STT_TLS) {
+					symbol_value = dlsym(self->dl_handles[j], symbol_name);
+				}
+				else {
+					symbol_value = (void *) (exports[j].base + def->st_value);
+				}
+				
+				break;
+			}
+			
+			symbol_value = dlsym(self->dl_handles[j], symbol_name);
+			
+			if (symbol_value) {
+				break;
+			}
+		}
+		
+		// Symbols from dependencies of dependencies. Every dependency is
+		// loaded RTLD_GLOBAL, so one lookup in the global scope covers them.
+		if (!symbol_value) {
+			symbol_value = dlsym(RTLD_DEFAULT, symbol_name);
+		}
+		
+		if (symbol_value) {
+			sym->st_value = (LeafAddr) symbol_value;
+		}
+		else {
+			unresolved_count++;
+			__android_log_print(ANDROID_LOG_INFO, "leaflib", "Warning: External symbol named '%s' not found.\n", symbol_name);
+		}
+	}
+	
+	free(exports);
+	
+	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Resolved %zu imports in %.3f ms, %zu unresolved\n", import_count - unresolved_count, (LeafTimeNs() - start) / 1000000.0, unresolved_count);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Leaf itself
 //////////////
@@ -169,8 +571,149 @@ Leaf *LeafInit(void) {
 	return self;
 }
 
-static void *LeafMakeMap(size_t size) {
-	return mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+static void *LeafMakeMap(Leaf *self, size_t size) {
+	if (!(self->flags & LEAF_FLAG_HUGEPAGES)) {
+		return mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	
+	// Over-allocate so the start can be aligned to a hugepage, then give back
+	// the parts we don't need
+	size_t page_size = getpagesize();
+	size = (size + page_size - 1) & ~(page_size - 1);
+	
+	uint8_t *raw = mmap(NULL, size + LEAF_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (raw == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	
+	uint8_t *aligned = (uint8_t *) (((size_t) raw + LEAF_HUGEPAGE_SIZE - 1) & ~(LEAF_HUGEPAGE_SIZE - 1));
+	
+	if (aligned != raw) {
+		munmap(raw, aligned - raw);
+	}
+	
+	if (aligned + size != raw + size + LEAF_HUGEPAGE_SIZE) {
+		munmap(aligned + size, (raw + size + LEAF_HUGEPAGE_SIZE) - (aligned + size));
+	}
+	
+	return aligned;
+}
+
+static void LeafAdviseHugepages(Leaf *self) {
+	/**
+	 * Ask for hugepages over the executable segments. This has to happen before
+	 * they are copied in so the first faults can get hugepages directly.
+	 */
+	
+	size_t page_size = getpagesize();
+	
+	for (size_t i = 0; self->phdrs[i] != NULL; i++) {
+		LeafPhdr *phdr = self->phdrs[i];
+		
+		if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) {
+			continue;
+		}
+		
+		size_t start = phdr->p_vaddr & ~(LEAF_HUGEPAGE_SIZE - 1);
+		size_t end = (phdr->p_vaddr + phdr->p_memsz + page_size - 1) & ~(page_size - 1);
+		
+		if (madvise(self->blob + start, end - start, MADV_HUGEPAGE)) {
+			__android_log_print(ANDROID_LOG_INFO, "leaflib", "madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+		}
+		else {
+			__android_log_print(ANDROID_LOG_INFO, "leaflib", "Advised hugepages for 0x%zx - 0x%zx\n", start, end);
+		}
+	}
+}
+
+static bool LeafPageIsCopied(Leaf *self, size_t page_start, size_t page_size) {
+	/**
+	 * Check if the page at the given offset holds any file contents, in which
+	 * case copying the segments in will have already faulted it.
+	 */
+	
+	for (size_t i = 0; self->phdrs[i] != NULL; i++) {
+		LeafPhdr *phdr = self->phdrs[i];
+		
+		if (phdr->p_type == PT_LOAD && page_start < phdr->p_vaddr + phdr->p_filesz && page_start + page_size > phdr->p_vaddr) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static void LeafPrefaultPages(Leaf *self) {
+	/**
+	 * Touch the pages from the hot page list so they don't get faulted in for
+	 * the first time while the game is running.
+	 */
+	
+	size_t page_size = getpagesize();
+	size_t page_count = (self->blob_length + page_size - 1) / page_size;
+	size_t count = 0;
+	
+	for (size_t i = 0; i < self->prefault_count; i++) {
+		// Compared as an index, since the offset can overflow on 32-bit
+		if (self->prefault_pages[i] >= page_count) {
+			continue;
+		}
+		
+		// Write so we get a real page instead of the shared zero page
+		volatile uint8_t *page = self->blob + (size_t) self->prefault_pages[i] * page_size;
+		*page = *page;
+		count++;
+	}
+	
+	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Prefaulted %zu hot pages\n", count);
+}
+
+void LeafSetPrefaultPages(Leaf *self, const uint32_t *pages, size_t count) {
+	/**
+	 * Set the list of page indexes (offset from the start of the image divided
+	 * by the page size) to fault in while loading. Must be called before
+	 * loading and `pages` must stay valid until loading is done. These would
+	 * normally come from LeafRecordHotPages() on an earlier run.
+	 */
+	
+	self->prefault_pages = pages;
+	self->prefault_count = count;
+}
+
+size_t LeafRecordHotPages(Leaf *self, uint32_t **pages) {
+	/**
+	 * Record the pages that have been touched since loading, not counting ones
+	 * the loader touched itself while copying. The list is returned in `pages`
+	 * and must be free()'d. Returns the number of pages.
+	 */
+	
+	size_t page_size = getpagesize();
+	size_t page_count = (self->blob_length + page_size - 1) / page_size;
+	
+	unsigned char *resident = malloc(page_count);
+	uint32_t *list = malloc(page_count * sizeof *list);
+	
+	if (!resident || !list || mincore(self->blob, self->blob_length, (void *) resident)) {
+		free(resident);
+		free(list);
+		*pages = NULL;
+		return 0;
+	}
+	
+	size_t count = 0;
+	
+	for (size_t i = 0; i < page_count; i++) {
+		if ((resident[i] & 1) && !LeafPageIsCopied(self, i * page_size, page_size)) {
+			list[count++] = i;
+		}
+	}
+	
+	free(resident);
+	
+	*pages = list;
+	
+	return count;
 }
 
 uint8_t ELF_SIGNATURE[] = {0x7f, 'E', 'L', 'F'};
@@ -184,6 +727,8 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 	 * on success
 	 */
 	
+	uint64_t stage_start = LeafTimeNs();
+	
 	// Init a read stream
 	LeafStream *stream = LeafStreamInit(contents, length);
 	
@@ -214,7 +759,11 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 		return "Only loading shared objects is supported";
 	}
 	
-	// TODO: e_machine
+#ifdef LEAF_CURRENT_MACHINE
+	if (self->ehdr->e_machine != LEAF_CURRENT_MACHINE) {
+		return "Incorrect machine type for this platform";
+	}
+#endif
 	
 	// Program and section headers
 	size_t phoff = self->ehdr->e_phoff;
@@ -259,13 +808,20 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 	__android_log_print(ANDROID_LOG_INFO, "leaflib", "leaf: highest value = 0x%zx, mapping...\n", highest);
 	
 	// Map memory for loadable segments, copy their contents
-	self->blob = LeafMakeMap(highest);
+	self->blob = LeafMakeMap(self, highest);
 	self->blob_length = highest;
 	
 	if (self->blob == MAP_FAILED) {
 		return strerror(errno);
 	}
 	
+	if (self->flags & LEAF_FLAG_HUGEPAGES) {
+		LeafAdviseHugepages(self);
+	}
+	
+	self->timings.map_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
 	// load code, data, etc and also find location of dynamic symbol table
 	__android_log_print(ANDROID_LOG_INFO, "leaflib", "leaf: mapped at <%p>, copying...\n", self->blob);
 	
@@ -290,31 +846,36 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 		return "Failed to find dynamic info";
 	}
 	
+	if (self->prefault_pages) {
+		LeafPrefaultPages(self);
+	}
+	
+	self->timings.copy_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
 	// Get information from dynamic segment
 	// WARNING: Lots of unimplemented stuff here, only implemented what's from
 	// libsmashhit.so
 	// NOTE: try only to use things from the loaded blob now
 	const char *strtab = NULL;
-	size_t strtab_size;
 	
-	size_t reloc_types; // HACK the entire handling of reloc types is hacky
+	size_t reloc_types = 0; // HACK the entire handling of reloc types is hacky
 	
 	LeafRela *relocs = NULL;
-	size_t reloc_size;
-	size_t reloc_ent_size;
+	size_t reloc_size = 0;
+	size_t reloc_ent_size = 0;
 	
 	LeafRela *plt_relocs = NULL;
-	size_t plt_relocs_size;
+	size_t plt_relocs_size = 0;
 	
 	LeafSym *symtab = NULL;
 	size_t sym_count = 0;
-	size_t sym_ent_size;
 	
 	void **init_array = NULL;
-	size_t init_array_size;
+	size_t init_array_size = 0;
 	
 	void **fini_array = NULL;
-	size_t fini_array_size;
+	size_t fini_array_size = 0;
 	
 	for (size_t i = 0; dyns[i].d_tag != DT_NULL; i++) {
 		switch (dyns[i].d_tag) {
@@ -334,6 +895,14 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 				sym_count = ((Elf32_Word *)(self->blob + dyns[i].d_un.d_ptr))[1];
 				break;
 			}
+			case DT_GNU_HASH: {
+				// Desktop toolchains tend to only emit DT_GNU_HASH, prefer
+				// DT_HASH when both are there since it's cheaper
+				if (!sym_count) {
+					sym_count = LeafGnuHashSymCount(self->blob + dyns[i].d_un.d_ptr);
+				}
+				break;
+			}
 			case DT_STRTAB: {
 				strtab = self->blob + dyns[i].d_un.d_ptr;
 				break;
@@ -344,6 +913,7 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 			}
 			case DT_RELA: {
 				relocs = self->blob + dyns[i].d_un.d_ptr;
+				reloc_types = DT_RELA;
 				break;
 			}
 			case DT_RELASZ: {
@@ -354,12 +924,9 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 				reloc_ent_size = dyns[i].d_un.d_val;
 				break;
 			}
-			case DT_STRSZ: {
-				strtab_size = dyns[i].d_un.d_val;
-				break;
-			}
+			case DT_STRSZ:
 			case DT_SYMENT: {
-				sym_ent_size = dyns[i].d_un.d_val;
+				// Not needed, the symbols are found through the hash tables
 				break;
 			}
 			case DT_SYMBOLIC: {
@@ -368,6 +935,7 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 			}
 			case DT_REL: {
 				relocs = self->blob + dyns[i].d_un.d_ptr;
+				reloc_types = DT_REL;
 				break;
 			}
 			case DT_RELSZ: {
@@ -419,11 +987,14 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 	if (!strtab) { return "Could not find string table address"; }
 	if (!relocs) { return "Could not find relocs"; }
 	if (!symtab) { return "Could not find symbol table address"; }
-	if (!plt_relocs) { return "Could not find PLT relocs address"; }
-	if (!init_array) { return "Could not find init array address"; }
-	if (!fini_array) { return "Could not find fini array address"; }
 	if (!sym_count) { return "Could not find number of symbols"; }
 	
+	// These are all optional, libsmashhit has them but small libraries might
+	// not have anything to put in them
+	if (!plt_relocs) { __android_log_print(ANDROID_LOG_INFO, "leaflib", "No PLT relocs\n"); }
+	if (!init_array) { __android_log_print(ANDROID_LOG_INFO, "leaflib", "No init array\n"); }
+	if (!fini_array) { __android_log_print(ANDROID_LOG_INFO, "leaflib", "No fini array\n"); }
+	
 	// save stuff we might want later
 	self->strtab = strtab;
 	self->symtab = symtab;
@@ -436,17 +1007,34 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 		self->dl_handles[i] += (size_t)strtab;
 	}
 	
-	// Load dependent libraries
+	// Load dependent libraries, keeping the sonames around for finding their
+	// export tables later
+	const char **sonames = malloc(self->dl_handle_count * sizeof *sonames);
+	
+	if (self->dl_handle_count && !sonames) {
+		return "Failed to alloc soname array";
+	}
+	
 	for (size_t i = 0; i < self->dl_handle_count; i++) {
 		__android_log_print(ANDROID_LOG_INFO, "leaflib", "Dep lib soname: %s\n", (char *)self->dl_handles[i]);
+		sonames[i] = self->dl_handles[i];
 		self->dl_handles[i] = dlopen(self->dl_handles[i], RTLD_NOW | RTLD_GLOBAL);
 		if (!self->dl_handles[i]) {
 			__android_log_print(ANDROID_LOG_INFO, "leaflib", "Loading lib failed! Continuing anyways...\n");
 		}
 	}
 	
-	// Reloc everything in symbol table, load external symbols
-	// TODO
+	self->timings.deps_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
+	// Load external symbols
+	LeafResolveImports(self, sonames);
+	free(sonames);
+	
+	self->timings.imports_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
+	// Reloc everything else in symbol table
 	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Have %zd symbols, fixing up symbol table...\n", sym_count);
 	
 	for (size_t i = 1; i < sym_count; i++) {
@@ -463,31 +1051,7 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 				break;
 			}
 			case SHN_UNDEF: {
-				// resolve the symbol in the dumest way possible, also probably
-				// not technically correct since ELF has stricter ordering
-				// requirements than this but whateverthefuck.
-				const char *symbol_name = strtab + sym->st_name;
-				
-				// dlsym(NULL, symbol_name) would be smarter but not sure if
-				// that works in this case...
-				for (size_t j = 0; j < self->dl_handle_count; j++) {
-					if (self->dl_handles[j] != NULL) {
-						void *symbol_value = dlsym(self->dl_handles[j], symbol_name);
-						
-						if (symbol_value) {
-							sym->st_value = (LeafAddr) symbol_value;
-							break;
-						}
-					}
-				}
-				
-				if (sym->st_value) {
-					// __android_log_print(ANDROID_LOG_INFO, "leaflib", "Found symbol '%s' at <0x%zx>\n", symbol_name, sym->st_value);
-				}
-				else {
-					__android_log_print(ANDROID_LOG_INFO, "leaflib", "Warning: External symbol named '%s' not found.\n", symbol_name);
-				}
-				
+				// already done by LeafResolveImports()
 				break;
 			}
 			default: {
@@ -516,16 +1080,46 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 		__android_log_print(ANDROID_LOG_INFO, "leaflib", "Symbol __aeabi_atexit not found for replacement\n");
 	}
 	
+	// Interpositions that were asked for before loading
+	for (size_t i = 0; i < self->interpose_count; i++) {
+		LeafInterpose *interpose = &self->interposes[i];
+		
+		if (!LeafInterposeImport(self, interpose->symbol_name, interpose->replacement, interpose->orig)) {
+			__android_log_print(ANDROID_LOG_INFO, "leaflib", "Could not interpose '%s'\n", interpose->symbol_name);
+		}
+		
+		free(interpose->symbol_name);
+	}
+	
+	free(self->interposes);
+	self->interposes = NULL;
+	self->interpose_count = 0;
+	
 	// debug: basic dump of symbol table
 	// __android_log_print(ANDROID_LOG_INFO, "leaflib", "symbol table after relocs:\n");
 	// for (size_t i = 0; i < sym_count; i++) {
 	// 	__android_log_print(ANDROID_LOG_INFO, "leaflib", "[%04zu] 0x%016zx %s\n", i, symtab[i].st_value, strtab + symtab[i].st_name);
 	// }
 	
+	self->timings.symbols_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
 	// Preform relocations
+	// A library with only PLT relocations might not give the entry size
+	if (!reloc_ent_size) {
+		reloc_ent_size = reloc_types == DT_REL ? sizeof(LeafRel) : sizeof(LeafRela);
+	}
+	
 	size_t reloc_count = reloc_size / reloc_ent_size;
 	size_t plt_reloc_count = plt_relocs_size / reloc_ent_size;
 	
+	// Keep these around for LeafInterposeImport()
+	self->relocs = relocs;
+	self->reloc_count = reloc_count;
+	self->plt_relocs = plt_relocs;
+	self->plt_reloc_count = plt_reloc_count;
+	self->relocs_are_rela = reloc_types == DT_RELA;
+	
 	if (reloc_types == DT_RELA) {
 		__android_log_print(ANDROID_LOG_INFO, "leaflib", "Will preform %zu relocations (DT_RELA)...\n", reloc_count);
 		LeafDoRela(self, relocs, reloc_count);
@@ -539,22 +1133,38 @@ const char *LeafLoadFromBuffer(Leaf *self, void *contents, size_t length) {
 		LeafDoRel(self, (LeafRel*) plt_relocs, plt_reloc_count);
 	}
 	
+	self->relocated = true;
+	
+	self->timings.relocs_ns = LeafTimeNs() - stage_start;
+	stage_start = LeafTimeNs();
+	
 	// Call init functions
 	// TODO
 	size_t init_count = init_array_size / sizeof(void *);
 	
 	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Calling %zu init functions...\n", init_count);
 	
+	self->timings.init_func_ns = calloc(init_count, sizeof *self->timings.init_func_ns);
+	self->timings.init_func_count = self->timings.init_func_ns ? init_count : 0;
+	
 	for (size_t i = 0; i < init_count; i++) {
 		void (*func)(void) = ((void(**)(void)) init_array)[i];
 		
 		__android_log_print(ANDROID_LOG_INFO, "leaflib", "Func addr: <%p>\n", func);
 		
 		if (func) {
+			uint64_t func_start = LeafTimeNs();
+			
 			func();
+			
+			if (self->timings.init_func_ns) {
+				self->timings.init_func_ns[i] = LeafTimeNs() - func_start;
+			}
 		}
 	}
 	
+	self->timings.init_ns = LeafTimeNs() - stage_start;
+	
 	LeafStreamFree(stream); // TODO free if it fails
 	
 	return NULL;
@@ -581,6 +1191,30 @@ void LeafDoRela(Leaf *self, LeafRela *relocs, size_t reloc_count) {
 				*((size_t *)where) = sym->st_value + rela->r_addend;
 				break;
 			}
+#endif
+#ifdef __x86_64__
+			case R_X86_64_NONE: {
+				break;
+			}
+			case R_X86_64_RELATIVE: {
+				// B + A
+				void *result = self->blob + rela->r_addend;
+				*((void **)where) = result;
+				break;
+			}
+			case R_X86_64_GLOB_DAT:
+			case R_X86_64_JUMP_SLOT: {
+				// S
+				LeafSym *sym = &self->symtab[LeafRelocSym(rela->r_info)];
+				*((size_t *)where) = sym->st_value;
+				break;
+			}
+			case R_X86_64_64: {
+				// S + A
+				LeafSym *sym = &self->symtab[LeafRelocSym(rela->r_info)];
+				*((size_t *)where) = sym->st_value + rela->r_addend;
+				break;
+			}
 #endif
 			default: {
 				__android_log_print(ANDROID_LOG_INFO, "leaflib", "Unknown reloc type: offset=0x%zx sym=0x%zx type=0x%zx addend=0x%zx\n", rela->r_offset, LeafRelocSym(rela->r_info), LeafRelocType(rela->r_info), rela->r_addend);
@@ -594,7 +1228,9 @@ void LeafDoRel(Leaf *self, LeafRel *relocs, size_t reloc_count) {
 	for (size_t i = 0; i < reloc_count; i++) {
 		LeafRel *rel = &relocs[i];
 		
+		// Not used on x86_64, which only has RELA relocations
 		void *where = self->blob + rel->r_offset;
+		(void) where;
 		
 		switch (LeafRelocType(rel->r_info)) {
 			// TODO other arches
@@ -657,9 +1293,16 @@ const char *LeafLoadFromFile(Leaf *self, const char *path) {
 		return "Could not open file";
 	}
 	
-	fseek(file, 0, SEEK_END);
-	long length = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	long length = -1;
+	
+	if (!fseek(file, 0, SEEK_END)) {
+		length = ftell(file);
+	}
+	
+	if (length <= 0 || fseek(file, 0, SEEK_SET)) {
+		fclose(file);
+		return "Could not get file size";
+	}
 	
 	uint8_t *data = malloc(length);
 	
@@ -668,7 +1311,7 @@ const char *LeafLoadFromFile(Leaf *self, const char *path) {
 		return "Failed to allocate data";
 	}
 	
-	if (fread(data, 1, length, file) != length) {
+	if (fread(data, 1, length, file) != (size_t) length) {
 		fclose(file); free(data);
 		return "Failed to read data";
 	}
@@ -714,6 +1357,212 @@ LeafSym *LeafSymbolInfo(Leaf *self, const char *symbol_name) {
 	return NULL;
 }
 
+static int LeafAddrIndexCompare(const void *a, const void *b) {
+	const LeafAddrIndexEntry *x = a, *y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+bool LeafBuildAddrIndex(Leaf *self) {
+	/**
+	 * Build the sorted address -> symbol index used by LeafSymbolForAddr().
+	 * Only needs to be done once, returns true if the index is available.
+	 */
+	
+	if (self->addr_index) {
+		return true;
+	}
+	
+	LeafAddrIndexEntry *index = malloc(self->sym_count * sizeof *index);
+	
+	if (!index) {
+		return false;
+	}
+	
+	size_t count = 0;
+	LeafAddr blob_start = (LeafAddr) self->blob;
+	LeafAddr blob_end = blob_start + self->blob_length;
+	
+	for (size_t i = 1; i < self->sym_count; i++) {
+		LeafSym *sym = &self->symtab[i];
+		int type = LeafSymType(sym->st_info);
+		
+		// only things defined in our own image, which excludes imports
+		if (sym->st_value < blob_start || sym->st_value >= blob_end) {
+			continue;
+		}
+		
+		if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE) {
+			continue;
+		}
+		
+		index[count].addr = sym->st_value;
+		index[count].size = sym->st_size;
+		index[count].name = self->strtab + sym->st_name;
+		count++;
+	}
+	
+	qsort(index, count, sizeof *index, LeafAddrIndexCompare);
+	
+	// Publish the count before the pointer so that a signal handler never sees
+	// a half built index
+	self->addr_index_count = count;
+	__atomic_store_n(&self->addr_index, index, __ATOMIC_RELEASE);
+	
+	return true;
+}
+
+const char *LeafSymbolForAddr(Leaf *self, void *addr, size_t *offset) {
+	/**
+	 * Find the name of the symbol containing `addr`, writing the offset of addr
+	 * from the start of the symbol to `offset` if it isn't NULL. Returns NULL
+	 * if no symbol covers the address.
+	 * 
+	 * This builds the index on first use. Once it has been built (see
+	 * LeafBuildAddrIndex()) this doesn't allocate or lock, so it's safe to call
+	 * from a signal handler.
+	 */
+	
+	LeafAddr target = (LeafAddr) addr;
+	
+	// Symbols without a size would otherwise match anything past them
+	if (target < (LeafAddr) self->blob || target >= (LeafAddr) self->blob + self->blob_length) {
+		return NULL;
+	}
+	
+	LeafAddrIndexEntry *index = __atomic_load_n(&self->addr_index, __ATOMIC_ACQUIRE);
+	
+	if (!index) {
+		if (!LeafBuildAddrIndex(self)) {
+			return NULL;
+		}
+		
+		index = self->addr_index;
+	}
+	
+	// Find the last entry starting at or before the target
+	size_t low = 0, high = self->addr_index_count;
+	
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		
+		if (index[mid].addr <= target) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	
+	if (low == 0) {
+		return NULL;
+	}
+	
+	LeafAddrIndexEntry *entry = &index[low - 1];
+	
+	// Sized symbols have to actually contain the address, ones without a size
+	// are taken to extend up to the next symbol
+	if (entry->size && target >= entry->addr + entry->size) {
+		return NULL;
+	}
+	
+	if (offset) {
+		*offset = target - entry->addr;
+	}
+	
+	return entry->name;
+}
+
+static void LeafRepointSlots(Leaf *self, void *relocs, size_t reloc_count, size_t sym_index, size_t delta) {
+	/**
+	 * Move every slot relocated against the given symbol by `delta`. Since
+	 * these are all some form of S + A, this works the same for REL and RELA
+	 * without needing to know the addend.
+	 */
+	
+	for (size_t i = 0; i < reloc_count; i++) {
+		size_t offset, info;
+		
+		if (self->relocs_are_rela) {
+			offset = ((LeafRela *) relocs)[i].r_offset;
+			info = ((LeafRela *) relocs)[i].r_info;
+		}
+		else {
+			offset = ((LeafRel *) relocs)[i].r_offset;
+			info = ((LeafRel *) relocs)[i].r_info;
+		}
+		
+		if (LeafRelocSym(info) != sym_index) {
+			continue;
+		}
+		
+		size_t *slot = self->blob + offset;
+		__atomic_store_n(slot, *slot + delta, __ATOMIC_RELEASE);
+	}
+}
+
+bool LeafInterposeImport(Leaf *self, const char *symbol_name, void *replacement, void **orig) {
+	/**
+	 * Make calls from the loaded binary to the imported function (or uses of
+	 * the imported data) `symbol_name` go to `replacement` instead. If `orig`
+	 * isn't NULL, the address the import originally resolved to is written to
+	 * it.
+	 * 
+	 * This only swaps GOT/PLT pointers, so it doesn't cost anything at call
+	 * time. It can be used before loading, in which case it is applied when
+	 * the imports are resolved and `orig` must stay valid until then, or after
+	 * loading, in which case the GOT is patched in place. Returns false if the
+	 * symbol isn't an import of the binary.
+	 */
+	
+	if (!self->symtab) {
+		LeafInterpose *interposes = realloc(self->interposes, (self->interpose_count + 1) * sizeof *interposes);
+		
+		if (!interposes) {
+			return false;
+		}
+		
+		self->interposes = interposes;
+		
+		LeafInterpose *interpose = &self->interposes[self->interpose_count];
+		interpose->symbol_name = strdup(symbol_name);
+		interpose->replacement = replacement;
+		interpose->orig = orig;
+		
+		if (!interpose->symbol_name) {
+			return false;
+		}
+		
+		self->interpose_count += 1;
+		
+		return true;
+	}
+	
+	LeafSym *sym = LeafSymbolInfo(self, symbol_name);
+	
+	if (!sym || sym->st_shndx != SHN_UNDEF) {
+		return false;
+	}
+	
+	void *original = (void *) sym->st_value;
+	
+	if (orig) {
+		*orig = original;
+	}
+	
+	// Anything relocated from now on will pick up the new value
+	sym->st_value = (LeafAddr) replacement;
+	
+	if (self->relocated) {
+		size_t sym_index = sym - self->symtab;
+		size_t delta = (size_t) replacement - (size_t) original;
+		
+		LeafRepointSlots(self, self->relocs, self->reloc_count, sym_index, delta);
+		LeafRepointSlots(self, self->plt_relocs, self->plt_reloc_count, sym_index, delta);
+	}
+	
+	return true;
+}
+
 void LeafFinish(Leaf *self) {
 	/**
 	 * Use LeafFree() unless you are probably just going to rely on exiting the
@@ -721,7 +1570,7 @@ void LeafFinish(Leaf *self) {
 	 * with a global variable.
 	 */
 	
-	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Calling %d fini functions...", self->fini_count);
+	__android_log_print(ANDROID_LOG_INFO, "leaflib", "Calling %zu fini functions...", self->fini_count);
 	
 	// remember: run them backwards
 	for (size_t i = 1; i <= self->fini_count; i++) {
@@ -759,6 +1608,9 @@ void LeafFree(Leaf *self) {
 	
 	free(self->phdrs);
 	
+	free(self->timings.init_func_ns);
+	free(self->addr_index);
+	
 	// Everything else is just a pointer to something in the loaded program
 	// memory...
 	
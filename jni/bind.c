@@ -0,0 +1,149 @@
+/**
+ * Calling native functions from Lua without writing a wrapper for each one.
+ * The signature is worked out once when the function is bound, so calls only
+ * have to convert the arguments and make the call.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+#define KN_BIND_MAX_ARGS 8
+
+#if defined(__aarch64__) || defined(__x86_64__)
+// Integers and floats are passed in separate sets of registers, so passing
+// eight of each puts every argument where the function expects it whatever
+// order they're in
+#define KN_BIND_SPLIT_FLOATS 1
+#define KN_BIND_CALL_ARGS ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], ints[6], ints[7], floats[0], floats[1], floats[2], floats[3], floats[4], floats[5], floats[6], floats[7]
+typedef uintptr_t (*KNBoundIntFunc)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, float, float, float, float, float, float, float, float);
+typedef float (*KNBoundFloatFunc)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, float, float, float, float, float, float, float, float);
+#else
+// On armeabi-v7a (softfp) and x86 every argument is one word in the core
+// registers or on the stack, in order, floats included
+#define KN_BIND_SPLIT_FLOATS 0
+#define KN_BIND_CALL_ARGS ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], ints[6], ints[7]
+typedef uintptr_t (*KNBoundIntFunc)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+typedef float (*KNBoundFloatFunc)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+#endif
+
+typedef struct KNBoundArg {
+	char type;
+	uint8_t slot; // Index into the integer or float arguments
+} KNBoundArg;
+
+typedef struct KNBoundFunc {
+	void *func;
+	char ret;
+	size_t arg_count;
+	KNBoundArg args[KN_BIND_MAX_ARGS];
+} KNBoundFunc;
+
+static int knCallBound(lua_State *script) {
+	/**
+	 * The closure returned by knBindFunction().
+	 */
+	
+	KNBoundFunc *bound = lua_touserdata(script, lua_upvalueindex(1));
+	uintptr_t ints[KN_BIND_MAX_ARGS] = { 0 };
+	float floats[KN_BIND_MAX_ARGS] = { 0 };
+	
+	for (size_t i = 0; i < bound->arg_count; i++) {
+		KNBoundArg *arg = &bound->args[i];
+		
+		switch (arg->type) {
+			case 'i':
+				ints[arg->slot] = (uintptr_t) (int32_t) lua_tointeger(script, i + 1);
+				break;
+			case 'p':
+				ints[arg->slot] = (uintptr_t) lua_tointeger(script, i + 1);
+				break;
+			case 'b':
+				ints[arg->slot] = lua_toboolean(script, i + 1);
+				break;
+			case 'f':
+#if KN_BIND_SPLIT_FLOATS
+				floats[arg->slot] = lua_tonumber(script, i + 1);
+#else
+				floats[0] = lua_tonumber(script, i + 1);
+				memcpy(&ints[arg->slot], &floats[0], sizeof(float));
+#endif
+				break;
+		}
+	}
+	
+	if (bound->ret == 'f') {
+		lua_pushnumber(script, ((KNBoundFloatFunc) bound->func)(KN_BIND_CALL_ARGS));
+		return 1;
+	}
+	
+	uintptr_t result = ((KNBoundIntFunc) bound->func)(KN_BIND_CALL_ARGS);
+	
+	switch (bound->ret) {
+		case 'i':
+			lua_pushinteger(script, (int32_t) result);
+			return 1;
+		case 'p':
+			lua_pushinteger(script, result);
+			return 1;
+		case 'b':
+			lua_pushboolean(script, (uint8_t) result);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+int knBindFunction(lua_State *script) {
+	/**
+	 * (function|nil) func = knBindFunction(symbolOrAddr, signature)
+	 * 
+	 * Return a Lua function that calls the native function with the given
+	 * symbol or address, converting its arguments and return value according
+	 * to `signature` (see knHook for the format).
+	 */
+	
+	void *func = lua_type(script, 1) == LUA_TSTRING ? KNGetSymbolAddr(lua_tostring(script, 1)) : (void *) lua_tointeger(script, 1);
+	const char *signature = lua_tostring(script, 2);
+	char ret, args[KN_BIND_MAX_ARGS];
+	size_t arg_count;
+	
+	if (!func || !signature || !KNParseSignature(signature, &ret, args, &arg_count, KN_BIND_MAX_ARGS)) {
+		knReturnNil(script);
+	}
+	
+	KNBoundFunc *bound = lua_newuserdata(script, sizeof *bound);
+	bound->func = func;
+	bound->ret = ret;
+	bound->arg_count = arg_count;
+	
+	// Work out where each argument goes now instead of on every call
+	uint8_t next_int = 0, next_float = 0;
+	
+	for (size_t i = 0; i < arg_count; i++) {
+		bound->args[i].type = args[i];
+		
+		if (KN_BIND_SPLIT_FLOATS && args[i] == 'f') {
+			bound->args[i].slot = next_float++;
+		}
+		else {
+			bound->args[i].slot = next_int++;
+		}
+	}
+	
+	lua_pushcclosure(script, knCallBound, 1);
+	return 1;
+}
+
+int knEnableBind(lua_State *script) {
+	knRegisterFunc(script, knBindFunction);
+	
+	return 0;
+}
@@ -0,0 +1,516 @@
+/**
+ * Growable byte buffers, for building up strings a piece at a time without
+ * Lua copying the whole thing for every piece.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+#define KN_BUFFER_MAGIC ('K' | ('N' << 8) | ('B' << 16) | ('F' << 24))
+#define KN_BUFFER_MAX_SPEC 32
+
+struct KNBuffer {
+	uint32_t magic;
+	char *data;
+	size_t size;
+	size_t alloced;
+};
+
+// Address used as the registry key for the buffer metatable
+static char gBufferMetatableKey;
+
+KNBuffer *KNToBuffer(lua_State *script, int index) {
+	KNBuffer *buffer = lua_touserdata(script, index);
+	
+	if (!buffer || lua_objlen(script, index) != sizeof *buffer || buffer->magic != KN_BUFFER_MAGIC) {
+		return NULL;
+	}
+	
+	return buffer;
+}
+
+const char *KNToBytes(lua_State *script, int index, size_t *size) {
+	/**
+	 * Get the bytes of a buffer or a string (or number) on the stack, or NULL
+	 * if it's neither. For passing buffers to anything that takes a string
+	 * without making one first.
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, index);
+	
+	if (buffer) {
+		*size = buffer->size;
+		return buffer->data ? buffer->data : "";
+	}
+	
+	return lua_tolstring(script, index, size);
+}
+
+char *KNBufferDetach(KNBuffer *buffer, size_t *size, size_t *alloced) {
+	/**
+	 * Take the memory of a buffer, leaving it empty. Used to send buffers to
+	 * workers without copying them.
+	 */
+	
+	char *data = buffer->data;
+	*size = buffer->size;
+	*alloced = buffer->alloced;
+	
+	buffer->data = NULL;
+	buffer->size = 0;
+	buffer->alloced = 0;
+	
+	return data;
+}
+
+void KNPushBuffer(lua_State *script, char *data, size_t size, size_t alloced) {
+	/**
+	 * Push a new buffer that owns `data`, which was allocated with malloc().
+	 * KNOpenBuffers() has to have been called on the state first.
+	 */
+	
+	KNBuffer *buffer = lua_newuserdata(script, sizeof *buffer);
+	buffer->magic = KN_BUFFER_MAGIC;
+	buffer->data = data;
+	buffer->size = size;
+	buffer->alloced = alloced;
+	
+	lua_pushlightuserdata(script, &gBufferMetatableKey);
+	lua_rawget(script, LUA_REGISTRYINDEX);
+	lua_setmetatable(script, -2);
+}
+
+static char *KNBufferReserve(KNBuffer *buffer, size_t size) {
+	/**
+	 * Make sure there is space for `size` more bytes and return where they
+	 * go.
+	 */
+	
+	if (buffer->size + size > buffer->alloced) {
+		size_t alloced = buffer->alloced ? buffer->alloced : 64;
+		
+		while (alloced < buffer->size + size) {
+			alloced *= 2;
+		}
+		
+		char *data = realloc(buffer->data, alloced);
+		
+		if (!data) {
+			return NULL;
+		}
+		
+		buffer->data = data;
+		buffer->alloced = alloced;
+	}
+	
+	return buffer->data + buffer->size;
+}
+
+static bool KNBufferAppend(KNBuffer *buffer, const void *data, size_t size) {
+	/**
+	 * Add bytes to the end of the buffer. They can be from the buffer itself,
+	 * which might move when it grows.
+	 */
+	
+	const char *from = data;
+	bool inside = buffer->data && from >= buffer->data && from < buffer->data + buffer->size;
+	size_t offset = inside ? from - buffer->data : 0;
+	char *at = KNBufferReserve(buffer, size);
+	
+	if (!at) {
+		return false;
+	}
+	
+	memcpy(at, inside ? buffer->data + offset : from, size);
+	buffer->size += size;
+	
+	return true;
+}
+
+static bool KNBufferAppendFormatted(KNBuffer *buffer, const char *spec, ...) {
+	/**
+	 * snprintf() straight into the buffer.
+	 */
+	
+	va_list args;
+	va_start(args, spec);
+	char *at = KNBufferReserve(buffer, 64);
+	int length = at ? vsnprintf(at, 64, spec, args) : -1;
+	va_end(args);
+	
+	if (length >= 64) {
+		va_start(args, spec);
+		at = KNBufferReserve(buffer, length + 1);
+		length = at ? vsnprintf(at, length + 1, spec, args) : -1;
+		va_end(args);
+	}
+	
+	if (length < 0) {
+		return false;
+	}
+	
+	buffer->size += length;
+	return true;
+}
+
+int knBuffer(lua_State *script) {
+	/**
+	 * buffer = knBuffer([capacity])
+	 * 
+	 * Make a new empty buffer, with space for `capacity` bytes before it
+	 * needs to grow.
+	 */
+	
+	lua_Integer capacity = lua_tointeger(script, 1);
+	
+	KNPushBuffer(script, NULL, 0, 0);
+	
+	if (capacity > 0) {
+		KNBufferReserve(lua_touserdata(script, -1), capacity);
+	}
+	
+	return 1;
+}
+
+static int knBufferAppend(lua_State *script) {
+	/**
+	 * buffer = buffer:append(...)
+	 * 
+	 * Add each of the strings, numbers or other buffers passed to the end of
+	 * the buffer.
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	
+	if (!buffer) {
+		knReturnNil(script);
+	}
+	
+	for (int i = 2; i <= lua_gettop(script); i++) {
+		size_t size;
+		const char *data = KNToBytes(script, i, &size);
+		
+		if (!data || !KNBufferAppend(buffer, data, size)) {
+			knReturnNil(script);
+		}
+	}
+	
+	lua_settop(script, 1);
+	return 1;
+}
+
+static int knBufferAppendf(lua_State *script) {
+	/**
+	 * buffer = buffer:appendf(format, ...)
+	 * 
+	 * Like buffer:append(string.format(format, ...)), but formatted straight
+	 * into the buffer. Supports %d, %i, %u, %c, %x, %X, %o, %e, %E, %f, %g,
+	 * %G, %s and %% with the usual flags, width and precision.
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	const char *format = lua_tostring(script, 2);
+	
+	if (!buffer || !format) {
+		knReturnNil(script);
+	}
+	
+	int arg = 3;
+	size_t start = buffer->size;
+	
+	while (*format) {
+		const char *percent = strchr(format, '%');
+		
+		if (!percent) {
+			KNBufferAppend(buffer, format, strlen(format));
+			break;
+		}
+		
+		KNBufferAppend(buffer, format, percent - format);
+		
+		if (percent[1] == '%') {
+			KNBufferAppend(buffer, "%", 1);
+			format = percent + 2;
+			continue;
+		}
+		
+		// Copy the spec without its conversion, leaving space for "ll"
+		size_t length = strspn(percent + 1, "-+ #0123456789.") + 1;
+		char spec[KN_BUFFER_MAX_SPEC];
+		char conversion = percent[length];
+		
+		if (length + 3 >= sizeof spec || !conversion) {
+			knReturnNil(script);
+		}
+		
+		memcpy(spec, percent, length);
+		spec[length] = '\0';
+		format = percent + length + 1;
+		
+		bool success;
+		
+		switch (conversion) {
+			case 'd':
+			case 'i':
+			case 'c':
+				strcat(spec, conversion == 'c' ? "c" : "lld");
+				success = conversion == 'c' ? KNBufferAppendFormatted(buffer, spec, (int) lua_tonumber(script, arg)) : KNBufferAppendFormatted(buffer, spec, (long long) lua_tonumber(script, arg));
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				strcat(spec, "ll");
+				spec[length + 2] = conversion;
+				spec[length + 3] = '\0';
+				success = KNBufferAppendFormatted(buffer, spec, (unsigned long long) (long long) lua_tonumber(script, arg));
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'g':
+			case 'G':
+				spec[length] = conversion;
+				spec[length + 1] = '\0';
+				success = KNBufferAppendFormatted(buffer, spec, (double) lua_tonumber(script, arg));
+				break;
+			case 's': {
+				size_t size;
+				const char *data = KNToBytes(script, arg, &size);
+				
+				if (!data) {
+					knReturnNil(script);
+				}
+				
+				// The buffer itself is added as it was before this call
+				if (data == buffer->data) {
+					size = start;
+				}
+				
+				// Nothing to format, so it can be copied as is
+				if (length == 1) {
+					success = KNBufferAppend(buffer, data, size);
+				}
+				else {
+					// The buffer itself can't be formatted straight into itself,
+					// since it might move when it grows
+					if (data == buffer->data && size) {
+						lua_pushlstring(script, data, size);
+						lua_replace(script, arg);
+						data = lua_tolstring(script, arg, &size);
+					}
+					
+					// Buffers don't end in a NUL, so the size always has to
+					// be passed as the precision
+					char *precision = strchr(spec, '.');
+					
+					if (precision) {
+						size_t max = strtoul(precision + 1, NULL, 10);
+						size = size < max ? size : max;
+						*precision = '\0';
+					}
+					
+					strcat(spec, ".*s");
+					success = KNBufferAppendFormatted(buffer, spec, (int) size, data);
+				}
+				
+				break;
+			}
+			default:
+				knReturnNil(script);
+		}
+		
+		if (!success) {
+			knReturnNil(script);
+		}
+		
+		arg++;
+	}
+	
+	lua_settop(script, 1);
+	return 1;
+}
+
+static int knBufferPack(lua_State *script) {
+	/**
+	 * buffer = buffer:pack(format, ...)
+	 * 
+	 * Add numbers to the buffer in binary, in the byte order of the device.
+	 * Each character of `format` is the type of one number: b/B for a signed
+	 * or unsigned 8-bit integer, h/H for 16-bit, i/I for 32-bit, l/L for
+	 * 64-bit, f for a float and d for a double.
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	const char *format = lua_tostring(script, 2);
+	
+	if (!buffer || !format) {
+		knReturnNil(script);
+	}
+	
+	for (int arg = 3; *format; format++, arg++) {
+		lua_Number number = lua_tonumber(script, arg);
+		bool success;
+		
+		switch (*format) {
+			case 'b':
+			case 'B': {
+				uint8_t value = (int64_t) number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			case 'h':
+			case 'H': {
+				uint16_t value = (int64_t) number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			case 'i':
+			case 'I': {
+				uint32_t value = (int64_t) number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			case 'l':
+			case 'L': {
+				int64_t value = number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			case 'f': {
+				float value = number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			case 'd': {
+				double value = number;
+				success = KNBufferAppend(buffer, &value, sizeof value);
+				break;
+			}
+			default:
+				success = false;
+				break;
+		}
+		
+		if (!success) {
+			knReturnNil(script);
+		}
+	}
+	
+	lua_settop(script, 1);
+	return 1;
+}
+
+static int knBufferClear(lua_State *script) {
+	/**
+	 * buffer = buffer:clear()
+	 * 
+	 * Empty the buffer, keeping its memory to be reused.
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	
+	if (!buffer) {
+		knReturnNil(script);
+	}
+	
+	buffer->size = 0;
+	
+	lua_settop(script, 1);
+	return 1;
+}
+
+static int knBufferToString(lua_State *script) {
+	/**
+	 * string = buffer:tostring()
+	 * 
+	 * Get the contents of the buffer as a string. Also used by tostring().
+	 */
+	
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	
+	if (!buffer) {
+		knReturnNil(script);
+	}
+	
+	lua_pushlstring(script, buffer->data ? buffer->data : "", buffer->size);
+	return 1;
+}
+
+static int knBufferLength(lua_State *script) {
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	
+	lua_pushinteger(script, buffer ? buffer->size : 0);
+	return 1;
+}
+
+static int knBufferFree(lua_State *script) {
+	KNBuffer *buffer = KNToBuffer(script, 1);
+	
+	if (buffer) {
+		free(buffer->data);
+		buffer->data = NULL;
+		buffer->size = 0;
+		buffer->alloced = 0;
+	}
+	
+	return 0;
+}
+
+static void knSetMethod(lua_State *script, const char *name, lua_CFunction func, void (*settable)(lua_State *, int)) {
+	lua_pushstring(script, name);
+	lua_pushcfunction(script, func);
+	settable(script, -3);
+}
+
+void KNOpenBuffers(lua_State *script, void (*createtable)(lua_State *, int, int), void (*settable)(lua_State *, int)) {
+	/**
+	 * Make the metatable shared by every buffer in a state, if it doesn't have
+	 * one yet. The game's states need the game's table functions and workers
+	 * need ours.
+	 */
+	
+	lua_pushlightuserdata(script, &gBufferMetatableKey);
+	lua_rawget(script, LUA_REGISTRYINDEX);
+	bool exists = lua_istable(script, -1);
+	lua_pop(script, 1);
+	
+	if (exists) {
+		return;
+	}
+	
+	lua_pushlightuserdata(script, &gBufferMetatableKey);
+	createtable(script, 0, 4);
+	
+	knSetMethod(script, "__gc", knBufferFree, settable);
+	knSetMethod(script, "__len", knBufferLength, settable);
+	knSetMethod(script, "__tostring", knBufferToString, settable);
+	
+	lua_pushstring(script, "__index");
+	createtable(script, 0, 5);
+	knSetMethod(script, "append", knBufferAppend, settable);
+	knSetMethod(script, "appendf", knBufferAppendf, settable);
+	knSetMethod(script, "pack", knBufferPack, settable);
+	knSetMethod(script, "clear", knBufferClear, settable);
+	knSetMethod(script, "tostring", knBufferToString, settable);
+	settable(script, -3);
+	
+	settable(script, LUA_REGISTRYINDEX);
+}
+
+int knEnableBuffer(lua_State *script) {
+	knRegisterFunc(script, knBuffer);
+	KNOpenBuffers(script, KNLuaCreateTable, KNLuaSetTable);
+	
+	return 0;
+}
@@ -6,9 +6,11 @@
 #include "lua/lualib.h"
 #include "lua/lauxlib.h"
 
+#include "util.h"
+
 int knWriteFile(lua_State *script) {
 	/**
-	 * (nil|boolean) success = knWriteFile((string) path, (string) contents)
+	 * (nil|boolean) success = knWriteFile((string) path, (string|buffer) contents)
 	 * 
 	 * Write a files contents to the given path. Returns either nil or false on
 	 * failure or true on success.
@@ -20,7 +22,7 @@ int knWriteFile(lua_State *script) {
 	
 	const char *path = lua_tostring(script, 1);
 	size_t size;
-	const char *data = lua_tolstring(script, 2, &size);
+	const char *data = KNToBytes(script, 2, &size);
 	
 	if (!path || !data) {
 		return 0;
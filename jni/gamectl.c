@@ -66,15 +66,20 @@ int knGetStreak(lua_State *script) {
 	return 1;
 }
 
-shortop_t gNoclipBufferedInstruction = KN_RET;
+KNPatch *gNoclipPatch;
 
-#define NOCLIP_IS_ON (gNoclipBufferedInstruction != KN_RET)
+#define NOCLIP_IS_ON (gNoclipPatch != NULL)
 
 void swap_noclip_state(void) {
-	shortop_t *hitSomething = KNGetSymbolAddr("_ZN5Level12hitSomethingEi");
-	shortop_t currentInstr = hitSomething[0];
-	hitSomething[0] = gNoclipBufferedInstruction;
-	gNoclipBufferedInstruction = currentInstr;
+	if (gNoclipPatch) {
+		KNPatchRevert(gNoclipPatch);
+		gNoclipPatch = NULL;
+	}
+	else {
+		// Return from Level::hitSomething straight away
+		shortop_t ret = KN_RET;
+		gNoclipPatch = KNPatchApply(KNGetSymbolAddr("_ZN5Level12hitSomethingEi"), &ret, sizeof ret, "noclip");
+	}
 }
 
 int knSetNoclip(lua_State *script) {
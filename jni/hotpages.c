@@ -0,0 +1,136 @@
+/**
+ * Hot page profile for libsmashhit, which lets pages that would otherwise be
+ * touched for the first time during gameplay be faulted in while loading
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+#define KN_HOTPAGES_MAGIC ('K' | ('N' << 8) | ('H' << 16) | ('P' << 24))
+
+extern Leaf *gLeaf;
+
+char *gHotPagesPath;
+uint32_t *gHotPages;
+
+void KNHotPagesLoad(struct android_app *app, Leaf *leaf) {
+	/**
+	 * Load the hot page profile saved by an earlier run, if there is one, and
+	 * have Leaf prefault those pages.
+	 */
+	
+	const char *internal_path = app->activity->internalDataPath;
+	const char *base_path = "hotpages.kn";
+	
+	gHotPagesPath = malloc(strlen(internal_path) + 1 + strlen(base_path) + 1);
+	
+	if (!gHotPagesPath) {
+		return;
+	}
+	
+	strcpy(gHotPagesPath, internal_path);
+	strcat(gHotPagesPath, "/");
+	strcat(gHotPagesPath, base_path);
+	
+	FILE *file = fopen(gHotPagesPath, "rb");
+	
+	if (!file) {
+		return;
+	}
+	
+	uint32_t header[2];
+	long file_size = fseek(file, 0, SEEK_END) ? -1 : ftell(file);
+	
+	if (file_size < (long) sizeof header || fseek(file, 0, SEEK_SET) || fread(header, sizeof header, 1, file) != 1 || header[0] != KN_HOTPAGES_MAGIC) {
+		fclose(file);
+		return;
+	}
+	
+	// The count has to match the size of the file, which also keeps it small
+	// enough that the allocation can't overflow
+	size_t count = header[1];
+	
+	if (count > SIZE_MAX / sizeof *gHotPages || (uint64_t) count * sizeof *gHotPages != (uint64_t) file_size - sizeof header) {
+		__android_log_print(ANDROID_LOG_WARN, TAG, "Ignoring hot page profile with a bad page count");
+		fclose(file);
+		return;
+	}
+	
+	gHotPages = malloc(count * sizeof *gHotPages);
+	
+	if (gHotPages && fread(gHotPages, sizeof *gHotPages, count, file) == count) {
+		LeafSetPrefaultPages(leaf, gHotPages, count);
+	}
+	
+	fclose(file);
+}
+
+void KNHotPagesRelease(Leaf *leaf) {
+	/**
+	 * Free the hot page profile once Leaf is done loading with it.
+	 */
+	
+	LeafSetPrefaultPages(leaf, NULL, 0);
+	free(gHotPages);
+	gHotPages = NULL;
+}
+
+int knSaveHotPages(lua_State *script) {
+	/**
+	 * (int|nil) count = knSaveHotPages()
+	 * 
+	 * Record which pages of libsmashhit have been touched so far and save them
+	 * so they can be prefaulted on the next start. Returns the number of pages
+	 * saved or nil on failure.
+	 */
+	
+	if (!gHotPagesPath) {
+		knReturnNil(script);
+	}
+	
+	uint32_t *pages;
+	size_t count = LeafRecordHotPages(gLeaf, &pages);
+	
+	if (!pages) {
+		knReturnNil(script);
+	}
+	
+	FILE *file = fopen(gHotPagesPath, "wb");
+	
+	if (!file) {
+		free(pages);
+		knReturnNil(script);
+	}
+	
+	uint32_t header[2] = { KN_HOTPAGES_MAGIC, count };
+	bool error = fwrite(header, sizeof header, 1, file) != 1;
+	error |= fwrite(pages, sizeof *pages, count, file) != count;
+	
+	fclose(file);
+	free(pages);
+	
+	if (error) {
+		knReturnNil(script);
+	}
+	
+	__android_log_print(ANDROID_LOG_INFO, TAG, "Saved %zu hot pages", count);
+	
+	lua_pushinteger(script, count);
+	return 1;
+}
+
+int knEnableHotPages(lua_State *script) {
+	knRegisterFunc(script, knSaveHotPages);
+	
+	return 0;
+}
@@ -9,6 +9,8 @@
 #include "lua/lualib.h"
 #include "lua/lauxlib.h"
 
+#include "util.h"
+
 typedef struct {
     http_t *context;
 } knHttpContext;
@@ -46,7 +48,7 @@ int knHttpRequest(lua_State *script) {
     }
     else {
         size_t size = 0;
-        const char *body = lua_tolstring(script, 2, &size);
+        const char *body = KNToBytes(script, 2, &size);
         
         request = http_post(url, body, size, NULL);
     }
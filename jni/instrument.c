@@ -0,0 +1,372 @@
+/**
+ * Call counts and latency histograms for native functions, without having to
+ * write a hook for each one
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+#include "leafhook.h"
+
+// Threads past this many share shards, which is still correct since shards
+// are only ever updated atomically
+#define KN_INSTRUMENT_SHARDS 8
+#define KN_INSTRUMENT_BUCKETS 64
+
+// Calls nested deeper than this on one thread are counted but not timed
+#define KN_INSTRUMENT_MAX_DEPTH 64
+
+#if defined(__aarch64__)
+#define KN_NOP 0xd503201f
+#define KN_PROBE_RETURN(ctx) ((ctx)->x[30])
+#define KN_PROBE_PC(ctx) ((ctx)->pc)
+typedef uint32_t knnop_t;
+#elif defined(__arm__)
+#define KN_NOP 0xe320f000
+#define KN_PROBE_RETURN(ctx) ((ctx)->lr)
+#define KN_PROBE_PC(ctx) ((ctx)->pc)
+typedef uint32_t knnop_t;
+#else
+#define KN_NOP 0x90
+#define KN_PROBE_RETURN(ctx) (*(uintptr_t *) (ctx)->gpr[4])
+#define KN_PROBE_PC(ctx) ((ctx)->ip)
+typedef uint8_t knnop_t;
+#endif
+
+// Bucket n counts calls that took under 2^n ns, but at least 2^(n-1) ns
+typedef struct KNInstrumentShard {
+	uint64_t calls;
+	uint64_t timed_calls;
+	uint64_t total_ns;
+	uint64_t buckets[KN_INSTRUMENT_BUCKETS];
+} __attribute__((aligned(64))) KNInstrumentShard;
+
+typedef struct KNInstrumentedFunction {
+	struct KNInstrumentedFunction *next;
+	char *symbol;
+	void *addr;
+	KNInstrumentShard shards[KN_INSTRUMENT_SHARDS];
+} KNInstrumentedFunction;
+
+typedef struct KNInstrumentFrame {
+	KNInstrumentedFunction *function;
+	uintptr_t ret;
+	uint64_t start;
+} KNInstrumentFrame;
+
+typedef struct KNInstrumentThread {
+	uint32_t shard; // Shard index plus one, zero if not assigned yet
+	uint32_t depth;
+	KNInstrumentFrame frames[KN_INSTRUMENT_MAX_DEPTH];
+} KNInstrumentThread;
+
+KNInstrumentedFunction *gInstrumentedFunctions;
+void *gInstrumentReturnPad;
+uint32_t gInstrumentNextShard;
+bool gInstrumentLogged;
+
+static __thread KNInstrumentThread gInstrumentThread;
+
+static KNInstrumentShard *KNInstrumentGetShard(KNInstrumentedFunction *function) {
+	KNInstrumentThread *thread = &gInstrumentThread;
+	
+	if (!thread->shard) {
+		thread->shard = (__atomic_fetch_add(&gInstrumentNextShard, 1, __ATOMIC_RELAXED) % KN_INSTRUMENT_SHARDS) + 1;
+	}
+	
+	return &function->shards[thread->shard - 1];
+}
+
+static void KNInstrumentEnter(LHProbeContext *ctx, void *userdata) {
+	/**
+	 * Probe on the first instruction of an instrumented function. This counts
+	 * the call and swaps the return address for the return pad so we also get
+	 * to see it return.
+	 */
+	
+	KNInstrumentedFunction *function = userdata;
+	KNInstrumentThread *thread = &gInstrumentThread;
+	
+	__atomic_fetch_add(&KNInstrumentGetShard(function)->calls, 1, __ATOMIC_RELAXED);
+	
+	if (thread->depth >= KN_INSTRUMENT_MAX_DEPTH) {
+		return;
+	}
+	
+	KNInstrumentFrame *frame = &thread->frames[thread->depth++];
+	frame->function = function;
+	frame->ret = KN_PROBE_RETURN(ctx);
+	KN_PROBE_RETURN(ctx) = (uintptr_t) gInstrumentReturnPad;
+	frame->start = KNTimeNs();
+}
+
+static void KNInstrumentReturn(LHProbeContext *ctx, void *userdata) {
+	/**
+	 * Probe on the return pad, which instrumented functions return to instead
+	 * of their caller. Record how long the call took and go to the real
+	 * return address.
+	 */
+	
+	uint64_t end = KNTimeNs();
+	KNInstrumentThread *thread = &gInstrumentThread;
+	KNInstrumentFrame *frame = &thread->frames[--thread->depth];
+	KNInstrumentShard *shard = KNInstrumentGetShard(frame->function);
+	uint64_t duration = end - frame->start;
+	size_t bucket = duration ? 64 - __builtin_clzll(duration) : 0;
+	
+	if (bucket >= KN_INSTRUMENT_BUCKETS) {
+		bucket = KN_INSTRUMENT_BUCKETS - 1;
+	}
+	
+	__atomic_fetch_add(&shard->timed_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->total_ns, duration, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->buckets[bucket], 1, __ATOMIC_RELAXED);
+	
+	KN_PROBE_PC(ctx) = frame->ret;
+}
+
+static bool KNInstrumentInitReturnPad(void) {
+	/**
+	 * Make the code instrumented functions return to. It's never run: the
+	 * probe on it always continues at the real return address.
+	 */
+	
+	size_t page_size = getpagesize();
+	knnop_t *pad = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (pad == MAP_FAILED) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < page_size / sizeof *pad; i++) {
+		pad[i] = KN_NOP;
+	}
+	
+	if (mprotect(pad, page_size, PROT_READ | PROT_EXEC) || !KNProbe(pad, KNInstrumentReturn, NULL)) {
+		munmap(pad, page_size);
+		return false;
+	}
+	
+	gInstrumentReturnPad = pad;
+	
+	return true;
+}
+
+static KNInstrumentedFunction *KNInstrumentFind(const char *symbol) {
+	for (KNInstrumentedFunction *function = gInstrumentedFunctions; function; function = function->next) {
+		if (!strcmp(function->symbol, symbol)) {
+			return function;
+		}
+	}
+	
+	return NULL;
+}
+
+static void KNInstrumentSum(KNInstrumentedFunction *function, KNInstrumentShard *total) {
+	/**
+	 * Add up all of the shards of a function.
+	 */
+	
+	memset(total, 0, sizeof *total);
+	
+	for (size_t i = 0; i < KN_INSTRUMENT_SHARDS; i++) {
+		KNInstrumentShard *shard = &function->shards[i];
+		total->calls += __atomic_load_n(&shard->calls, __ATOMIC_RELAXED);
+		total->timed_calls += __atomic_load_n(&shard->timed_calls, __ATOMIC_RELAXED);
+		total->total_ns += __atomic_load_n(&shard->total_ns, __ATOMIC_RELAXED);
+		
+		for (size_t j = 0; j < KN_INSTRUMENT_BUCKETS; j++) {
+			total->buckets[j] += __atomic_load_n(&shard->buckets[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static uint64_t KNInstrumentPercentile(KNInstrumentShard *total, double fraction) {
+	/**
+	 * Upper bound in ns of the bucket the given fraction of timed calls falls
+	 * into.
+	 */
+	
+	uint64_t target = total->timed_calls * fraction;
+	uint64_t seen = 0;
+	
+	for (size_t i = 0; i < KN_INSTRUMENT_BUCKETS - 1; i++) {
+		seen += total->buckets[i];
+		
+		if (seen > target) {
+			return 1ull << i;
+		}
+	}
+	
+	return UINT64_MAX;
+}
+
+void KNInstrumentLog(void) {
+	/**
+	 * Log the stats of every instrumented function. This only happens once,
+	 * so it's fine to call this both when the game returns and at exit.
+	 */
+	
+	if (gInstrumentLogged) {
+		return;
+	}
+	
+	gInstrumentLogged = true;
+	
+	for (KNInstrumentedFunction *function = gInstrumentedFunctions; function; function = function->next) {
+		KNInstrumentShard total;
+		KNInstrumentSum(function, &total);
+		
+		__android_log_print(ANDROID_LOG_INFO, TAG, "Function stats for %s: %llu calls, %.3f ms total, %.3f us mean, p50 < %llu ns, p99 < %llu ns",
+			function->symbol,
+			(unsigned long long) total.calls,
+			total.total_ns / 1000000.0,
+			total.timed_calls ? total.total_ns / 1000.0 / total.timed_calls : 0.0,
+			(unsigned long long) KNInstrumentPercentile(&total, 0.5),
+			(unsigned long long) KNInstrumentPercentile(&total, 0.99));
+	}
+}
+
+bool KNInstrumentFunction(const char *symbol) {
+	/**
+	 * Start counting calls to the function with the given symbol and how long
+	 * they take. This puts a probe on its first instruction, which swaps the
+	 * return address so that returning goes through the return pad. Note
+	 * that unwinding through an instrumented function (for a C++ exception,
+	 * say) won't work.
+	 */
+	
+	if (KNInstrumentFind(symbol)) {
+		return true;
+	}
+	
+	void *addr = KNGetSymbolAddr(symbol);
+	
+	if (!addr) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Can't instrument %s, symbol not found", symbol);
+		return false;
+	}
+	
+	if (!gInstrumentReturnPad) {
+		if (!KNInstrumentInitReturnPad()) {
+			__android_log_print(ANDROID_LOG_ERROR, TAG, "Failed to create instrumentation return pad");
+			return false;
+		}
+		
+		atexit(KNInstrumentLog);
+	}
+	
+	KNInstrumentedFunction *function = calloc(1, sizeof *function);
+	
+	if (!function) {
+		return false;
+	}
+	
+	function->symbol = strdup(symbol);
+	function->addr = addr;
+	
+	if (!function->symbol || !KNProbe(addr, KNInstrumentEnter, function)) {
+		free(function->symbol);
+		free(function);
+		return false;
+	}
+	
+	function->next = gInstrumentedFunctions;
+	gInstrumentedFunctions = function;
+	
+	__android_log_print(ANDROID_LOG_INFO, TAG, "Instrumented %s at <%p>", symbol, addr);
+	
+	return true;
+}
+
+int knInstrumentFunction(lua_State *script) {
+	/**
+	 * (bool) success = knInstrumentFunction(symbol)
+	 * 
+	 * Start collecting call stats for the function with the given symbol.
+	 */
+	
+	const char *symbol = lua_tostring(script, 1);
+	
+	if (!symbol) {
+		lua_pushboolean(script, false);
+		return 1;
+	}
+	
+	lua_pushboolean(script, KNInstrumentFunction(symbol));
+	
+	return 1;
+}
+
+int knGetFunctionStats(lua_State *script) {
+	/**
+	 * (table|nil) stats = knGetFunctionStats(symbol)
+	 * 
+	 * Return the call count, timings and latency histogram of an instrumented
+	 * function, or nil if it isn't instrumented.
+	 */
+	
+	const char *symbol = lua_tostring(script, 1);
+	KNInstrumentedFunction *function = symbol ? KNInstrumentFind(symbol) : NULL;
+	
+	if (!function) {
+		knReturnNil(script);
+	}
+	
+	KNInstrumentShard total;
+	KNInstrumentSum(function, &total);
+	
+	KNLuaCreateTable(script, 0, 6);
+	
+	lua_pushstring(script, "calls");
+	lua_pushnumber(script, total.calls);
+	KNLuaSetTable(script, -3);
+	
+	lua_pushstring(script, "total_ms");
+	lua_pushnumber(script, total.total_ns / 1000000.0);
+	KNLuaSetTable(script, -3);
+	
+	lua_pushstring(script, "mean_ms");
+	lua_pushnumber(script, total.timed_calls ? total.total_ns / 1000000.0 / total.timed_calls : 0.0);
+	KNLuaSetTable(script, -3);
+	
+	lua_pushstring(script, "p50_ns");
+	lua_pushnumber(script, KNInstrumentPercentile(&total, 0.5));
+	KNLuaSetTable(script, -3);
+	
+	lua_pushstring(script, "p99_ns");
+	lua_pushnumber(script, KNInstrumentPercentile(&total, 0.99));
+	KNLuaSetTable(script, -3);
+	
+	lua_pushstring(script, "histogram");
+	KNLuaCreateTable(script, 0, 0);
+	
+	for (size_t i = 0; i < KN_INSTRUMENT_BUCKETS; i++) {
+		if (total.buckets[i]) {
+			lua_pushinteger(script, i);
+			lua_pushnumber(script, total.buckets[i]);
+			KNLuaSetTable(script, -3);
+		}
+	}
+	
+	KNLuaSetTable(script, -3);
+	
+	return 1;
+}
+
+int knEnableInstrument(lua_State *script) {
+	knRegisterFunc(script, knInstrumentFunction);
+	knRegisterFunc(script, knGetFunctionStats);
+	
+	return 0;
+}
@@ -5,13 +5,25 @@
  * 
  * Usage:
  * 
- *  - Define `LH_AARCH64` on ARM64, `LH_AARCH32` on ARM32, etc.
- *  - Create a hooker (`LHHookerCreate()`)
- *  - Use it to hook functions (`LHHookerHookFunction()`)
+ *  - Define `LH_AARCH64` on ARM64, `LH_AARCH32` on ARM32, `LH_X86_64` on
+ *    x86_64 or `LH_X86` on x86
+ *  - Create a hooker (`LHHookerCreate()`), or `LHHookerCreateDualMapped()` if
+ *    the system doesn't allow RWX memory
+ *  - Use it to hook functions (`LHHookerHookFunction()`) and maybe unhook them
+ *    later (`LHHookerUnhook()`), or probe single instructions
+ *    (`LHHookerProbe()`, removed with `LHHookerUnprobe()`)
+ *  - Optionally, wrap many hooks in `LHHookerBegin()` and `LHHookerCommit()`
+ *    so the functions are patched all at once
  */
 
 #ifndef _LEAFHOOK_HEADER
 #define _LEAFHOOK_HEADER
+
+// glibc only has REG_RIP and REG_EIP with _GNU_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdbool.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -19,17 +31,119 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+
+typedef struct LHBlock {
+	struct LHBlock *next;
+	uint8_t *rw; // where code is written
+	uint8_t *rx; // where code is run, same as rw unless dual mapped
+	size_t size;
+	size_t used;
+} LHBlock;
+
+// Max size of the code written over the start of a hooked function
+#define LH_PATCH_MAX_SIZE 16
+
+typedef struct LHPatch {
+	uint8_t *addr;
+	size_t size;
+	uint8_t code[LH_PATCH_MAX_SIZE];
+} LHPatch;
+
+typedef struct LHHookEntry {
+	void *hook;
+	void **orig;
+} LHHookEntry;
+
+// A hooked function and its chain of hooks, oldest first
+typedef struct LHTarget {
+	struct LHTarget *next;
+	uint8_t *function;
+	uint8_t original[LH_PATCH_MAX_SIZE];
+	size_t patch_size;
+	void *trampoline; // the relocated original code
+	LHHookEntry *hooks;
+	size_t hook_count;
+} LHTarget;
+
+// A probed instruction and the bytes the jump to its stub replaced
+typedef struct LHProbeSite {
+	struct LHProbeSite *next;
+	uint8_t *addr;
+	uint8_t original[LH_PATCH_MAX_SIZE];
+	size_t patch_size;
+} LHProbeSite;
+
+// Asked before a hook or probe writes over [addr, addr + size), so code that
+// patches the same memory some other way can refuse it
+typedef bool (*LHPatchCheck)(void *addr, size_t size, void *userdata);
 
 typedef struct LHHooker {
-	void *rwx_block;
-	size_t rwx_block_size;
-	size_t rwx_block_used;
+	LHBlock *blocks;
+	bool dual_mapped;
+	LHTarget *targets;
+	LHProbeSite *probes;
+	LHPatchCheck patch_check;
+	void *patch_check_userdata;
+	
+	// Patches waiting for LHHookerCommit()
+	LHPatch *pending;
+	size_t pending_count;
+	size_t transaction_depth;
 } LHHooker;
 
+// Registers saved for a probe, see LHHookerProbe()
+#if defined(LH_AARCH64)
+typedef struct LHProbeContext {
+	uint64_t x[31];
+	uint64_t sp;
+	uint64_t pc;
+	uint64_t nzcv;
+	uint8_t v[32][16];
+} LHProbeContext;
+#elif defined(LH_AARCH32)
+typedef struct LHProbeContext {
+	uint32_t r[13];
+	uint32_t sp;
+	uint32_t lr;
+	uint32_t pc;
+	uint32_t cpsr;
+	uint32_t pad;
+	uint64_t d[32]; // d16-d31 are only saved on devices that have them
+} LHProbeContext;
+#else
+// gpr is in encoding order: ax, cx, dx, bx, sp, bp, si, di, then r8-r15
+typedef struct LHProbeContext {
+	uint8_t xmm[sizeof(void *) * 2][16];
+	uintptr_t gpr[sizeof(void *) * 2];
+	uintptr_t ip;
+	uintptr_t flags;
+} LHProbeContext;
+#endif
+
+typedef void (*LHProbeCallback)(LHProbeContext *ctx, void *userdata);
+
 LHHooker *LHHookerCreate(void);
+LHHooker *LHHookerCreateDualMapped(void);
 void LHHookerRelease(LHHooker *self);
 
 bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig);
+bool LHHookerUnhook(LHHooker *self, void *function, void *hook);
+bool LHHookerProbe(LHHooker *self, void *addr, LHProbeCallback callback, void *userdata);
+bool LHHookerProbeThread(LHHooker *self, void *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread);
+bool LHHookerUnprobe(LHHooker *self, void *addr);
+bool LHHookerIsPatched(LHHooker *self, void *addr, size_t size);
+void LHHookerSetPatchCheck(LHHooker *self, LHPatchCheck check, void *userdata);
+void LHHookerBegin(LHHooker *self);
+bool LHHookerCommit(LHHooker *self);
+
+bool LHGetProtections(const uintptr_t *pages, int *prots, size_t count);
+uintptr_t LHThreadId(void);
 
 #ifdef LEAFHOOK_IMPLEMENTATION
 
@@ -64,10 +178,10 @@ bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **ori
 #define AARCH32_ADR_DECODE_RD(input) ((((input >> 12) & 0xf) << 0))
 #define AARCH32_ADR_DECODE_IMM(input) ((((input >> 0) & 0xfff) << 0))
 #define IS_AARCH32_ADR(input) ((input & 0xffff0000) == 0xe28f0000)
-#define MAKE_AARCH32_ADR_SUB(Rd, imm) ((((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001010001111 << 16))
+#define MAKE_AARCH32_ADR_SUB(Rd, imm) ((((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001001001111 << 16))
 #define AARCH32_ADR_SUB_DECODE_RD(input) ((((input >> 12) & 0xf) << 0))
 #define AARCH32_ADR_SUB_DECODE_IMM(input) ((((input >> 0) & 0xfff) << 0))
-#define IS_AARCH32_ADR_SUB(input) ((input & 0xffff0000) == 0xe28f0000)
+#define IS_AARCH32_ADR_SUB(input) ((input & 0xffff0000) == 0xe24f0000)
 #define MAKE_AARCH32_LDR_LITERAL(U, Rt, imm) ((((imm) & 0xfff) << 0) | (((Rt) & 0xf) << 12) | (0b0011111 << 16) | (((U) & 0x1) << 23) | (0b11100101 << 24))
 #define AARCH32_LDR_LITERAL_DECODE_U(input) ((((input >> 23) & 0x1) << 0))
 #define AARCH32_LDR_LITERAL_DECODE_RT(input) ((((input >> 12) & 0xf) << 0))
@@ -78,15 +192,118 @@ bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **ori
 #define IS_AARCH32_BX(input) ((input & 0xfffffff0) == 0xe12fff10)
 // END AUTO GENERATED MACROS
 
-void *LHHookerMapRwxPages(size_t size) {
-	return mmap(NULL, size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+// Trampoline memory is allocated in blocks of this many pages
+#define LH_BLOCK_PAGES 16
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+void *LHHookerMapRwxPages(size_t size, void *hint) {
+	return mmap(hint, size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 }
 
-LHHooker *LHHookerCreate(void) {
+static bool LHHookerMapDualPages(size_t size, void *hint, uint8_t **rw, uint8_t **rx) {
+	/**
+	 * Map the same memory twice, once RW and once RX, so that trampolines can
+	 * be written without any page ever being both writable and executable.
+	 */
+	
+	int fd = syscall(__NR_memfd_create, "leafhook", MFD_CLOEXEC);
+	
+	if (fd < 0) {
+		return false;
+	}
+	
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return false;
+	}
+	
+	*rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	*rx = mmap(hint, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	
+	// The mappings keep the memory alive
+	close(fd);
+	
+	if (*rw == MAP_FAILED || *rx == MAP_FAILED) {
+		if (*rw != MAP_FAILED) { munmap(*rw, size); }
+		if (*rx != MAP_FAILED) { munmap(*rx, size); }
+		return false;
+	}
+	
+	return true;
+}
+
+static void LHBlockUnmap(LHBlock *block) {
+	munmap(block->rw, block->size);
+	
+	if (block->rx != block->rw) {
+		munmap(block->rx, block->size);
+	}
+	
+	free(block);
+}
+
+static LHBlock *LHHookerMapBlock(LHHooker *self, size_t min_size, void *hint) {
+	/**
+	 * Map a block of trampoline memory big enough for `min_size` bytes,
+	 * preferably with its executable view at `hint`.
+	 */
+	
+	size_t page_size = getpagesize();
+	size_t size = LH_BLOCK_PAGES * page_size;
+	
+	if (size < min_size) {
+		size = (min_size + page_size - 1) & ~(page_size - 1);
+	}
+	
+	LHBlock *block = malloc(sizeof *block);
+	
+	if (!block) {
+		return NULL;
+	}
+	
+	memset(block, 0, sizeof *block);
+	block->size = size;
+	
+	if (self->dual_mapped) {
+		if (!LHHookerMapDualPages(size, hint, &block->rw, &block->rx)) {
+			free(block);
+			return NULL;
+		}
+	}
+	else {
+		block->rw = block->rx = LHHookerMapRwxPages(size, hint);
+		
+		if (block->rw == MAP_FAILED) {
+			free(block);
+			return NULL;
+		}
+	}
+	
+	return block;
+}
+
+static LHBlock *LHHookerAddBlock(LHHooker *self, size_t min_size, void *hint) {
 	/**
-	 * Create a new hook manager
+	 * Map another block of trampoline memory and put it at the front of the
+	 * block list.
 	 */
 	
+	LHBlock *block = LHHookerMapBlock(self, min_size, hint);
+	
+	if (!block) {
+		return NULL;
+	}
+	
+	block->next = self->blocks;
+	self->blocks = block;
+	
+	return block;
+}
+
+static LHHooker *LHHookerCreateInternal(bool dual_mapped) {
 	LHHooker *self = malloc(sizeof *self);
 	
 	if (!self) {
@@ -95,10 +312,10 @@ LHHooker *LHHookerCreate(void) {
 	
 	memset(self, 0, sizeof *self);
 	
-	self->rwx_block_size = 10 * getpagesize();
-	self->rwx_block = LHHookerMapRwxPages(self->rwx_block_size);
+	self->dual_mapped = dual_mapped;
 	
-	if (!self->rwx_block) {
+	// Make sure we can get at least one block so failing is obvious up front
+	if (!LHHookerAddBlock(self, 0, NULL)) {
 		LHHookerRelease(self);
 		return NULL;
 	}
@@ -106,6 +323,30 @@ LHHooker *LHHookerCreate(void) {
 	return self;
 }
 
+LHHooker *LHHookerCreate(void) {
+	/**
+	 * Create a new hook manager. Uses RWX memory for trampolines, falling back
+	 * to dual mapped memory if RWX memory isn't allowed.
+	 */
+	
+	LHHooker *self = LHHookerCreateInternal(false);
+	
+	if (!self) {
+		self = LHHookerCreateInternal(true);
+	}
+	
+	return self;
+}
+
+LHHooker *LHHookerCreateDualMapped(void) {
+	/**
+	 * Create a new hook manager which never uses RWX memory for trampolines,
+	 * for systems enforcing W^X.
+	 */
+	
+	return LHHookerCreateInternal(true);
+}
+
 void LHHookerRelease(LHHooker *self) {
 	/**
 	 * Release a hook manager and any related resources. Don't call if any
@@ -116,37 +357,176 @@ void LHHookerRelease(LHHooker *self) {
 		return;
 	}
 	
-	if (self->rwx_block) {
-		munmap(self->rwx_block, self->rwx_block_size);
+	LHBlock *block = self->blocks;
+	
+	while (block) {
+		LHBlock *next = block->next;
+		LHBlockUnmap(block);
+		block = next;
+	}
+	
+	LHTarget *target = self->targets;
+	
+	while (target) {
+		LHTarget *next = target->next;
+		free(target->hooks);
+		free(target);
+		target = next;
+	}
+	
+	LHProbeSite *site = self->probes;
+	
+	while (site) {
+		LHProbeSite *next = site->next;
+		free(site);
+		site = next;
 	}
 	
+	free(self->pending);
 	free(self);
 }
 
-static void *LHHookerAllocRwx(LHHooker *self, size_t size) {
+static bool LHIsNear(void *addr, size_t size, void *near, size_t range) {
+	/**
+	 * Check if all of [addr, addr + size) is within `range` bytes of `near`.
+	 * A range of zero means any address is fine.
+	 */
+	
+	if (!range) {
+		return true;
+	}
+	
+	uintptr_t lo = (uintptr_t) addr, hi = (uintptr_t) addr + size, n = (uintptr_t) near;
+	
+	return (lo >= n ? lo - n : n - lo) < range && (hi >= n ? hi - n : n - hi) < range;
+}
+
+static LHBlock *LHHookerAddBlockNear(LHHooker *self, size_t min_size, void *near, size_t range) {
+	/**
+	 * Map a new block within `range` bytes of `near`. The kernel only takes
+	 * mmap() addresses as hints, so this probes outwards from `near` until a
+	 * mapping lands close enough.
+	 */
+	
+	uintptr_t page_mask = ~((uintptr_t) getpagesize() - 1);
+	uintptr_t step = (range / 16) & page_mask;
+	
+	for (size_t i = 1; i < 16; i++) {
+		for (int dir = -1; dir <= 1; dir += 2) {
+			uintptr_t hint = ((uintptr_t) near & page_mask) + dir * (intptr_t) (i * step);
+			
+			// Don't wrap around the address space
+			if ((dir < 0 && hint > (uintptr_t) near) || (dir > 0 && hint < (uintptr_t) near)) {
+				continue;
+			}
+			
+			LHBlock *block = LHHookerMapBlock(self, min_size, (void *) hint);
+			
+			if (!block) {
+				return NULL;
+			}
+			
+			if (LHIsNear(block->rx, block->size, near, range)) {
+				block->next = self->blocks;
+				self->blocks = block;
+				return block;
+			}
+			
+			LHBlockUnmap(block);
+		}
+	}
+	
+	return NULL;
+}
+
+static void *LHHookerAllocNear(LHHooker *self, size_t size, void *near, size_t range, void **exec) {
 	/**
-	 * Allocate some RWX memory from self->rwx_block. Should be 4 byte aligned.
+	 * Allocate some trampoline memory whose executable address is within
+	 * `range` bytes of `near` (any address if `range` is zero), adding more
+	 * blocks as needed. Returns the address to write the code to and writes
+	 * the address it will run at to `exec`. Allocations are 8 byte aligned.
+	 * Returns NULL if no suitable memory can be mapped.
 	 */
 	
-	// Ensure 4 byte alignment
-	if (size & 3) {
-		size += 4 - (size & 3);
+	// Ensure 8 byte alignment
+	size = (size + 7) & ~7;
+	
+	LHBlock *block = self->blocks;
+	
+	while (block) {
+		if (block->size - block->used >= size && LHIsNear(block->rx + block->used, size, near, range)) {
+			break;
+		}
+		
+		block = block->next;
+	}
+	
+	if (!block) {
+		block = range ? LHHookerAddBlockNear(self, size, near, range) : LHHookerAddBlock(self, size, NULL);
+		
+		if (!block) {
+			return NULL;
+		}
 	}
 	
-	// Calc pointer
-	void *ptr = self->rwx_block + self->rwx_block_used;
+	// Calc pointers
+	void *ptr = block->rw + block->used;
+	*exec = block->rx + block->used;
 	
 	// Add this allocation to used size
-	self->rwx_block_used += size;
+	block->used += size;
 	
 	return ptr;
 }
 
-#define LH_STREAM_MAX_SIZE 0x100
+// Only the ARM block rewriters don't care where their code goes
+#if defined(LH_AARCH64) || defined(LH_AARCH32)
+static void *LHHookerAlloc(LHHooker *self, size_t size, void **exec) {
+	return LHHookerAllocNear(self, size, NULL, 0, exec);
+}
+#endif
+
+static void LHHookerTrim(LHHooker *self, void *exec, size_t size) {
+	/**
+	 * Shrink the most recent allocation at `exec` down to `size` bytes, for
+	 * when the final size of some code isn't known until it is written.
+	 */
+	
+	for (LHBlock *block = self->blocks; block; block = block->next) {
+		if ((uint8_t *) exec >= block->rx && (uint8_t *) exec < block->rx + block->size) {
+			block->used = ((uint8_t *) exec - block->rx) + ((size + 7) & ~7);
+			return;
+		}
+	}
+}
+
+static void LHHookerFree(LHHooker *self, void *exec, size_t size) {
+	/**
+	 * Give back an allocation that turned out not to be needed. Only the most
+	 * recent allocation in a block can be given back, anything else is kept.
+	 */
+	
+	if (!exec) {
+		return;
+	}
+	
+	for (LHBlock *block = self->blocks; block; block = block->next) {
+		if ((uint8_t *) exec >= block->rx && (uint8_t *) exec < block->rx + block->size) {
+			if ((uint8_t *) exec + ((size + 7) & ~7) == block->rx + block->used) {
+				block->used = (uint8_t *) exec - block->rx;
+			}
+			
+			return;
+		}
+	}
+}
+
+#define LH_STREAM_MAX_SIZE 0x400
 
 typedef struct LHStream {
 	uint8_t data[LH_STREAM_MAX_SIZE];
 	size_t head;
+	bool overflow;
 } LHStream;
 
 static void LHStreamInit(LHStream *self) {
@@ -156,6 +536,7 @@ static void LHStreamInit(LHStream *self) {
 static void LHStreamWrite(LHStream *self, size_t size, void *data) {
 	if (self->head + size > LH_STREAM_MAX_SIZE) {
 		// fail
+		self->overflow = true;
 		return;
 	}
 	
@@ -163,162 +544,712 @@ static void LHStreamWrite(LHStream *self, size_t size, void *data) {
 	self->head += size;
 }
 
+#if defined(LH_X86) || defined(LH_X86_64)
+static void LHStreamWrite8(LHStream *self, uint8_t data) {
+	LHStreamWrite(self, 1, &data);
+}
+#endif
+
 static size_t LHStreamWrite32(LHStream *self, uint32_t data) {
 	LHStreamWrite(self, sizeof data, &data);
 	return self->head - sizeof data;
 }
 
+#if defined(LH_AARCH64) || defined(LH_X86) || defined(LH_X86_64)
 static size_t LHStreamWrite64(LHStream *self, uint64_t data) {
 	LHStreamWrite(self, sizeof data, &data);
 	return self->head - sizeof data;
 }
+#endif
 
 static size_t LHStreamTell(LHStream *self) {
 	return self->head;
 }
 
-#define LH_COPY_TO_NEW_BLOCK() void *new_block = LHHookerAllocRwx(self, LHStreamTell(&code) + LHStreamTell(&data)); \
+#define LH_COPY_TO_NEW_BLOCK() if (code.overflow || data.overflow) { return NULL; } \
+	void *new_block_exec; \
+	void *new_block = LHHookerAlloc(self, LHStreamTell(&code) + LHStreamTell(&data), &new_block_exec); \
+	if (!new_block) { return NULL; } \
 	memcpy(new_block, code.data, LHStreamTell(&code)); \
 	memcpy(new_block + LHStreamTell(&code), data.data, LHStreamTell(&data)); \
-	return new_block;
+	__builtin___clear_cache(new_block_exec, new_block_exec + LHStreamTell(&code) + LHStreamTell(&data)); \
+	return new_block_exec;
 
-#ifdef LH_AARCH64
-
-// Offset from next instruction to next available data region
-#define LH_INS_OFFSET (((block_size + 2) * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data))
+static int LHPatchCompare(const void *a, const void *b) {
+	const LHPatch *pa = a, *pb = b;
+	return (pa->addr > pb->addr) - (pa->addr < pb->addr);
+}
 
-static uint32_t *LHRewriteAArch64Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+bool LHGetProtections(const uintptr_t *pages, int *prots, size_t count) {
 	/**
-	 * Rewrite a block of instructions located at `old_block` to be position
-	 * indepedent, also inserting a jump back to (old_block + block_size) at the
-	 * end.
+	 * Look up the current protection of each page in `pages`, which must be
+	 * sorted, so it can be put back after patching. Returns false if a page
+	 * isn't mapped or the mappings can't be read.
 	 */
 	
-	LHStream code; LHStreamInit(&code);
-	LHStream data; LHStreamInit(&data);
+	FILE *maps = fopen("/proc/self/maps", "r");
 	
-	for (size_t i = 0; i < block_size; i++) {
-		uint32_t ins = old_block[i];
+	if (!maps) {
+		return false;
+	}
+	
+	char line[256];
+	size_t i = 0;
+	
+	while (i < count && fgets(line, sizeof line, maps)) {
+		// "start-end perms offset dev inode path"
+		char *at;
+		uintptr_t start = strtoull(line, &at, 16);
+		uintptr_t end = strtoull(at + 1, &at, 16);
+		int prot = (at[1] == 'r' ? PROT_READ : 0) | (at[2] == 'w' ? PROT_WRITE : 0) | (at[3] == 'x' ? PROT_EXEC : 0);
 		
-		if (IS_AARCH64_ADR(ins)) {
-			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
-			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21);
-			
-			size_t result = (size_t) (((void *)&old_block[i]) + imm);
-			size_t offset = LH_INS_OFFSET;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
-			LHStreamWrite64(&data, result);
-		}
-		else if (IS_AARCH64_ADRP(ins)) {
-			// similar to adr but works with respect to pages
-			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
-			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21) << 12;
-			
-			size_t result = (size_t) ((void *)&old_block[i]);
-			result &= 0xfffffffffffff000;
-			result += imm;
-			size_t offset = LH_INS_OFFSET;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
-			LHStreamWrite64(&data, result);
-		}
-		else if (IS_AARCH64_LDR_LITERAL(ins)) {
-			bool x = AARCH64_LDR_LITERAL_DECODE_X(ins);
-			uint32_t Rt = AARCH64_LDR_LITERAL_DECODE_RT(ins);
-			size_t imm = LH_SEXT64(AARCH64_LDR_LITERAL_DECODE_IMM(ins), 19) << 2;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(x, LH_INS_OFFSET >> 2, Rt));
-			
-			if (x) {
-				uint64_t d = ((uint64_t *)(((void *)&old_block[i]) + imm))[i];
-				LHStreamWrite64(&data, d);
-			}
-			else {
-				uint32_t d = ((uint32_t *)(((void *)&old_block[i]) + imm))[i];
-				LHStreamWrite32(&data, d);
+		for (; i < count && pages[i] < end; i++) {
+			if (pages[i] < start) {
+				fclose(maps);
+				return false;
 			}
+			
+			prots[i] = prot;
 		}
-		else {
-			LHStreamWrite32(&code, ins);
-		}
+		
+		// Skip the rest of long lines
+		while (!strchr(line, '\n') && fgets(line, sizeof line, maps)) {}
 	}
 	
-	// Insert jump back to end
-	// TODO: Actually figure out which registers are available to use instead of
-	// just using x17
-	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_INS_OFFSET >> 2, 16));
-	LHStreamWrite32(&code, MAKE_AARCH64_BR(16));
-	LHStreamWrite64(&data, (size_t)(old_block + block_size));
+	fclose(maps);
 	
-	// Copy to rwx block
-	LH_COPY_TO_NEW_BLOCK();
+	return i == count;
 }
 
-static void LHWriteAArch64LongJump(uint32_t *code, void *target) {
-	code[0] = MAKE_AARCH64_LDR_LITERAL(1, 8 >> 2, 16);
-	code[1] = MAKE_AARCH64_BR(16);
-	code[2] = ((uint32_t *)&target)[0];
-	code[3] = ((uint32_t *)&target)[1];
+uintptr_t LHThreadId(void) {
+	/**
+	 * Get the thread pointer of the calling thread, which is unique to each
+	 * running thread. This is the value LHHookerProbeThread() compares with,
+	 * read the same way its stubs do.
+	 */
+	
+	uintptr_t thread = 0;
+	
+	// Going by what's being compiled for rather than LH_*, so the relocators
+	// can still be built for testing on other machines
+#if defined(__aarch64__)
+	__asm__ volatile ("mrs %0, tpidr_el0" : "=r" (thread));
+#elif defined(__arm__)
+	__asm__ volatile ("mrc p15, 0, %0, c13, c0, 3" : "=r" (thread));
+#elif defined(__x86_64__)
+	__asm__ volatile ("mov %%fs:0, %0" : "=r" (thread));
+#elif defined(__i386__)
+	__asm__ volatile ("mov %%gs:0, %0" : "=r" (thread));
+#endif
+	
+	return thread;
 }
 
-static bool LHHookerAArch64Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
-	if (orig) {
-		uint32_t *orig_ptr = LHRewriteAArch64Block(self, function, 4);
+/**
+ * Writing patches
+ * 
+ * Other threads might be running the code being patched, and a patch longer
+ * than one instruction can't be written in one go. So they are written the
+ * same way Linux patches its own code:
+ * 
+ *  1. The first instruction is replaced with one that stops any thread that
+ *     gets there: a branch to itself on ARM, or an int3 on x86 which a SIGTRAP
+ *     handler turns into a retry
+ *  2. The rest of the patch is written
+ *  3. The first instruction is replaced with the real one
+ * 
+ * with caches synced on every core between each step. A single instruction
+ * patch on ARM is just one atomic store, which is why hooks prefer those.
+ * 
+ * A thread that is already part way through the bytes being replaced can still
+ * go wrong, so functions with long patches should be hooked before other
+ * threads are running them.
+ */
+
+// Max patches that are mid-write at once, bigger batches are split up
+#define LH_TRAP_MAX 64
+
+#if defined(LH_X86) || defined(LH_X86_64)
+#define LH_PATCH_HEAD_SIZE 1
+#define LH_PATCH_HEAD_WAIT 0xcc
+
+#ifdef LH_X86_64
+#define LH_REG_IP REG_RIP
+#else
+#define LH_REG_IP REG_EIP
+#endif
+
+// Where the int3s of the last patches written are, for the SIGTRAP handler.
+// These are kept until the next write starts, after which a thread that
+// trapped on an old int3 is recognised by the int3 being gone.
+static uint8_t *gLHTrapAddrs[LH_TRAP_MAX];
+static size_t gLHTrapCount;
+static struct sigaction gLHOldTrapAction;
+static bool gLHTrapInstalled;
+
+static void LHTrapHandler(int sig, siginfo_t *info, void *context) {
+	ucontext_t *uc = context;
+	uint8_t *ip = (uint8_t *) uc->uc_mcontext.gregs[LH_REG_IP];
+	size_t count = __atomic_load_n(&gLHTrapCount, __ATOMIC_ACQUIRE);
+	
+	// One of ours, so run whatever is there now: still the int3, or the
+	// finished patch. An int3 that isn't there any more was one of ours too,
+	// even if the list has moved on to the next write since it was hit.
+	if (info->si_code == SI_KERNEL) {
+		bool ours = __atomic_load_n(ip - 1, __ATOMIC_ACQUIRE) != LH_PATCH_HEAD_WAIT;
+		
+		for (size_t i = 0; i < count && !ours; i++) {
+			ours = __atomic_load_n(&gLHTrapAddrs[i], __ATOMIC_RELAXED) == ip - 1;
+		}
+		
+		if (ours) {
+			uc->uc_mcontext.gregs[LH_REG_IP] = (uintptr_t) (ip - 1);
+			return;
+		}
+	}
+	
+	if (gLHOldTrapAction.sa_flags & SA_SIGINFO) {
+		gLHOldTrapAction.sa_sigaction(sig, info, context);
+	}
+	else if (gLHOldTrapAction.sa_handler == SIG_DFL) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+	else if (gLHOldTrapAction.sa_handler != SIG_IGN) {
+		gLHOldTrapAction.sa_handler(sig);
+	}
+}
+
+static bool LHPatchWaitBegin(LHPatch *patches, size_t count) {
+	/**
+	 * Install the SIGTRAP handler if needed and tell it where the int3s will
+	 * be.
+	 */
+	
+	if (!gLHTrapInstalled) {
+		struct sigaction action;
+		memset(&action, 0, sizeof action);
+		action.sa_sigaction = LHTrapHandler;
+		action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+		sigemptyset(&action.sa_mask);
 		
-		if (!orig_ptr) {
+		if (sigaction(SIGTRAP, &action, &gLHOldTrapAction)) {
 			return false;
 		}
 		
-		orig[0] = orig_ptr;
+		gLHTrapInstalled = true;
+	}
+	
+	__atomic_store_n(&gLHTrapCount, 0, __ATOMIC_RELEASE);
+	
+	for (size_t i = 0; i < count; i++) {
+		__atomic_store_n(&gLHTrapAddrs[i], patches[i].addr, __ATOMIC_RELAXED);
 	}
 	
-	LHWriteAArch64LongJump(function, hook);
+	__atomic_store_n(&gLHTrapCount, count, __ATOMIC_RELEASE);
 	
 	return true;
 }
-
-#undef LH_INS_OFFSET
-
-#endif // LH_AARCH64
+#else
+#define LH_PATCH_HEAD_SIZE 4
 
 #ifdef LH_AARCH32
+#define LH_PATCH_HEAD_WAIT 0xeafffffe // b .
+#else
+#define LH_PATCH_HEAD_WAIT 0x14000000 // b .
+#endif
 
-// AArch32, so the PC points to (instruction + 8) for regular arm modea
-#define LH_INS_OFFSET (((block_size + 2) * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data) - 8)
-#define LH_PC_VALUE_ALIGNED ((((uint32_t)&old_block[i]) + 8) & 0xfffffffc)
+static bool LHPatchWaitBegin(LHPatch *patches, size_t count) {
+	return true;
+}
+#endif
 
-uint32_t *LHRewriteAArch32Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+#define LH_MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE 32
+#define LH_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE 64
+
+static void LHSyncCores(void) {
 	/**
-	 * Rewrite a block of asm so that it is position indepedent (for our
-	 * purposes) and has a jump back to the old block at the end.
+	 * Make every core stop using instructions it fetched before the last
+	 * write, if the kernel can do that for us. Otherwise the cache flushes
+	 * are all there is.
 	 */
 	
-	LHStream code; LHStreamInit(&code);
-	LHStream data; LHStreamInit(&data);
+#ifdef __NR_membarrier
+	static int registered;
 	
-	for (size_t i = 0; i < block_size; i++) {
-		uint32_t ins = old_block[i];
-		
-		if (IS_AARCH32_ADR(ins)) {
-			uint32_t Rd = AARCH32_ADR_DECODE_RD(ins);
-			uint32_t imm = AARCH32_ADR_DECODE_IMM(ins);
-			
-			uint32_t result = LH_PC_VALUE_ALIGNED;
-			result += imm;
-			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
-			LHStreamWrite32(&data, result);
-		}
-		else if (IS_AARCH32_ADR_SUB(ins)) {
+	if (!registered) {
+		registered = syscall(__NR_membarrier, LH_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) ? -1 : 1;
+	}
+	
+	if (registered > 0) {
+		syscall(__NR_membarrier, LH_MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+	}
+#endif
+}
+
+static void LHPatchStoreHead(uint8_t *addr, const uint8_t *head) {
+#if LH_PATCH_HEAD_SIZE == 1
+	__atomic_store_n(addr, head[0], __ATOMIC_RELEASE);
+#else
+	uint32_t word;
+	memcpy(&word, head, sizeof word);
+	__atomic_store_n((uint32_t *) addr, word, __ATOMIC_RELEASE);
+#endif
+	__builtin___clear_cache((char *) addr, (char *) addr + LH_PATCH_HEAD_SIZE);
+}
+
+static bool LHPatchWriteAll(LHPatch *patches, size_t count) {
+	/**
+	 * Write some patches with the steps above. The pages must be writable.
+	 */
+	
+	if (!LHPatchWaitBegin(patches, count)) {
+		return false;
+	}
+	
+	uint32_t wait = LH_PATCH_HEAD_WAIT;
+	
+	for (size_t i = 0; i < count; i++) {
+		if (patches[i].size > LH_PATCH_HEAD_SIZE) {
+			LHPatchStoreHead(patches[i].addr, (uint8_t *) &wait);
+		}
+	}
+	
+	LHSyncCores();
+	
+	for (size_t i = 0; i < count; i++) {
+		if (patches[i].size > LH_PATCH_HEAD_SIZE) {
+			memcpy(patches[i].addr + LH_PATCH_HEAD_SIZE, patches[i].code + LH_PATCH_HEAD_SIZE, patches[i].size - LH_PATCH_HEAD_SIZE);
+			__builtin___clear_cache((char *) patches[i].addr, (char *) patches[i].addr + patches[i].size);
+		}
+	}
+	
+	LHSyncCores();
+	
+	for (size_t i = 0; i < count; i++) {
+		LHPatchStoreHead(patches[i].addr, patches[i].code);
+	}
+	
+	LHSyncCores();
+	
+	return true;
+}
+
+static bool LHHookerWritePatches(LHHooker *self, LHPatch *patches, size_t count) {
+	/**
+	 * Write out a set of patches. The pages they touch are made writable once
+	 * for the whole set, and put back to how they were afterwards.
+	 */
+	
+	uintptr_t page_size = getpagesize();
+	uintptr_t page_mask = ~(page_size - 1);
+	
+	qsort(patches, count, sizeof *patches, LHPatchCompare);
+	
+	// Every page touched, in order and without repeats. A patch can be
+	// split over two pages at most.
+	uintptr_t *pages = calloc(count * 2, sizeof *pages);
+	int *prots = malloc(count * 2 * sizeof *prots);
+	size_t page_count = 0;
+	
+	if (!pages || !prots) {
+		free(pages);
+		free(prots);
+		return false;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		uintptr_t last = ((uintptr_t) patches[i].addr + patches[i].size - 1) & page_mask;
+		
+		for (uintptr_t page = (uintptr_t) patches[i].addr & page_mask; page <= last; page += page_size) {
+			if (!page_count || page > pages[page_count - 1]) {
+				pages[page_count++] = page;
+			}
+		}
+	}
+	
+	// Without the mappings, assume it's all normal code
+	if (!LHGetProtections(pages, prots, page_count)) {
+		for (size_t i = 0; i < page_count; i++) {
+			prots[i] = PROT_READ | PROT_EXEC;
+		}
+	}
+	
+	// Make neighbouring pages writable together. Code being patched might be
+	// running, so it has to stay executable too.
+	bool success = true;
+	size_t unprotected = 0;
+	
+	while (unprotected < page_count) {
+		size_t end = unprotected + 1;
+		
+		while (end < page_count && pages[end] == pages[end - 1] + page_size) {
+			end++;
+		}
+		
+		if (mprotect((void *) pages[unprotected], pages[end - 1] + page_size - pages[unprotected], PROT_READ | PROT_WRITE | PROT_EXEC)) {
+			success = false;
+			break;
+		}
+		
+		unprotected = end;
+	}
+	
+	for (size_t i = 0; success && i < count; i += LH_TRAP_MAX) {
+		success = LHPatchWriteAll(&patches[i], count - i < LH_TRAP_MAX ? count - i : LH_TRAP_MAX);
+	}
+	
+	// Put back the old protections, again grouping pages where possible
+	for (size_t i = 0; i < unprotected;) {
+		size_t end = i + 1;
+		
+		while (end < unprotected && pages[end] == pages[end - 1] + page_size && prots[end] == prots[i]) {
+			end++;
+		}
+		
+		mprotect((void *) pages[i], pages[end - 1] + page_size - pages[i], prots[i]);
+		i = end;
+	}
+	
+	free(pages);
+	free(prots);
+	
+	return success;
+}
+
+static bool LHHookerApplyPatch(LHHooker *self, void *addr, void *code, size_t size) {
+	/**
+	 * Write a patch now, or queue it if a transaction is open.
+	 */
+	
+	LHPatch patch;
+	
+	patch.addr = addr;
+	patch.size = size;
+	memcpy(patch.code, code, size);
+	
+	if (!self->transaction_depth) {
+		return LHHookerWritePatches(self, &patch, 1);
+	}
+	
+	// A later patch to the same function replaces the queued one
+	for (size_t i = 0; i < self->pending_count; i++) {
+		if (self->pending[i].addr == patch.addr) {
+			self->pending[i] = patch;
+			return true;
+		}
+	}
+	
+	LHPatch *pending = realloc(self->pending, (self->pending_count + 1) * sizeof *pending);
+	
+	if (!pending) {
+		return false;
+	}
+	
+	self->pending = pending;
+	self->pending[self->pending_count++] = patch;
+	
+	return true;
+}
+
+#ifdef LH_AARCH64
+
+// Extra encodings used when rewriting branches
+#define IS_AARCH64_B(input) ((input & 0xfc000000) == 0x14000000)
+#define IS_AARCH64_BL(input) ((input & 0xfc000000) == 0x94000000)
+#define IS_AARCH64_B_COND(input) ((input & 0xff000010) == 0x54000000)
+#define IS_AARCH64_CBZ(input) ((input & 0x7e000000) == 0x34000000)
+#define IS_AARCH64_TBZ(input) ((input & 0x7e000000) == 0x36000000)
+#define IS_AARCH64_LOAD_LITERAL(input) ((input & 0x3b000000) == 0x18000000)
+#define AARCH64_IMM26_DECODE(input) (LH_SEXT64(((input) & 0x3ffffff), 26) << 2)
+#define AARCH64_IMM19_DECODE(input) (LH_SEXT64((((input) >> 5) & 0x7ffff), 19) << 2)
+#define AARCH64_IMM14_DECODE(input) (LH_SEXT64((((input) >> 5) & 0x3fff), 14) << 2)
+#define AARCH64_IMM26_REPLACE(input, imm) (((input) & ~0x3ffffff) | ((imm) & 0x3ffffff))
+#define AARCH64_IMM19_REPLACE(input, imm) (((input) & ~(0x7ffff << 5)) | (((imm) & 0x7ffff) << 5))
+#define AARCH64_IMM14_REPLACE(input, imm) (((input) & ~(0x3fff << 5)) | (((imm) & 0x3fff) << 5))
+#define MAKE_AARCH64_B(imm) (0x14000000 | ((imm) & 0x3ffffff))
+#define MAKE_AARCH64_BLR(Rn) (0xd63f0000 | (((Rn) & 0x1f) << 5))
+#define AARCH64_NOP 0xd503201f
+
+// Offset from current instruction to next available data region
+#define LH_INS_OFFSET (code_size - LHStreamTell(code) + LHStreamTell(data))
+
+static void LHAArch64EmitJump(LHStream *code, LHStream *data, size_t code_size, uint64_t target, bool link) {
+	/**
+	 * Jump (or call, if `link` is set) to an absolute address using x16.
+	 */
+	
+	LHStreamWrite32(code, MAKE_AARCH64_LDR_LITERAL(1, LH_INS_OFFSET >> 2, 16));
+	LHStreamWrite32(code, link ? MAKE_AARCH64_BLR(16) : MAKE_AARCH64_BR(16));
+	LHStreamWrite64(data, target);
+}
+
+static void LHAArch64EmitBlock(LHStream *code, LHStream *data, uint32_t *old_block, size_t block_size, size_t code_size, size_t *positions) {
+	/**
+	 * Write the rewritten instructions for LHRewriteAArch64Block. This is run
+	 * twice: once to find out how big the code is (and where each instruction
+	 * ends up in `positions`) and again with the real `code_size` so that the
+	 * literal offsets are correct.
+	 */
+	
+	for (size_t i = 0; i < block_size; i++) {
+		uint32_t ins = old_block[i];
+		uint8_t *pc = (uint8_t *) &old_block[i];
+		
+		positions[i] = LHStreamTell(code);
+		
+		if (IS_AARCH64_ADR(ins)) {
+			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
+			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21);
+			
+			size_t result = (size_t) (pc + imm);
+			size_t offset = LH_INS_OFFSET;
+			
+			LHStreamWrite32(code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
+			LHStreamWrite64(data, result);
+		}
+		else if (IS_AARCH64_ADRP(ins)) {
+			// similar to adr but works with respect to pages
+			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
+			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21) << 12;
+			
+			size_t result = (size_t) pc;
+			result &= 0xfffffffffffff000;
+			result += imm;
+			size_t offset = LH_INS_OFFSET;
+			
+			LHStreamWrite32(code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
+			LHStreamWrite64(data, result);
+		}
+		else if (IS_AARCH64_LOAD_LITERAL(ins)) {
+			// All the literal loads (LDR, LDRSW, SIMD LDR and PRFM) keep their
+			// encoding and just load a copy of the data from our literal pool
+			uint32_t opc = ins >> 30;
+			bool simd = (ins >> 26) & 1;
+			size_t size = simd ? (4 << opc) : (opc == 1 ? 8 : 4);
+			uint8_t *addr = pc + AARCH64_IMM19_DECODE(ins);
+			
+			if (!simd && opc == 3) {
+				// Prefetch, which we can just drop
+				LHStreamWrite32(code, AARCH64_NOP);
+				continue;
+			}
+			
+			uint8_t value[16] = {0};
+			memcpy(value, addr, size);
+			
+			LHStreamWrite32(code, AARCH64_IMM19_REPLACE(ins, LH_INS_OFFSET >> 2));
+			LHStreamWrite(data, (size + 7) & ~7, value);
+		}
+		else if (IS_AARCH64_B(ins) || IS_AARCH64_BL(ins) || IS_AARCH64_B_COND(ins) || IS_AARCH64_CBZ(ins) || IS_AARCH64_TBZ(ins)) {
+			bool is_b = IS_AARCH64_B(ins) || IS_AARCH64_BL(ins);
+			int64_t imm = IS_AARCH64_TBZ(ins) ? AARCH64_IMM14_DECODE(ins) : (is_b ? AARCH64_IMM26_DECODE(ins) : AARCH64_IMM19_DECODE(ins));
+			uint32_t *target = (uint32_t *) (pc + imm);
+			
+			if (target >= old_block && target < old_block + block_size) {
+				// Branch inside the block, so go to where that instruction
+				// ended up in the trampoline instead
+				int64_t rel = ((int64_t) positions[target - old_block] - (int64_t) LHStreamTell(code)) >> 2;
+				
+				if (IS_AARCH64_TBZ(ins)) { ins = AARCH64_IMM14_REPLACE(ins, rel); }
+				else if (is_b) { ins = AARCH64_IMM26_REPLACE(ins, rel); }
+				else { ins = AARCH64_IMM19_REPLACE(ins, rel); }
+				
+				LHStreamWrite32(code, ins);
+			}
+			else if (is_b) {
+				LHAArch64EmitJump(code, data, code_size, (uint64_t) target, IS_AARCH64_BL(ins));
+			}
+			else {
+				// Conditional, so branch over a B that skips the long jump:
+				// b.cond/cbz/tbz +8; b +12; ldr x16, target; br x16
+				if (IS_AARCH64_TBZ(ins)) { ins = AARCH64_IMM14_REPLACE(ins, 2); }
+				else { ins = AARCH64_IMM19_REPLACE(ins, 2); }
+				
+				LHStreamWrite32(code, ins);
+				LHStreamWrite32(code, MAKE_AARCH64_B(3));
+				LHAArch64EmitJump(code, data, code_size, (uint64_t) target, false);
+			}
+		}
+		else {
+			LHStreamWrite32(code, ins);
+		}
+	}
+	
+	// Insert jump back to end
+	// TODO: Actually figure out which registers are available to use instead of
+	// just using x16
+	LHAArch64EmitJump(code, data, code_size, (uint64_t) (old_block + block_size), false);
+	
+	// Keep the literal pool 8 byte aligned
+	if (LHStreamTell(code) & 7) {
+		LHStreamWrite32(code, AARCH64_NOP);
+	}
+}
+
+static uint32_t *LHRewriteAArch64Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+	/**
+	 * Rewrite a block of instructions located at `old_block` to be position
+	 * indepedent, also inserting a jump back to (old_block + block_size) at the
+	 * end.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	size_t positions[block_size];
+	
+	// Find out how big the code will be
+	LHAArch64EmitBlock(&code, &data, old_block, block_size, 0, positions);
+	size_t code_size = LHStreamTell(&code);
+	
+	// Then write it for real
+	LHStreamInit(&code);
+	LHStreamInit(&data);
+	LHAArch64EmitBlock(&code, &data, old_block, block_size, code_size, positions);
+	
+	// Copy to trampoline block
+	LH_COPY_TO_NEW_BLOCK();
+}
+
+static void LHWriteAArch64LongJump(uint32_t *code, void *target) {
+	code[0] = MAKE_AARCH64_LDR_LITERAL(1, 8 >> 2, 16);
+	code[1] = MAKE_AARCH64_BR(16);
+	memcpy(&code[2], &target, sizeof target);
+}
+
+// B reaches +-128MB, keep some margin for the size of the veneer
+#define LH_AARCH64_NEAR_RANGE 0x7ff0000
+
+// Size of the veneer used when a hook is out of range of a B
+#define LH_VENEER_SIZE (4 * sizeof(uint32_t))
+
+static bool LHWriteAArch64NearJump(LHHooker *self, uint32_t *code, uint32_t *at, void *target, void **veneer_out) {
+	/**
+	 * Write a single B to `target` for when `code` will be placed at `at`,
+	 * going through a veneer allocated within range if the target itself is
+	 * too far away. The veneer, if any, is written to `veneer_out`. Returns
+	 * false if there is no memory close enough for the veneer.
+	 */
+	
+	if (!LHIsNear(target, 0, at, LH_AARCH64_NEAR_RANGE)) {
+		void *veneer_exec;
+		uint32_t *veneer = LHHookerAllocNear(self, LH_VENEER_SIZE, at, LH_AARCH64_NEAR_RANGE, &veneer_exec);
+		
+		if (!veneer) {
+			return false;
+		}
+		
+		LHWriteAArch64LongJump(veneer, target);
+		__builtin___clear_cache(veneer_exec, veneer_exec + LH_VENEER_SIZE);
+		
+		target = veneer_exec;
+		*veneer_out = veneer_exec;
+	}
+	
+	code[0] = MAKE_AARCH64_B(((int64_t) (intptr_t) target - (int64_t) (intptr_t) at) >> 2);
+	
+	return true;
+}
+
+static size_t LHHookerMakePatch(LHHooker *self, void *function, void *hook, void *patch, void **veneer) {
+	/**
+	 * Write the code that redirects `function` to `hook` into `patch`, and
+	 * return its size. A single instruction is preferred since that only needs
+	 * one instruction relocated and can be written atomically. Any veneer
+	 * allocated for the patch is written to `veneer` so it can be freed if
+	 * the patch isn't used.
+	 */
+	
+	*veneer = NULL;
+	
+	if (LHWriteAArch64NearJump(self, patch, function, hook, veneer)) {
+		return sizeof(uint32_t);
+	}
+	
+	LHWriteAArch64LongJump(patch, hook);
+	
+	return 4 * sizeof(uint32_t);
+}
+
+static void *LHHookerRelocate(LHHooker *self, void *function, size_t patch_size) {
+	return LHRewriteAArch64Block(self, function, patch_size / sizeof(uint32_t));
+}
+
+#undef LH_INS_OFFSET
+
+#endif // LH_AARCH64
+
+#ifdef LH_AARCH32
+
+// Extra encodings used when rewriting branches
+#define IS_AARCH32_B(input) ((input & 0x0e000000) == 0x0a000000 && (input >> 28) != 0xf)
+#define IS_AARCH32_BLX_IMM(input) ((input & 0xfe000000) == 0xfa000000)
+#define AARCH32_B_DECODE_IMM(input) ((int32_t) ((input) << 8) >> 6)
+#define AARCH32_B_REPLACE_IMM(input, imm) (((input) & 0xff000000) | ((imm) & 0xffffff))
+#define AARCH32_SET_COND(input, cond) (((input) & 0x0fffffff) | ((uint32_t) (cond) << 28))
+#define MAKE_AARCH32_MOV_LR_PC 0xe1a0e00f
+
+// AArch32, so the PC points to (instruction + 8) for regular arm modea
+#define LH_INS_OFFSET (code_size - LHStreamTell(code) + LHStreamTell(data) - 8)
+#define LH_PC_VALUE_ALIGNED ((((uint32_t) (uintptr_t) &old_block[i]) + 8) & 0xfffffffc)
+
+static uint32_t LHAArch32ExpandImm(uint32_t imm12) {
+	/**
+	 * Decode an ARM modified immediate (8 bits rotated right by twice the top
+	 * four bits).
+	 */
+	
+	uint32_t value = imm12 & 0xff;
+	uint32_t rot = ((imm12 >> 8) & 0xf) * 2;
+	
+	return rot ? ((value >> rot) | (value << (32 - rot))) : value;
+}
+
+static void LHAArch32EmitJump(LHStream *code, LHStream *data, size_t code_size, uint32_t cond, uint32_t target, bool link) {
+	/**
+	 * Jump (or call, if `link` is set) to an absolute address by loading it
+	 * straight into the PC, which also switches to thumb if bit 0 is set.
+	 */
+	
+	if (link) {
+		LHStreamWrite32(code, AARCH32_SET_COND(MAKE_AARCH32_MOV_LR_PC, cond));
+	}
+	
+	LHStreamWrite32(code, AARCH32_SET_COND(MAKE_AARCH32_LDR_LITERAL(1, 15, LH_INS_OFFSET), cond));
+	LHStreamWrite32(data, target);
+}
+
+static void LHAArch32EmitBlock(LHStream *code, LHStream *data, uint32_t *old_block, size_t block_size, size_t code_size, size_t *positions) {
+	/**
+	 * Write the rewritten instructions for LHRewriteAArch32Block. Like on
+	 * AArch64 this is run once to get the code size and then for real.
+	 */
+	
+	for (size_t i = 0; i < block_size; i++) {
+		uint32_t ins = old_block[i];
+		uint32_t pc = (uint32_t) (uintptr_t) &old_block[i];
+		
+		positions[i] = LHStreamTell(code);
+		
+		if (IS_AARCH32_ADR(ins)) {
+			uint32_t Rd = AARCH32_ADR_DECODE_RD(ins);
+			uint32_t imm = LHAArch32ExpandImm(AARCH32_ADR_DECODE_IMM(ins));
+			
+			uint32_t result = LH_PC_VALUE_ALIGNED;
+			result += imm;
+			
+			LHStreamWrite32(code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
+			LHStreamWrite32(data, result);
+		}
+		else if (IS_AARCH32_ADR_SUB(ins)) {
 			uint32_t Rd = AARCH32_ADR_DECODE_RD(ins);
-			uint32_t imm = AARCH32_ADR_DECODE_IMM(ins);
+			uint32_t imm = LHAArch32ExpandImm(AARCH32_ADR_DECODE_IMM(ins));
 			
 			uint32_t result = LH_PC_VALUE_ALIGNED;
 			result -= imm;
 			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
-			LHStreamWrite32(&data, result);
+			LHStreamWrite32(code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
+			LHStreamWrite32(data, result);
 		}
 		else if (IS_AARCH32_LDR_LITERAL(ins)) {
 			bool U = AARCH32_LDR_LITERAL_DECODE_U(ins);
@@ -336,63 +1267,1478 @@ uint32_t *LHRewriteAArch32Block(LHHooker *self, uint32_t *old_block, size_t bloc
 			
 			uint32_t offset = LH_INS_OFFSET;
 			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rt, offset));
-			LHStreamWrite32(&data, ((uint32_t *)addr)[0]);
+			LHStreamWrite32(code, MAKE_AARCH32_LDR_LITERAL(1, Rt, offset));
+			LHStreamWrite32(data, ((uint32_t *) (uintptr_t) addr)[0]);
+		}
+		else if (IS_AARCH32_B(ins)) {
+			uint32_t cond = ins >> 28;
+			bool link = (ins >> 24) & 1;
+			uint32_t target = pc + 8 + AARCH32_B_DECODE_IMM(ins);
+			uint32_t *target_ptr = (uint32_t *) (uintptr_t) target;
+			
+			if (target_ptr >= old_block && target_ptr < old_block + block_size) {
+				// Branch inside the block, so go to where that instruction
+				// ended up in the trampoline instead
+				int32_t rel = ((int32_t) positions[target_ptr - old_block] - (int32_t) LHStreamTell(code) - 8) >> 2;
+				LHStreamWrite32(code, AARCH32_B_REPLACE_IMM(ins, rel));
+			}
+			else {
+				LHAArch32EmitJump(code, data, code_size, cond, target, link);
+			}
+		}
+		else if (IS_AARCH32_BLX_IMM(ins)) {
+			// Always calls thumb code, H gives bit 1 of the target
+			uint32_t target = pc + 8 + AARCH32_B_DECODE_IMM(ins) + (((ins >> 24) & 1) << 1);
+			LHAArch32EmitJump(code, data, code_size, 0xe, target | 1, true);
 		}
 		else {
-			LHStreamWrite32(&code, ins);
+			LHStreamWrite32(code, ins);
 		}
 	}
 	
-	// Insert jump back to rest of function
-	LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, 12, LH_INS_OFFSET));
-	LHStreamWrite32(&code, MAKE_AARCH32_BX(12));
-	LHStreamWrite32(&data, (uint32_t)(old_block + block_size));
+	// Insert jump back to rest of function, loading straight into the PC so
+	// no registers are clobbered. Being the last instruction, the PC is past
+	// the start of the data so the offset is negative.
+	int32_t back_offset = LH_INS_OFFSET;
+	LHStreamWrite32(code, back_offset < 0 ? MAKE_AARCH32_LDR_LITERAL(0, 15, -back_offset) : MAKE_AARCH32_LDR_LITERAL(1, 15, back_offset));
+	LHStreamWrite32(data, (uint32_t) (uintptr_t) (old_block + block_size));
+}
+
+uint32_t *LHRewriteAArch32Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+	/**
+	 * Rewrite a block of asm so that it is position indepedent (for our
+	 * purposes) and has a jump back to the old block at the end.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	size_t positions[block_size];
 	
-	// Copy to rwx block
+	// Find out how big the code will be
+	LHAArch32EmitBlock(&code, &data, old_block, block_size, 0, positions);
+	size_t code_size = LHStreamTell(&code);
+	
+	// Then write it for real
+	LHStreamInit(&code);
+	LHStreamInit(&data);
+	LHAArch32EmitBlock(&code, &data, old_block, block_size, code_size, positions);
+	
+	// Copy to trampoline block
 	LH_COPY_TO_NEW_BLOCK();
 }
 
 void LHWriteAArch32LongJump(uint32_t *code, void *target) {
 	code[0] = MAKE_AARCH32_LDR_LITERAL(1, 12, 0);
 	code[1] = MAKE_AARCH32_BX(12);
-	code[2] = (uint32_t)target;
+	code[2] = (uint32_t) (uintptr_t) target;
 }
 
-static bool LHHookerAArch32Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
-	if (orig) {
-		uint32_t *orig_ptr = LHRewriteAArch32Block(self, function, 3);
+// B reaches +-32MB, keep some margin for the size of the veneer
+#define LH_AARCH32_NEAR_RANGE 0x1ff0000
+#define MAKE_AARCH32_B(imm) (0xea000000 | ((imm) & 0xffffff))
+
+// Size of the veneer used when a hook is out of range of a B
+#define LH_VENEER_SIZE (2 * sizeof(uint32_t))
+
+static bool LHWriteAArch32NearJump(LHHooker *self, uint32_t *code, uint32_t *at, void *target, void **veneer_out) {
+	/**
+	 * Write a single B to `target` for when `code` will be placed at `at`,
+	 * going through a veneer if the target is too far away or is thumb code
+	 * (which B can't switch to). The veneer, if any, is written to
+	 * `veneer_out`.
+	 */
+	
+	if (!LHIsNear(target, 0, at, LH_AARCH32_NEAR_RANGE) || ((uintptr_t) target & 1)) {
+		void *veneer_exec;
+		uint32_t *veneer = LHHookerAllocNear(self, LH_VENEER_SIZE, at, LH_AARCH32_NEAR_RANGE, &veneer_exec);
 		
-		if (!orig_ptr) {
+		if (!veneer) {
 			return false;
 		}
 		
-		orig[0] = orig_ptr;
+		// ldr pc, [pc, #-4]; .word target
+		veneer[0] = MAKE_AARCH32_LDR_LITERAL(0, 15, 4);
+		veneer[1] = (uint32_t) (uintptr_t) target;
+		__builtin___clear_cache(veneer_exec, veneer_exec + LH_VENEER_SIZE);
+		
+		target = veneer_exec;
+		*veneer_out = veneer_exec;
 	}
 	
-	LHWriteAArch32LongJump(function, hook);
+	code[0] = MAKE_AARCH32_B(((int32_t) (uintptr_t) target - (int32_t) (uintptr_t) at - 8) >> 2);
 	
 	return true;
 }
 
+static size_t LHHookerMakePatch(LHHooker *self, void *function, void *hook, void *patch, void **veneer) {
+	// Prefer a single instruction patch, see the AArch64 version
+	*veneer = NULL;
+	
+	if (LHWriteAArch32NearJump(self, patch, function, hook, veneer)) {
+		return sizeof(uint32_t);
+	}
+	
+	LHWriteAArch32LongJump(patch, hook);
+	
+	return 3 * sizeof(uint32_t);
+}
+
+static void *LHHookerRelocate(LHHooker *self, void *function, size_t patch_size) {
+	return LHRewriteAArch32Block(self, function, patch_size / sizeof(uint32_t));
+}
+
 #undef LH_PC_VALUE_ALIGNED
 #undef LH_INS_OFFSET
 
 #endif
 
-bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig) {
-	/**
-	 * Hook the function pointed to by `function` to call `hook`. Optionally
+#if defined(LH_X86) || defined(LH_X86_64)
+
+#ifdef LH_X86_64
+#define LH_X86_LONG_MODE 1
+// Keep a little margin so the whole trampoline stays in rel32 range
+#define LH_X86_NEAR_RANGE 0x7ff00000
+#else
+#define LH_X86_LONG_MODE 0
+#define LH_X86_NEAR_RANGE 0
+#endif
+
+// Size of "jmp [rip+0]" followed by the 64 bit target
+#define LH_X86_ABS_JUMP_SIZE 14
+
+// Size of the relay used when a hook is out of range of a jmp rel32
+#define LH_VENEER_SIZE LH_X86_ABS_JUMP_SIZE
+
+typedef struct LHX86Ins {
+	size_t length;
+	size_t opcode_offset; // offset of the last opcode byte
+	uint8_t opcode;
+	bool two_byte; // opcode is in the 0F map
+	bool operand16; // has a 66 prefix
+	int rip_disp_offset; // offset of a RIP relative disp32, or -1
+	int rel_size; // size of relative branch immediate at the end, or 0
+} LHX86Ins;
+
+// One bit per opcode which has a ModRM byte, for the one byte and 0F maps
+static const uint32_t gLHX86ModRM1[8] = {
+	0x0f0f0f0f, 0x0f0f0f0f, 0x00000000, 0x00000a0c,
+	0x0000ffff, 0x00000000, 0xff0f00f3, 0xc0c00000,
+};
+
+static const uint32_t gLHX86ModRM2[8] = {
+	0xffffa00f, 0x0000ff0f, 0xffffffff, 0xff7fffff,
+	0xffff0000, 0xfffff838, 0xffff00ff, 0xffffffff,
+};
+
+#define LH_X86_HAS_BIT(table, op) ((table[(op) >> 5] >> ((op) & 31)) & 1)
+
+static size_t LHX86ModRMSize(const uint8_t *p, bool addr16, bool *rip_relative) {
+	/**
+	 * Get the size of a ModRM byte along with any SIB and displacement.
+	 */
+	
+	uint8_t mod = p[0] >> 6, rm = p[0] & 7;
+	size_t size = 1;
+	
+	*rip_relative = false;
+	
+	if (mod == 3) {
+		return size;
+	}
+	
+	if (addr16) {
+		if (mod == 0 && rm == 6) { return size + 2; }
+		return size + (mod == 1 ? 1 : (mod == 2 ? 2 : 0));
+	}
+	
+	if (rm == 4) {
+		size++;
+		
+		if (mod == 0 && (p[1] & 7) == 5) {
+			return size + 4;
+		}
+	}
+	else if (mod == 0 && rm == 5) {
+		*rip_relative = LH_X86_LONG_MODE;
+		return size + 4;
+	}
+	
+	return size + (mod == 1 ? 1 : (mod == 2 ? 4 : 0));
+}
+
+static bool LHX86Decode(const uint8_t *code, LHX86Ins *ins) {
+	/**
+	 * Find the length of the instruction at `code` and anything about it that
+	 * needs fixing up when it is moved. Returns false for anything we don't
+	 * understand.
+	 */
+	
+	const uint8_t *p = code;
+	bool addr16 = false, rex_w = false, has_modrm = false, rip_relative = false;
+	size_t imm = 0;
+	
+	memset(ins, 0, sizeof *ins);
+	ins->rip_disp_offset = -1;
+	
+	// Legacy prefixes
+	for (;; p++) {
+		if (*p == 0x66) { ins->operand16 = true; }
+		else if (*p == 0x67) { addr16 = !LH_X86_LONG_MODE; }
+		else if (*p == 0xf0 || *p == 0xf2 || *p == 0xf3 || *p == 0x2e || *p == 0x36 || *p == 0x3e || *p == 0x26 || *p == 0x64 || *p == 0x65) { }
+		else { break; }
+		
+		if (p - code >= 14) {
+			return false;
+		}
+	}
+	
+	// REX prefix
+	if (LH_X86_LONG_MODE && (*p & 0xf0) == 0x40) {
+		rex_w = (*p & 8) != 0;
+		p++;
+	}
+	
+	uint8_t op = *p;
+	
+	// VEX and EVEX, which are LES/LDS/BOUND in 32 bit mode unless the next
+	// byte looks like a register ModRM
+	if ((op == 0xc4 || op == 0xc5 || op == 0x62) && (LH_X86_LONG_MODE || (p[1] & 0xc0) == 0xc0)) {
+		size_t map = 1;
+		
+		if (op == 0xc5) { p += 2; }
+		else if (op == 0xc4) { map = p[1] & 0x1f; p += 3; }
+		else { map = p[1] & 0x03; p += 4; }
+		
+		ins->opcode_offset = p - code;
+		ins->opcode = *p;
+		ins->two_byte = true;
+		p++;
+		
+		if (map == 3 || (map == 1 && ((ins->opcode >= 0x70 && ins->opcode <= 0x73) || (ins->opcode >= 0xc4 && ins->opcode <= 0xc6) || ins->opcode == 0xc2))) {
+			imm = 1;
+		}
+		
+		// vzeroupper/vzeroall are the only ones without ModRM
+		has_modrm = !(map == 1 && ins->opcode == 0x77);
+	}
+	else if (op == 0x0f) {
+		p++;
+		op = *p;
+		
+		if (op == 0x38 || op == 0x3a) {
+			imm = (op == 0x3a);
+			p++;
+			has_modrm = true;
+		}
+		else {
+			has_modrm = LH_X86_HAS_BIT(gLHX86ModRM2, op);
+			
+			if ((op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac || op == 0xba || (op >= 0xc2 && op <= 0xc6) || op == 0x0f) {
+				imm = 1;
+			}
+			else if (op >= 0x80 && op <= 0x8f) {
+				// 66 is ignored on branches in 64 bit mode
+				imm = (ins->operand16 && !LH_X86_LONG_MODE) ? 2 : 4;
+				ins->rel_size = imm;
+			}
+		}
+		
+		ins->opcode_offset = p - code;
+		ins->opcode = *p;
+		ins->two_byte = true;
+		p++;
+	}
+	else {
+		ins->opcode_offset = p - code;
+		ins->opcode = op;
+		p++;
+		
+		has_modrm = LH_X86_HAS_BIT(gLHX86ModRM1, op);
+		
+		size_t immz = ins->operand16 ? 2 : 4;
+		
+		if (op < 0x40 && (op & 7) == 4) { imm = 1; }
+		else if (op < 0x40 && (op & 7) == 5) { imm = immz; }
+		else if (op == 0x68 || op == 0x69 || op == 0x81 || op == 0xa9 || op == 0xc7) { imm = immz; }
+		else if (op == 0x6a || op == 0x6b || op == 0x80 || op == 0x82 || op == 0x83 || op == 0xa8 || op == 0xc0 || op == 0xc1 || op == 0xc6 || op == 0xcd || op == 0xd4 || op == 0xd5) { imm = 1; }
+		else if (op >= 0xb0 && op <= 0xb7) { imm = 1; }
+		else if (op >= 0xb8 && op <= 0xbf) { imm = rex_w ? 8 : immz; }
+		else if (op >= 0xa0 && op <= 0xa3) { imm = LH_X86_LONG_MODE ? 8 : (addr16 ? 2 : 4); }
+		else if (op == 0xc2 || op == 0xca) { imm = 2; }
+		else if (op == 0xc8) { imm = 3; }
+		else if (op == 0x9a || op == 0xea) { imm = immz + 2; }
+		else if (op >= 0xe4 && op <= 0xe7) { imm = 1; }
+		else if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3) || op == 0xeb) { imm = 1; ins->rel_size = 1; }
+		else if (op == 0xe8 || op == 0xe9) { imm = LH_X86_LONG_MODE ? 4 : immz; ins->rel_size = imm; }
+		else if (op == 0xf6 && (p[0] & 0x38) < 0x10) { imm = 1; }
+		else if (op == 0xf7 && (p[0] & 0x38) < 0x10) { imm = immz; }
+	}
+	
+	if (has_modrm) {
+		size_t modrm_size = LHX86ModRMSize(p, addr16, &rip_relative);
+		
+		if (rip_relative) {
+			ins->rip_disp_offset = (p + 1) - code;
+		}
+		
+		p += modrm_size;
+	}
+	
+	p += imm;
+	
+	ins->length = p - code;
+	
+	return ins->length <= 15;
+}
+
+static bool LHX86Reachable(uint8_t *from, void *to) {
+	/**
+	 * Check if `to` can be reached with a rel32 from the end of an instruction
+	 * ending at `from`.
+	 */
+	
+	int64_t delta = (int64_t) (intptr_t) to - (int64_t) (intptr_t) from;
+	
+	return !LH_X86_LONG_MODE || delta == (int32_t) delta;
+}
+
+static void LHX86WriteRel32(LHStream *code, uint8_t *at, void *to) {
+	LHStreamWrite32(code, (uint32_t) ((uint8_t *) to - (at + 4)));
+}
+
+static void LHX86EmitJump(LHStream *code, uint8_t *exec, uint8_t op, void *target) {
+	/**
+	 * Emit a jmp (E9) or call (E8) to `target`, going through an absolute
+	 * address when it is out of rel32 range. `exec` is where the stream will
+	 * be run from.
+	 */
+	
+	uint8_t *at = exec + LHStreamTell(code);
+	
+	if (LHX86Reachable(at + 5, target)) {
+		LHStreamWrite(code, 1, &op);
+		LHX86WriteRel32(code, at + 1, target);
+		return;
+	}
+	
+	uint64_t addr = (uint64_t) (uintptr_t) target;
+	
+	if (op == 0xe9) {
+		// jmp [rip+0]
+		LHStreamWrite(code, 6, "\xff\x25\x00\x00\x00\x00");
+	}
+	else {
+		// call [rip+2]; jmp +8
+		LHStreamWrite(code, 8, "\xff\x15\x02\x00\x00\x00\xeb\x08");
+	}
+	
+	LHStreamWrite64(code, addr);
+}
+
+static void *LHRewriteX86Block(LHHooker *self, uint8_t *old_block, size_t min_size, size_t *block_size) {
+	/**
+	 * Copy whole instructions from `old_block` until at least `min_size`
+	 * bytes are covered, fixing up anything relative to the instruction
+	 * pointer, then add a jump back to the rest of the function. The number
+	 * of bytes covered is written to `block_size`.
+	 */
+	
+	void *exec;
+	uint8_t *new_block = LHHookerAllocNear(self, LH_STREAM_MAX_SIZE, old_block, LH_X86_NEAR_RANGE, &exec);
+	
+	if (!new_block) {
+		return NULL;
+	}
+	
+	LHStream code; LHStreamInit(&code);
+	size_t offset = 0;
+	bool ended = false;
+	
+	while (offset < min_size) {
+		LHX86Ins ins;
+		uint8_t *src = old_block + offset;
+		uint8_t *dst = (uint8_t *) exec + LHStreamTell(&code);
+		
+		if (ended || !LHX86Decode(src, &ins)) {
+			goto fail;
+		}
+		
+		if (ins.rel_size) {
+			int32_t rel = (ins.rel_size == 1) ? (int8_t) src[ins.length - 1] : (ins.rel_size == 2) ? (int16_t) (src[ins.length - 2] | (src[ins.length - 1] << 8)) : (int32_t) (src[ins.length - 4] | (src[ins.length - 3] << 8) | (src[ins.length - 2] << 16) | ((uint32_t) src[ins.length - 1] << 24));
+			uint8_t *target = src + ins.length + rel;
+			
+			// "call next; pop reg" gets the address of the original code
+			if (!ins.two_byte && ins.opcode == 0xe8 && rel == 0) {
+#ifdef LH_X86_64
+				// push [rip+2]; jmp +8; .quad target
+				LHStreamWrite(&code, 8, "\xff\x35\x02\x00\x00\x00\xeb\x08");
+				LHStreamWrite64(&code, (uint64_t) (uintptr_t) target);
+#else
+				LHStreamWrite8(&code, 0x68);
+				LHStreamWrite32(&code, (uint32_t) (uintptr_t) target);
+#endif
+				offset += ins.length;
+				continue;
+			}
+
+#ifdef LH_X86
+			// i386 PIC code calls __x86.get_pc_thunk.reg (mov reg, [esp]; ret)
+			// right at the start of functions, so load the original return
+			// address directly instead
+			if (!ins.two_byte && ins.opcode == 0xe8 && target[0] == 0x8b && (target[1] & 0xc7) == 0x04 && target[2] == 0x24 && target[3] == 0xc3) {
+				uint8_t mov = 0xb8 | ((target[1] >> 3) & 7);
+				LHStreamWrite(&code, 1, &mov);
+				LHStreamWrite32(&code, (uint32_t) (uintptr_t) (src + ins.length));
+				offset += ins.length;
+				continue;
+			}
+#endif
+			
+			// Branches back into the bytes we are overwriting can't work and
+			// 16 bit branches are too rare to bother with
+			if ((target > old_block && target < old_block + min_size) || ins.rel_size == 2) {
+				goto fail;
+			}
+			
+			if (!ins.two_byte && (ins.opcode == 0xe8 || ins.opcode == 0xe9 || ins.opcode == 0xeb)) {
+				LHX86EmitJump(&code, exec, ins.opcode == 0xe8 ? 0xe8 : 0xe9, target);
+				ended = (ins.opcode != 0xe8);
+			}
+			else if (!ins.two_byte && ins.opcode >= 0xe0 && ins.opcode <= 0xe3) {
+				// loop/jcxz only come in rel8, so branch over a jump to the
+				// real target: op +2; jmp +N; jmp target
+				LHStreamWrite(&code, ins.opcode_offset + 1, src);
+				LHStreamWrite(&code, 3, "\x02\xeb\x00");
+				size_t skip_at = LHStreamTell(&code) - 1;
+				LHX86EmitJump(&code, exec, 0xe9, target);
+				
+				if (!code.overflow) {
+					code.data[skip_at] = LHStreamTell(&code) - skip_at - 1;
+				}
+			}
+			else {
+				// jcc, either rel8 or rel32
+				uint8_t cc = ins.opcode & 0xf;
+				
+				if (LHX86Reachable(dst + 6, target)) {
+					uint8_t jcc[2] = { 0x0f, 0x80 | cc };
+					LHStreamWrite(&code, 2, jcc);
+					LHX86WriteRel32(&code, dst + 2, target);
+				}
+				else {
+					// Inverted condition skipping an absolute jump
+					uint8_t jncc[2] = { 0x70 | (cc ^ 1), LH_X86_ABS_JUMP_SIZE };
+					LHStreamWrite(&code, 2, jncc);
+					LHStreamWrite(&code, 6, "\xff\x25\x00\x00\x00\x00");
+					LHStreamWrite64(&code, (uint64_t) (uintptr_t) target);
+				}
+			}
+		}
+		else if (ins.rip_disp_offset >= 0) {
+			int32_t disp;
+			memcpy(&disp, src + ins.rip_disp_offset, sizeof disp);
+			
+			int64_t new_disp = (int64_t) disp + ((int64_t) (intptr_t) src - (int64_t) (intptr_t) dst);
+			
+			if (new_disp != (int32_t) new_disp) {
+				goto fail;
+			}
+			
+			disp = new_disp;
+			
+			size_t start = LHStreamTell(&code);
+			LHStreamWrite(&code, ins.length, src);
+			
+			if (!code.overflow) {
+				memcpy(code.data + start + ins.rip_disp_offset, &disp, sizeof disp);
+			}
+		}
+		else {
+			LHStreamWrite(&code, ins.length, src);
+			
+			// ret, jmp r/m, int3 and ud2 end the function
+			ended = (!ins.two_byte && (ins.opcode == 0xc3 || ins.opcode == 0xc2 || ins.opcode == 0xcc || (ins.opcode == 0xff && ((src[ins.opcode_offset + 1] >> 3) & 7) == 4))) || (ins.two_byte && ins.opcode == 0x0b);
+		}
+		
+		offset += ins.length;
+	}
+	
+	// Insert jump back to rest of function
+	if (!ended) {
+		LHX86EmitJump(&code, exec, 0xe9, old_block + offset);
+	}
+	
+	if (code.overflow) {
+		goto fail;
+	}
+	
+	memcpy(new_block, code.data, LHStreamTell(&code));
+	LHHookerTrim(self, exec, LHStreamTell(&code));
+	
+	*block_size = offset;
+	
+	return exec;
+
+fail:
+	LHHookerTrim(self, exec, 0);
+	return NULL;
+}
+
+static size_t LHHookerMakePatch(LHHooker *self, void *function, void *hook, void *patch_out, void **veneer) {
+	/**
+	 * Make the jump to an x86 hook. This is a 5 byte jmp rel32 when the hook
+	 * (or a stub jumping to it) is in range, or a 14 byte absolute jump
+	 * otherwise. The stub, if any, is written to `veneer`.
+	 */
+	
+	LHStream patch; LHStreamInit(&patch);
+	*veneer = NULL;
+	
+	if (LHX86Reachable((uint8_t *) function + 5, hook)) {
+		LHX86EmitJump(&patch, function, 0xe9, hook);
+	}
+	else {
+		void *relay_exec;
+		uint8_t *relay = LHHookerAllocNear(self, LH_VENEER_SIZE, function, LH_X86_NEAR_RANGE, &relay_exec);
+		
+		if (relay) {
+			LHStream stub; LHStreamInit(&stub);
+			LHX86EmitJump(&stub, relay_exec, 0xe9, hook);
+			memcpy(relay, stub.data, LHStreamTell(&stub));
+			LHX86EmitJump(&patch, function, 0xe9, relay_exec);
+			*veneer = relay_exec;
+		}
+		else {
+			LHX86EmitJump(&patch, function, 0xe9, hook);
+		}
+	}
+	
+	memcpy(patch_out, patch.data, LHStreamTell(&patch));
+	
+	return LHStreamTell(&patch);
+}
+
+static void *LHHookerRelocate(LHHooker *self, void *function, size_t patch_size) {
+	size_t block_size;
+	return LHRewriteX86Block(self, function, patch_size, &block_size);
+}
+
+#endif // LH_X86 || LH_X86_64
+
+#if !defined(LH_AARCH64) && !defined(LH_AARCH32) && !defined(LH_X86) && !defined(LH_X86_64)
+
+// No backend, so hooking always fails
+#define LH_VENEER_SIZE 0
+
+static size_t LHHookerMakePatch(LHHooker *self, void *function, void *hook, void *patch, void **veneer) {
+	*veneer = NULL;
+	return 0;
+}
+
+static void *LHHookerRelocate(LHHooker *self, void *function, size_t patch_size) {
+	return NULL;
+}
+
+#endif
+
+void LHHookerSetPatchCheck(LHHooker *self, LHPatchCheck check, void *userdata) {
+	/**
+	 * Have `check` called before every hook or probe is written, with the
+	 * bytes it would write over. If it returns false the hook or probe fails.
+	 */
+	
+	self->patch_check = check;
+	self->patch_check_userdata = userdata;
+}
+
+static bool LHHookerCanPatch(LHHooker *self, void *addr, size_t size) {
+	return !self->patch_check || self->patch_check(addr, size, self->patch_check_userdata);
+}
+
+static LHTarget *LHHookerFindTarget(LHHooker *self, void *function) {
+	for (LHTarget *target = self->targets; target; target = target->next) {
+		if (target->function == function) {
+			return target;
+		}
+	}
+	
+	return NULL;
+}
+
+bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig) {
+	/**
+	 * Hook the function pointed to by `function` to call `hook`. Optionally
 	 * write a pointer to where the original function can be invoked at `orig`,
 	 * if it is not null.
+	 * 
+	 * A function can be hooked any number of times. The newest hook is called
+	 * first and its `orig` calls the hook before it, and so on down to the
+	 * original function.
+	 */
+	
+	uint8_t patch[LH_PATCH_MAX_SIZE];
+	void *veneer;
+	size_t patch_size = LHHookerMakePatch(self, function, hook, patch, &veneer);
+	
+	if (!patch_size) {
+		return false;
+	}
+	
+	if (!LHHookerCanPatch(self, function, patch_size)) {
+		LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		return false;
+	}
+	
+	LHTarget *target = LHHookerFindTarget(self, function);
+	
+	if (!target) {
+		target = malloc(sizeof *target);
+		
+		if (!target) {
+			LHHookerFree(self, veneer, LH_VENEER_SIZE);
+			return false;
+		}
+		
+		memset(target, 0, sizeof *target);
+		target->function = function;
+		target->patch_size = patch_size;
+		memcpy(target->original, function, patch_size);
+		
+		// The original code is relocated even if this hook doesn't want it,
+		// since later hooks might. It's fine if that fails until then.
+		target->trampoline = LHHookerRelocate(self, function, patch_size);
+		
+		target->next = self->targets;
+		self->targets = target;
+	}
+	else if (patch_size > target->patch_size) {
+		// Only the first patch_size bytes were relocated, so a bigger patch
+		// would cut into code that is still run
+		LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		return false;
+	}
+	
+	void *next = target->hook_count ? target->hooks[target->hook_count - 1].hook : target->trampoline;
+	
+	if (orig && !next) {
+		LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		return false;
+	}
+	
+	LHHookEntry *hooks = realloc(target->hooks, (target->hook_count + 1) * sizeof *hooks);
+	
+	if (!hooks) {
+		LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		return false;
+	}
+	
+	target->hooks = hooks;
+	target->hooks[target->hook_count].hook = hook;
+	target->hooks[target->hook_count].orig = orig;
+	target->hook_count++;
+	
+	void *old_orig = orig ? orig[0] : NULL;
+	
+	if (orig) {
+		orig[0] = next;
+	}
+	
+	if (!LHHookerApplyPatch(self, function, patch, patch_size)) {
+		// Undo everything, so the hook isn't left half installed
+		target->hook_count--;
+		
+		if (orig) {
+			orig[0] = old_orig;
+		}
+		
+		LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		return false;
+	}
+	
+	return true;
+}
+
+bool LHHookerUnhook(LHHooker *self, void *function, void *hook) {
+	/**
+	 * Remove a hook made by LHHookerHookFunction(). The hooks around it are
+	 * linked back together, and once a function has no hooks left its
+	 * original code is restored so it costs nothing. Returns false if the hook
+	 * isn't installed.
+	 * 
+	 * The hook function itself must stay valid, since other threads might
+	 * still be running it.
 	 */
 	
-	bool success = false;
+	LHTarget *target = LHHookerFindTarget(self, function);
+	
+	if (!target) {
+		return false;
+	}
+	
+	size_t index;
+	
+	for (index = 0; index < target->hook_count; index++) {
+		if (target->hooks[index].hook == hook) {
+			break;
+		}
+	}
+	
+	if (index == target->hook_count) {
+		return false;
+	}
+	
+	// What this hook was calling as its original function
+	void *next = index ? target->hooks[index - 1].hook : target->trampoline;
+	bool success = true;
+	
+	if (index + 1 < target->hook_count) {
+		// Point the next newest hook past this one
+		void **orig = target->hooks[index + 1].orig;
+		
+		if (orig) {
+			__atomic_store_n(orig, next, __ATOMIC_RELEASE);
+		}
+	}
+	else if (index) {
+		// This was the newest hook, so the function now enters the one before
+		uint8_t patch[LH_PATCH_MAX_SIZE];
+		void *veneer;
+		size_t patch_size = LHHookerMakePatch(self, function, next, patch, &veneer);
+		
+		success = patch_size && patch_size <= target->patch_size && LHHookerApplyPatch(self, function, patch, patch_size);
+		
+		if (!success) {
+			LHHookerFree(self, veneer, LH_VENEER_SIZE);
+		}
+	}
+	else {
+		success = LHHookerApplyPatch(self, function, target->original, target->patch_size);
+	}
+	
+	memmove(&target->hooks[index], &target->hooks[index + 1], (target->hook_count - index - 1) * sizeof *target->hooks);
+	target->hook_count--;
+	
+	return success;
+}
+
+/**
+ * Probes
+ * 
+ * A probe replaces a single instruction anywhere in a function with a jump to
+ * a stub that saves every register into an LHProbeContext, calls the probe
+ * callback, restores the (possibly modified) registers and then runs the
+ * displaced instruction before going back. The stub has to be in direct
+ * branch range so that entering it doesn't clobber anything.
+ */
+
 #ifdef LH_AARCH64
-	success = LHHookerAArch64Function(self, function, hook, (uint32_t **) orig);
-#elif defined(LH_AARCH32)
-	success = LHHookerAArch32Function(self, function, hook, (uint32_t **) orig);
+
+#define LH_PROBE_FRAME_SIZE ((sizeof(LHProbeContext) + 15) & ~15)
+
+// Load/store pairs of registers at [sp, #offset]
+#define MAKE_AARCH64_STP_SP(Rt, Rt2, offset) (0xa9000000 | ((((offset) >> 3) & 0x7f) << 15) | ((Rt2) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_LDP_SP(Rt, Rt2, offset) (0xa9400000 | ((((offset) >> 3) & 0x7f) << 15) | ((Rt2) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_STP_Q_SP(Rt, Rt2, offset) (0xad000000 | ((((offset) >> 4) & 0x7f) << 15) | ((Rt2) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_LDP_Q_SP(Rt, Rt2, offset) (0xad400000 | ((((offset) >> 4) & 0x7f) << 15) | ((Rt2) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_STR_SP(Rt, offset) (0xf9000000 | (((offset) >> 3) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_LDR_SP(Rt, offset) (0xf9400000 | (((offset) >> 3) << 10) | (31 << 5) | (Rt))
+#define MAKE_AARCH64_ADD_FROM_SP(Rd, imm) (0x910003e0 | ((imm) << 10) | (Rd))
+#define MAKE_AARCH64_SUB_SP(imm) (0xd10003ff | ((imm) << 10))
+#define MAKE_AARCH64_ADD_SP(imm) (0x910003ff | ((imm) << 10))
+#define MAKE_AARCH64_MRS_NZCV(Rt) (0xd53b4200 | (Rt))
+#define MAKE_AARCH64_MSR_NZCV(Rt) (0xd51b4200 | (Rt))
+#define AARCH64_CMP_X16_X17 0xeb11021f
+
+static bool LHAArch64IsPCRelative(uint32_t ins) {
+	return IS_AARCH64_ADR(ins) || IS_AARCH64_ADRP(ins) || IS_AARCH64_LOAD_LITERAL(ins) || IS_AARCH64_B(ins) || IS_AARCH64_BL(ins) || IS_AARCH64_B_COND(ins) || IS_AARCH64_CBZ(ins) || IS_AARCH64_TBZ(ins);
+}
+
+#define AARCH64_PUSH_X16_X17 0xa9bf47f0 // stp x16, x17, [sp, #-16]!
+#define AARCH64_POP_X16_X17 0xa8c147f0 // ldp x16, x17, [sp], #16
+
+static void LHAArch64WriteProbeResume(LHStream *code, uint32_t *addr, bool displaced, void *exec) {
+	/**
+	 * Run the displaced instruction and carry on after it. Most instructions
+	 * can be copied as is, the rest were relocated to the block in literal 3.
+	 */
+	
+	if (displaced) {
+		LHStreamWrite32(code, MAKE_AARCH64_LDR_LITERAL(1, (int64_t) (3 * 8 - (int64_t) LHStreamTell(code)) >> 2, 16));
+		LHStreamWrite32(code, MAKE_AARCH64_BR(16));
+	}
+	else {
+		LHStreamWrite32(code, addr[0]);
+		LHStreamWrite32(code, MAKE_AARCH64_B(((int64_t) (intptr_t) (addr + 1) - (int64_t) (intptr_t) ((uint8_t *) exec + LHStreamTell(code))) >> 2));
+	}
+}
+
+static size_t LHHookerMakeProbe(LHHooker *self, uint32_t *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread, void *patch) {
+	/**
+	 * Build the probe stub for `addr` and write the branch to it to `patch`.
+	 * Returns the patch size or zero on failure.
+	 */
+	
+	// Instructions using the pc go through the usual rewriting, which clobbers
+	// x16 if they end up needing an absolute jump
+	uint32_t *displaced = NULL;
+	
+	if (LHAArch64IsPCRelative(addr[0])) {
+		displaced = LHRewriteAArch64Block(self, addr, 1);
+		
+		if (!displaced) {
+			return 0;
+		}
+	}
+	
+	// Literals go first so their offsets are known while writing the code
+	uint64_t literals[5] = { (uint64_t) addr, (uint64_t) userdata, (uint64_t) callback, (uint64_t) displaced, (uint64_t) thread };
+	
+	void *exec;
+	uint8_t *stub = LHHookerAllocNear(self, LH_STREAM_MAX_SIZE, addr, LH_AARCH64_NEAR_RANGE, &exec);
+	
+	if (!stub) {
+		return 0;
+	}
+	
+	LHStream code; LHStreamInit(&code);
+	LHStreamWrite(&code, sizeof literals, literals);
+	
+	#define LH_LITERAL(n) ((int64_t) ((n) * 8 - (int64_t) LHStreamTell(&code)) >> 2)
+	
+	// Other threads go straight on to the displaced instruction, only using
+	// the stack for the two registers needed to check
+	if (thread) {
+		LHStreamWrite32(&code, AARCH64_PUSH_X16_X17);
+		LHStreamWrite32(&code, 0xd53bd050); // mrs x16, tpidr_el0
+		LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_LITERAL(4), 17));
+		LHStreamWrite32(&code, 0xf9400231); // ldr x17, [x17]
+		LHStreamWrite32(&code, 0xca110210); // eor x16, x16, x17
+		size_t cbz_at = LHStreamWrite32(&code, 0);
+		LHStreamWrite32(&code, AARCH64_POP_X16_X17);
+		LHAArch64WriteProbeResume(&code, addr, displaced != NULL, exec);
+		
+		if (!code.overflow) {
+			// cbz x16 to here
+			uint32_t cbz = 0xb4000010 | ((((LHStreamTell(&code) - cbz_at) >> 2) & 0x7ffff) << 5);
+			memcpy(code.data + cbz_at, &cbz, sizeof cbz);
+		}
+		
+		LHStreamWrite32(&code, AARCH64_POP_X16_X17);
+	}
+	
+	// Save general registers, the original sp, pc and flags
+	LHStreamWrite32(&code, MAKE_AARCH64_SUB_SP(LH_PROBE_FRAME_SIZE));
+	
+	for (uint32_t i = 0; i < 30; i += 2) {
+		LHStreamWrite32(&code, MAKE_AARCH64_STP_SP(i, i + 1, i * 8));
+	}
+	
+	LHStreamWrite32(&code, MAKE_AARCH64_STR_SP(30, offsetof(LHProbeContext, x[30])));
+	LHStreamWrite32(&code, MAKE_AARCH64_ADD_FROM_SP(0, LH_PROBE_FRAME_SIZE));
+	LHStreamWrite32(&code, MAKE_AARCH64_STR_SP(0, offsetof(LHProbeContext, sp)));
+	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_LITERAL(0), 0));
+	LHStreamWrite32(&code, MAKE_AARCH64_STR_SP(0, offsetof(LHProbeContext, pc)));
+	LHStreamWrite32(&code, MAKE_AARCH64_MRS_NZCV(0));
+	LHStreamWrite32(&code, MAKE_AARCH64_STR_SP(0, offsetof(LHProbeContext, nzcv)));
+	
+	// Save SIMD registers
+	for (uint32_t i = 0; i < 32; i += 2) {
+		LHStreamWrite32(&code, MAKE_AARCH64_STP_Q_SP(i, i + 1, offsetof(LHProbeContext, v[i])));
+	}
+	
+	// callback(ctx, userdata)
+	LHStreamWrite32(&code, MAKE_AARCH64_ADD_FROM_SP(0, 0));
+	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_LITERAL(1), 1));
+	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_LITERAL(2), 16));
+	LHStreamWrite32(&code, MAKE_AARCH64_BLR(16));
+	
+	// Restore SIMD registers
+	for (uint32_t i = 0; i < 32; i += 2) {
+		LHStreamWrite32(&code, MAKE_AARCH64_LDP_Q_SP(i, i + 1, offsetof(LHProbeContext, v[i])));
+	}
+	
+	// Check if the callback moved the pc
+	LHStreamWrite32(&code, MAKE_AARCH64_LDR_SP(16, offsetof(LHProbeContext, pc)));
+	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_LITERAL(0), 17));
+	LHStreamWrite32(&code, AARCH64_CMP_X16_X17);
+	size_t bne_at = LHStreamTell(&code);
+	LHStreamWrite32(&code, 0);
+	
+	for (int redirect = 0; redirect < 2; redirect++) {
+		if (redirect && !code.overflow) {
+			// b.ne to here
+			uint32_t bne = 0x54000001 | ((((LHStreamTell(&code) - bne_at) >> 2) & 0x7ffff) << 5);
+			memcpy(code.data + bne_at, &bne, sizeof bne);
+		}
+		
+		LHStreamWrite32(&code, MAKE_AARCH64_LDR_SP(0, offsetof(LHProbeContext, nzcv)));
+		LHStreamWrite32(&code, MAKE_AARCH64_MSR_NZCV(0));
+		
+		for (uint32_t i = 0; i < 30; i += 2) {
+			if (redirect && i == 16) {
+				// x16 is needed for the jump
+				LHStreamWrite32(&code, MAKE_AARCH64_LDR_SP(17, offsetof(LHProbeContext, x[17])));
+			}
+			else {
+				LHStreamWrite32(&code, MAKE_AARCH64_LDP_SP(i, i + 1, i * 8));
+			}
+		}
+		
+		LHStreamWrite32(&code, MAKE_AARCH64_LDR_SP(30, offsetof(LHProbeContext, x[30])));
+		
+		if (redirect) {
+			LHStreamWrite32(&code, MAKE_AARCH64_LDR_SP(16, offsetof(LHProbeContext, pc)));
+			LHStreamWrite32(&code, MAKE_AARCH64_ADD_SP(LH_PROBE_FRAME_SIZE));
+			LHStreamWrite32(&code, MAKE_AARCH64_BR(16));
+		}
+		else {
+			LHStreamWrite32(&code, MAKE_AARCH64_ADD_SP(LH_PROBE_FRAME_SIZE));
+			LHAArch64WriteProbeResume(&code, addr, displaced != NULL, exec);
+		}
+	}
+	
+	#undef LH_LITERAL
+	
+	if (code.overflow) {
+		LHHookerTrim(self, exec, 0);
+		return 0;
+	}
+	
+	memcpy(stub, code.data, LHStreamTell(&code));
+	__builtin___clear_cache(exec, (char *) exec + LHStreamTell(&code));
+	LHHookerTrim(self, exec, LHStreamTell(&code));
+	
+	uint32_t *entry = (uint32_t *) ((uint8_t *) exec + sizeof literals);
+	((uint32_t *) patch)[0] = MAKE_AARCH64_B(((int64_t) (intptr_t) entry - (int64_t) (intptr_t) addr) >> 2);
+	
+	return sizeof(uint32_t);
+}
+
+#endif // LH_AARCH64
+
+#ifdef LH_AARCH32
+
+#define LH_PROBE_FRAME_SIZE (sizeof(LHProbeContext) + 8)
+#define LH_PROBE_RESUME_SLOT (sizeof(LHProbeContext) + 4)
+
+// AT_HWCAP bit for VFP with 32 double registers instead of 16
+#define LH_HWCAP_VFPD32 (1 << 19)
+
+static uint32_t LHAArch32EncodeImm(uint32_t value) {
+	/**
+	 * Encode `value` as an ARM modified immediate, the opposite of
+	 * LHAArch32ExpandImm. Only used for constants that are known to fit.
+	 */
+	
+	for (uint32_t rot = 0; rot < 16; rot++) {
+		uint32_t imm = rot ? ((value << (rot * 2)) | (value >> (32 - rot * 2))) : value;
+		
+		if (imm <= 0xff) {
+			return (rot << 8) | imm;
+		}
+	}
+	
+	return 0;
+}
+
+static bool LHAArch32IsPCRelative(uint32_t ins) {
+	/**
+	 * Check for instructions that use the pc which we can't relocate. This is
+	 * rough and errs on the side of refusing.
+	 */
+	
+	if (IS_AARCH32_ADR(ins) || IS_AARCH32_ADR_SUB(ins) || IS_AARCH32_LDR_LITERAL(ins) || IS_AARCH32_B(ins) || IS_AARCH32_BLX_IMM(ins)) {
+		return false;
+	}
+	
+	return (ins >> 28) == 0xf || ((ins >> 16) & 0xf) == 15 || ((ins >> 12) & 0xf) == 15 || (ins & 0xf) == 15;
+}
+
+static size_t LHHookerMakeProbe(LHHooker *self, uint32_t *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread, void *patch) {
+	/**
+	 * Build the probe stub for `addr` and write the branch to it to `patch`.
+	 * Returns the patch size or zero on failure.
+	 */
+	
+	if (LHAArch32IsPCRelative(addr[0])) {
+		return 0;
+	}
+	
+	// The displaced instruction with a jump back
+	uint32_t *displaced = LHRewriteAArch32Block(self, addr, 1);
+	
+	if (!displaced) {
+		return 0;
+	}
+	
+	uint32_t literals[5] = { (uint32_t) (uintptr_t) addr, (uint32_t) (uintptr_t) userdata, (uint32_t) (uintptr_t) callback, (uint32_t) (uintptr_t) displaced, (uint32_t) (uintptr_t) thread };
+	
+	void *exec;
+	uint8_t *stub = LHHookerAllocNear(self, LH_STREAM_MAX_SIZE, addr, LH_AARCH32_NEAR_RANGE, &exec);
+	
+	if (!stub) {
+		return 0;
+	}
+	
+	LHStream code; LHStreamInit(&code);
+	LHStreamWrite(&code, sizeof literals, literals);
+	
+	// ldr Rt, [pc, #-x] for literal n, pc being 8 ahead
+	#define LH_LITERAL(Rt, n) MAKE_AARCH32_LDR_LITERAL(0, Rt, LHStreamTell(&code) + 8 - (n) * 4)
+	
+	// The second bank of VFP registers only exists with VFPv3-D32 or NEON
+	bool d32 = getauxval(AT_HWCAP) & LH_HWCAP_VFPD32;
+	
+	// Other threads go straight on to the displaced instruction. The check
+	// can't change the flags, so a match picks which of the two pops to run.
+	if (thread) {
+		LHStreamWrite32(&code, 0xe92d0003); // push {r0, r1}
+		LHStreamWrite32(&code, 0xee1d0f70); // mrc p15, 0, r0, c13, c0, 3
+		LHStreamWrite32(&code, LH_LITERAL(1, 4));
+		LHStreamWrite32(&code, 0xe5911000); // ldr r1, [r1]
+		LHStreamWrite32(&code, 0xe0400001); // sub r0, r0, r1
+		LHStreamWrite32(&code, 0xe16f0f10); // clz r0, r0
+		LHStreamWrite32(&code, 0xe1a002a0); // lsr r0, r0, #5 (1 if they match)
+		LHStreamWrite32(&code, 0xe08ff180); // add pc, pc, r0, lsl #3
+		LHStreamWrite32(&code, 0xe320f000); // nop
+		LHStreamWrite32(&code, 0xe8bd0003); // pop {r0, r1}
+		LHStreamWrite32(&code, LH_LITERAL(15, 3));
+		LHStreamWrite32(&code, 0xe8bd0003); // pop {r0, r1}
+	}
+	
+	LHStreamWrite32(&code, 0xe24dd000 | LHAArch32EncodeImm(LH_PROBE_FRAME_SIZE)); // sub sp, sp, #frame
+	LHStreamWrite32(&code, 0xe88d1fff); // stmia sp, {r0-r12}
+	LHStreamWrite32(&code, 0xe28d0000 | LHAArch32EncodeImm(LH_PROBE_FRAME_SIZE)); // add r0, sp, #frame
+	LHStreamWrite32(&code, 0xe58d0000 | offsetof(LHProbeContext, sp)); // str r0, [sp, #sp]
+	LHStreamWrite32(&code, 0xe58de000 | offsetof(LHProbeContext, lr)); // str lr, [sp, #lr]
+	LHStreamWrite32(&code, LH_LITERAL(0, 0));
+	LHStreamWrite32(&code, 0xe58d0000 | offsetof(LHProbeContext, pc)); // str r0, [sp, #pc]
+	LHStreamWrite32(&code, 0xe10f0000); // mrs r0, apsr
+	LHStreamWrite32(&code, 0xe58d0000 | offsetof(LHProbeContext, cpsr)); // str r0, [sp, #cpsr]
+	LHStreamWrite32(&code, 0xe28d0000 | LHAArch32EncodeImm(offsetof(LHProbeContext, d))); // add r0, sp, #d
+	LHStreamWrite32(&code, 0xeca00b20); // vstmia r0!, {d0-d15}
+	
+	if (d32) {
+		LHStreamWrite32(&code, 0xecc00b20); // vstmia r0, {d16-d31}
+	}
+	
+	// callback(ctx, userdata). In the middle of a function sp is only 4 byte
+	// aligned, but calls need 8, so it's aligned for the call and put back
+	// from r4 after, which the callback has to keep.
+	LHStreamWrite32(&code, 0xe1a0000d); // mov r0, sp
+	LHStreamWrite32(&code, 0xe1a0400d); // mov r4, sp
+	LHStreamWrite32(&code, 0xe3cdd007); // bic sp, sp, #7
+	LHStreamWrite32(&code, LH_LITERAL(1, 1));
+	LHStreamWrite32(&code, LH_LITERAL(12, 2));
+	LHStreamWrite32(&code, 0xe12fff3c); // blx r12
+	LHStreamWrite32(&code, 0xe1a0d004); // mov sp, r4
+	
+	LHStreamWrite32(&code, 0xe28d0000 | LHAArch32EncodeImm(offsetof(LHProbeContext, d))); // add r0, sp, #d
+	LHStreamWrite32(&code, 0xecb00b20); // vldmia r0!, {d0-d15}
+	
+	if (d32) {
+		LHStreamWrite32(&code, 0xecd00b20); // vldmia r0, {d16-d31}
+	}
+	
+	// Resume at the displaced instruction unless the callback moved the pc
+	LHStreamWrite32(&code, 0xe59d0000 | offsetof(LHProbeContext, pc)); // ldr r0, [sp, #pc]
+	LHStreamWrite32(&code, LH_LITERAL(1, 0));
+	LHStreamWrite32(&code, 0xe1500001); // cmp r0, r1
+	LHStreamWrite32(&code, AARCH32_SET_COND(LH_LITERAL(0, 3), 0)); // ldreq r0, =displaced
+	LHStreamWrite32(&code, 0xe58d0000 | LH_PROBE_RESUME_SLOT); // str r0, [sp, #resume]
+	
+	LHStreamWrite32(&code, 0xe59d0000 | offsetof(LHProbeContext, cpsr)); // ldr r0, [sp, #cpsr]
+	LHStreamWrite32(&code, 0xe128f000); // msr APSR_nzcvq, r0
+	LHStreamWrite32(&code, 0xe59de000 | offsetof(LHProbeContext, lr)); // ldr lr, [sp, #lr]
+	LHStreamWrite32(&code, 0xe89d1fff); // ldmia sp, {r0-r12}
+	LHStreamWrite32(&code, 0xe28dd000 | LHAArch32EncodeImm(LH_PROBE_RESUME_SLOT)); // add sp, sp, #resume
+	LHStreamWrite32(&code, 0xe49df004); // pop {pc}
+	
+	#undef LH_LITERAL
+	
+	if (code.overflow) {
+		LHHookerTrim(self, exec, 0);
+		return 0;
+	}
+	
+	memcpy(stub, code.data, LHStreamTell(&code));
+	__builtin___clear_cache(exec, (char *) exec + LHStreamTell(&code));
+	LHHookerTrim(self, exec, LHStreamTell(&code));
+	
+	uint32_t entry = (uint32_t) (uintptr_t) exec + sizeof literals;
+	((uint32_t *) patch)[0] = MAKE_AARCH32_B(((int32_t) entry - (int32_t) (uintptr_t) addr - 8) >> 2);
+	
+	return sizeof(uint32_t);
+}
+
+#endif // LH_AARCH32
+
+#if defined(LH_X86) || defined(LH_X86_64)
+
+#ifdef LH_X86_64
+#define LH_X86_GPRS 16
+#define LH_X86_RED_ZONE 128
+#else
+#define LH_X86_GPRS 8
+#define LH_X86_RED_ZONE 0
 #endif
+
+// Where the stub keeps the address to resume at, just above the context
+#define LH_PROBE_RESUME_SLOT (sizeof(LHProbeContext))
+
+static void LHX86WriteSPOperand(LHStream *code, uint8_t opcode, uint8_t reg, uint32_t offset) {
+	// <opcode> reg, [esp/rsp + disp32]
+	uint8_t modrm[3] = { opcode, 0x84 | ((reg & 7) << 3), 0x24 };
+	LHStreamWrite(code, 3, modrm);
+	LHStreamWrite32(code, offset);
+}
+
+static void LHX86WriteRexW(LHStream *code, uint8_t reg) {
+	// 64 bit operand size prefix, also extending the ModRM reg field
+	if (LH_X86_LONG_MODE) {
+		LHStreamWrite8(code, 0x48 | (reg >= 8 ? 4 : 0));
+	}
+}
+
+static void LHX86WriteSSE(LHStream *code, uint8_t opcode, uint8_t reg, uint32_t offset) {
+	// movdqu to or from [esp/rsp + disp32]
+	LHStreamWrite8(code, 0xf3);
+	
+	if (reg >= 8) {
+		LHStreamWrite8(code, 0x44);
+	}
+	
+	LHStreamWrite8(code, 0x0f);
+	LHX86WriteSPOperand(code, opcode, reg, offset);
+}
+
+static void LHX86WriteMovImm(LHStream *code, uint8_t reg, uintptr_t value) {
+	// mov reg, imm (imm64 on x86_64)
+	LHX86WriteRexW(code, 0);
+	LHStreamWrite8(code, 0xb8 | reg);
+	LHStreamWrite(code, sizeof value, &value);
+}
+
+static void LHX86WriteProbeRestore(LHStream *code) {
+	/**
+	 * Restore the status flags and every general register other than the
+	 * stack pointer from the context at the top of the stack. The flags are
+	 * loaded with sahf, which is much quicker than popf.
+	 */
+	
+	LHX86WriteSPOperand(code, 0x8b, 0, offsetof(LHProbeContext, flags)); // mov eax, [flags]
+	LHStreamWrite(code, 3, "\xc0\xec\x03"); // shr ah, 3
+	LHStreamWrite(code, 3, "\x80\xe4\x01"); // and ah, 1
+	LHStreamWrite(code, 3, "\x80\xc4\x7f"); // add ah, 0x7f (sets OF if it was set)
+	LHStreamWrite(code, 2, "\x88\xc4"); // mov ah, al
+	LHStreamWrite8(code, 0x9e); // sahf
+	
+	for (uint8_t i = 0; i < LH_X86_GPRS; i++) {
+		if (i != 4) {
+			LHX86WriteRexW(code, i); LHX86WriteSPOperand(code, 0x8b, i, offsetof(LHProbeContext, gpr[i]));
+		}
+	}
+}
+
+static size_t LHHookerMakeProbe(LHHooker *self, uint8_t *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread, void *patch) {
+	/**
+	 * Build the probe stub for `addr` and write the jump to it to `patch`.
+	 * Returns the patch size or zero on failure.
+	 */
+	
+	// The displaced instructions with a jump back. x86 relocation never needs
+	// any scratch registers.
+	size_t block_size;
+	void *displaced = LHRewriteX86Block(self, addr, 5, &block_size);
+	
+	if (!displaced) {
+		return 0;
+	}
+	
+	void *exec;
+	uint8_t *stub = LHHookerAllocNear(self, LH_STREAM_MAX_SIZE, addr, LH_X86_NEAR_RANGE, &exec);
+	
+	if (!stub) {
+		return 0;
+	}
+	
+	LHStream code; LHStreamInit(&code);
+	
+	// Other threads go straight on to the displaced instructions. The check
+	// compares the thread pointers by adding one to the negation of the other
+	// so that the flags aren't touched.
+	if (thread) {
+		LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, -(int32_t) LH_X86_RED_ZONE);
+		LHStreamWrite(&code, 2, "\x50\x51"); // push eax/rax, push ecx/rcx
+#ifdef LH_X86_64
+		LHStreamWrite(&code, 9, "\x64\x48\x8b\x0c\x25\x00\x00\x00\x00"); // mov rcx, fs:[0]
+#else
+		LHStreamWrite(&code, 7, "\x65\x8b\x0d\x00\x00\x00\x00"); // mov ecx, gs:[0]
+#endif
+		LHX86WriteMovImm(&code, 0, (uintptr_t) thread);
+		LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 2, "\x8b\x00"); // mov eax, [eax]
+		LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 2, "\xf7\xd0"); // not eax
+		LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 4, "\x8d\x4c\x01\x01"); // lea ecx, [ecx + eax + 1]
+		LHStreamWrite8(&code, 0xe3); // jecxz/jrcxz run
+		size_t run_rel = LHStreamTell(&code);
+		LHStreamWrite8(&code, 0);
+		
+		LHStreamWrite(&code, 2, "\x59\x58"); // pop ecx/rcx, pop eax/rax
+		LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, LH_X86_RED_ZONE);
+		LHX86EmitJump(&code, exec, 0xe9, displaced);
+		
+		// run:
+		if (!code.overflow) {
+			code.data[run_rel] = LHStreamTell(&code) - (run_rel + 1);
+		}
+		
+		LHStreamWrite(&code, 2, "\x59\x58"); // pop ecx/rcx, pop eax/rax
+		LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, LH_X86_RED_ZONE);
+	}
+	
+	// Skip the red zone, make room for the resume address, save the flags
+	// and then make room for the rest of the context
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, -(int32_t) (LH_X86_RED_ZONE + sizeof(uintptr_t)));
+	LHStreamWrite8(&code, 0x9c);
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, -(int32_t) offsetof(LHProbeContext, flags));
+	
+	// Save general registers, the stack pointer is fixed up after
+	for (uint8_t i = 0; i < LH_X86_GPRS; i++) {
+		LHX86WriteRexW(&code, i); LHX86WriteSPOperand(&code, 0x89, i, offsetof(LHProbeContext, gpr[i]));
+	}
+	
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 0, sizeof(LHProbeContext) + sizeof(uintptr_t) + LH_X86_RED_ZONE);
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x89, 0, offsetof(LHProbeContext, gpr[4]));
+	LHX86WriteMovImm(&code, 0, (uintptr_t) addr);
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x89, 0, offsetof(LHProbeContext, ip));
+	
+	// Save SSE registers (movdqu)
+	for (uint8_t i = 0; i < LH_X86_GPRS; i++) {
+		LHX86WriteSSE(&code, 0x7f, i, offsetof(LHProbeContext, xmm[i]));
+	}
+	
+	// Align the stack with the old one kept in ebx/rbx, which is callee saved
+	LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 2, "\x89\xe3");
+	LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 3, "\x83\xe4\xf0");
+	
+	// callback(ctx, userdata)
+#ifdef LH_X86_64
+	LHStreamWrite(&code, 3, "\x48\x89\xdf"); // mov rdi, rbx
+	LHStreamWrite8(&code, 0x48); LHStreamWrite8(&code, 0xbe); // mov rsi, userdata
+	LHStreamWrite64(&code, (uint64_t) (uintptr_t) userdata);
+#else
+	LHStreamWrite(&code, 3, "\x83\xec\x08"); // sub esp, 8
+	LHStreamWrite8(&code, 0x68); // push userdata
+	LHStreamWrite32(&code, (uint32_t) (uintptr_t) userdata);
+	LHStreamWrite8(&code, 0x53); // push ebx
+#endif
+	LHX86WriteMovImm(&code, 0, (uintptr_t) callback);
+	LHStreamWrite(&code, 2, "\xff\xd0"); // call eax/rax
+	LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 2, "\x89\xdc"); // mov esp/rsp, ebx/rbx
+	
+	// Restore SSE registers
+	for (uint8_t i = 0; i < LH_X86_GPRS; i++) {
+		LHX86WriteSSE(&code, 0x6f, i, offsetof(LHProbeContext, xmm[i]));
+	}
+	
+	// Jump straight to the displaced instructions unless the callback moved
+	// the ip. Going anywhere else uses a ret, which isn't done normally since
+	// returning somewhere that wasn't called from throws off the return
+	// prediction of the code around the probe.
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8b, 0, offsetof(LHProbeContext, ip));
+	LHX86WriteMovImm(&code, 1, (uintptr_t) addr);
+	LHX86WriteRexW(&code, 0); LHStreamWrite(&code, 2, "\x39\xc8"); // cmp eax, ecx
+	LHStreamWrite(&code, 2, "\x0f\x85"); // jne moved
+	size_t moved_rel = LHStreamWrite32(&code, 0);
+	
+	LHX86WriteProbeRestore(&code);
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, sizeof(LHProbeContext) + sizeof(uintptr_t) + LH_X86_RED_ZONE);
+	LHX86EmitJump(&code, exec, 0xe9, displaced);
+	
+	// moved: return to the new ip, skipping the red zone
+	uint32_t moved = LHStreamTell(&code) - (moved_rel + 4);
+	memcpy(code.data + moved_rel, &moved, sizeof moved);
+	
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x89, 0, LH_PROBE_RESUME_SLOT);
+	LHX86WriteProbeRestore(&code);
+	LHX86WriteRexW(&code, 0); LHX86WriteSPOperand(&code, 0x8d, 4, sizeof(LHProbeContext));
+	LHStreamWrite8(&code, 0xc2);
+	uint16_t red_zone = LH_X86_RED_ZONE;
+	LHStreamWrite(&code, 2, &red_zone);
+	
+	if (code.overflow) {
+		LHHookerTrim(self, exec, 0);
+		return 0;
+	}
+	
+	memcpy(stub, code.data, LHStreamTell(&code));
+	LHHookerTrim(self, exec, LHStreamTell(&code));
+	
+	LHStream jump; LHStreamInit(&jump);
+	LHX86EmitJump(&jump, addr, 0xe9, exec);
+	memcpy(patch, jump.data, LHStreamTell(&jump));
+	
+	return LHStreamTell(&jump);
+}
+
+#endif // LH_X86 || LH_X86_64
+
+#if !defined(LH_AARCH64) && !defined(LH_AARCH32) && !defined(LH_X86) && !defined(LH_X86_64)
+
+static size_t LHHookerMakeProbe(LHHooker *self, void *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread, void *patch) {
+	return 0;
+}
+
+#endif
+
+bool LHHookerProbe(LHHooker *self, void *addr, LHProbeCallback callback, void *userdata) {
+	/**
+	 * Install a probe at any instruction `addr`, calling `callback` with the
+	 * register state every time it is about to be run. The callback may
+	 * change the registers in the context (other than the stack pointer) and
+	 * they will be used when execution continues; setting the pc/ip to
+	 * somewhere else will continue there instead.
+	 * 
+	 * On AArch64, x16 is clobbered when the pc is changed or when the probed
+	 * instruction uses the pc. On AArch32, probing instructions that use the
+	 * pc (other than branches and literal loads) is not supported.
+	 * 
+	 * On x86 the jump to the probe is 5 bytes, so it overwrites every
+	 * instruction that starts in the 5 bytes at `addr`, not just the probed
+	 * one. Nothing may jump to those following instructions (a loop head or
+	 * a branch target, for example), since it would land in the middle of the
+	 * jump. Only the status flags are taken back from the context's flags.
+	 */
+	
+	return LHHookerProbeThread(self, addr, callback, userdata, NULL);
+}
+
+static LHProbeSite **LHHookerFindProbe(LHHooker *self, uint8_t *addr, size_t size) {
+	/**
+	 * Find the link to the probe whose patch overlaps [addr, addr + size).
+	 */
+	
+	LHProbeSite **link = &self->probes;
+	
+	while (*link && !(addr < (*link)->addr + (*link)->patch_size && (*link)->addr < addr + size)) {
+		link = &(*link)->next;
+	}
+	
+	return link;
+}
+
+bool LHHookerProbeThread(LHHooker *self, void *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread) {
+	/**
+	 * Like LHHookerProbe(), but only call `callback` when `*thread` is the
+	 * LHThreadId() of the thread running the probe. Other threads skip
+	 * straight to the probed instruction without saving any registers, which
+	 * costs about as much as a hook. `*thread` is read on every run, so it
+	 * can be changed at any time; zero matches no thread.
+	 * 
+	 * A NULL `thread` calls `callback` on every thread.
+	 */
+	
+	// Probing an instruction twice would relocate the first probe's jump
+	if (*LHHookerFindProbe(self, addr, 1)) {
+		return false;
+	}
+	
+	LHProbeSite *site = calloc(1, sizeof *site);
+	
+	if (!site) {
+		return false;
+	}
+	
+	uint8_t patch[LH_PATCH_MAX_SIZE];
+	size_t patch_size = LHHookerMakeProbe(self, addr, callback, userdata, thread, patch);
+	
+	// On x86 the jump can also run into a probe just after this one
+	if (!patch_size || *LHHookerFindProbe(self, addr, patch_size) || !LHHookerCanPatch(self, addr, patch_size)) {
+		free(site);
+		return false;
+	}
+	
+	site->addr = addr;
+	site->patch_size = patch_size;
+	memcpy(site->original, addr, patch_size);
+	
+	if (!LHHookerApplyPatch(self, addr, patch, patch_size)) {
+		free(site);
+		return false;
+	}
+	
+	site->next = self->probes;
+	self->probes = site;
+	
+	return true;
+}
+
+bool LHHookerUnprobe(LHHooker *self, void *addr) {
+	/**
+	 * Remove the probe at `addr`, putting back the instruction it replaced.
+	 * The stub is kept since another thread might still be running it, so
+	 * its callback can be called once or twice more by threads that were
+	 * already on their way.
+	 */
+	
+	LHProbeSite **link = LHHookerFindProbe(self, addr, 1);
+	LHProbeSite *site = *link;
+	
+	if (!site || site->addr != addr) {
+		return false;
+	}
+	
+	if (!LHHookerApplyPatch(self, addr, site->original, site->patch_size)) {
+		return false;
+	}
+	
+	*link = site->next;
+	free(site);
+	
+	return true;
+}
+
+bool LHHookerIsPatched(LHHooker *self, void *addr, size_t size) {
+	/**
+	 * Check if any of [addr, addr + size) is written over by a hook or a
+	 * probe, including ones waiting for LHHookerCommit().
+	 */
+	
+	for (LHTarget *target = self->targets; target; target = target->next) {
+		if (target->hook_count && (uint8_t *) addr < target->function + target->patch_size && target->function < (uint8_t *) addr + size) {
+			return true;
+		}
+	}
+	
+	return *LHHookerFindProbe(self, addr, size) != NULL;
+}
+
+void LHHookerBegin(LHHooker *self) {
+	/**
+	 * Start a transaction. Hooks made until the matching LHHookerCommit() have
+	 * their trampolines built (so `orig` is valid right away) but the hooked
+	 * functions aren't patched until the commit. Transactions can be nested;
+	 * only the outermost commit writes anything.
+	 */
+	
+	self->transaction_depth++;
+}
+
+bool LHHookerCommit(LHHooker *self) {
+	/**
+	 * End a transaction, writing all the queued patches in one go.
+	 */
+	
+	if (!self->transaction_depth || --self->transaction_depth) {
+		return true;
+	}
+	
+	bool success = LHHookerWritePatches(self, self->pending, self->pending_count);
+	
+	free(self->pending);
+	self->pending = NULL;
+	self->pending_count = 0;
+	
 	return success;
 }
 
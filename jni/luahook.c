@@ -0,0 +1,349 @@
+/**
+ * Hooking native functions from Lua. Calls to a hooked function are recorded
+ * with their arguments and the Lua callbacks are run later in a batch by
+ * knRunHooks(), so the hooked function itself never waits on Lua. The probe
+ * checks the thread before saving anything, so calls from other threads only
+ * cost about as much as a plain hook.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+#include "leafhook.h"
+
+#define KN_LUA_HOOK_MAX_ARGS 8
+#define KN_LUA_HOOK_QUEUE_SIZE 256
+
+typedef union KNLuaHookValue {
+	uintptr_t i;
+	float f;
+} KNLuaHookValue;
+
+typedef struct KNLuaHook {
+	struct KNLuaHook *next;
+	void *addr;
+	lua_State *script; // NULL if no callback is attached
+	uintptr_t thread; // LHThreadId() of the script thread, zero when unhooked
+	bool probed;
+	size_t arg_count;
+	char args[KN_LUA_HOOK_MAX_ARGS];
+} KNLuaHook;
+
+typedef struct KNLuaHookCall {
+	KNLuaHook *hook;
+	KNLuaHookValue args[KN_LUA_HOOK_MAX_ARGS];
+} KNLuaHookCall;
+
+KNLuaHook *gLuaHooks;
+
+// Only ever touched from the script thread, so there's no locking
+KNLuaHookCall gLuaHookQueue[KN_LUA_HOOK_QUEUE_SIZE];
+KNLuaHookCall gLuaHookRunning[KN_LUA_HOOK_QUEUE_SIZE];
+size_t gLuaHookQueueCount;
+size_t gLuaHookDropped;
+
+static void *KNLuaHookArgAddr(LHProbeContext *ctx, bool is_float, size_t *next_int, size_t *next_float, size_t *next_stack) {
+	/**
+	 * Find where the next argument is in the registers or on the stack, going
+	 * by the calling convention.
+	 */
+
+#if defined(__aarch64__)
+	if (is_float && *next_float < 8) {
+		return ctx->v[(*next_float)++];
+	}
+	else if (!is_float && *next_int < 8) {
+		return &ctx->x[(*next_int)++];
+	}
+	
+	return (void *) (ctx->sp + 8 * (*next_stack)++);
+#elif defined(__arm__)
+	// softfp, so floats are passed like everything else
+	if (*next_int < 4) {
+		return &ctx->r[(*next_int)++];
+	}
+	
+	return (void *) (ctx->sp + 4 * (*next_stack)++);
+#elif defined(__x86_64__)
+	static const uint8_t int_regs[] = { 7, 6, 2, 1, 8, 9 }; // rdi, rsi, rdx, rcx, r8, r9
+	
+	if (is_float && *next_float < 8) {
+		return ctx->xmm[(*next_float)++];
+	}
+	else if (!is_float && *next_int < sizeof int_regs) {
+		return &ctx->gpr[int_regs[(*next_int)++]];
+	}
+	
+	// Skip the return address
+	return (void *) (ctx->gpr[4] + 8 + 8 * (*next_stack)++);
+#else
+	return (void *) (ctx->gpr[4] + 4 + 4 * (*next_stack)++);
+#endif
+}
+
+static void KNLuaHookEnter(LHProbeContext *ctx, void *userdata) {
+	/**
+	 * Probe on the first instruction of a hooked function. Queue the call if
+	 * it's on the script thread and there's a callback for it.
+	 */
+	
+	KNLuaHook *hook = userdata;
+	
+	// The probe has already checked the thread
+	if (!__atomic_load_n(&hook->script, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	
+	if (gLuaHookQueueCount >= KN_LUA_HOOK_QUEUE_SIZE) {
+		gLuaHookDropped++;
+		return;
+	}
+	
+	KNLuaHookCall *call = &gLuaHookQueue[gLuaHookQueueCount++];
+	call->hook = hook;
+	
+	size_t next_int = 0, next_float = 0, next_stack = 0;
+	
+	for (size_t i = 0; i < hook->arg_count; i++) {
+		bool is_float = hook->args[i] == 'f';
+		void *src = KNLuaHookArgAddr(ctx, is_float, &next_int, &next_float, &next_stack);
+		
+		if (is_float) {
+			memcpy(&call->args[i].f, src, sizeof(float));
+		}
+		else {
+			memcpy(&call->args[i].i, src, sizeof(uintptr_t));
+		}
+	}
+}
+
+bool KNParseSignature(const char *signature, char *ret, char *args, size_t *arg_count, size_t max_args) {
+	/**
+	 * Parse a function signature like "v(pif)": the return type, then the
+	 * argument types in brackets. Types are v (void, return only), i (int),
+	 * p (pointer), f (float) and b (bool).
+	 */
+	
+	const char *valid = "ipfb";
+	
+	if (!signature[0] || (!strchr(valid, signature[0]) && signature[0] != 'v') || signature[1] != '(') {
+		return false;
+	}
+	
+	*ret = signature[0];
+	*arg_count = 0;
+	
+	for (const char *c = signature + 2; *c != ')'; c++) {
+		if (!*c || !strchr(valid, *c) || *arg_count >= max_args) {
+			return false;
+		}
+		
+		args[(*arg_count)++] = *c;
+	}
+	
+	return true;
+}
+
+static KNLuaHook *KNLuaHookFind(void *addr) {
+	for (KNLuaHook *hook = gLuaHooks; hook; hook = hook->next) {
+		if (hook->addr == addr) {
+			return hook;
+		}
+	}
+	
+	return NULL;
+}
+
+static void KNLuaHookPushCallback(lua_State *script, KNLuaHook *hook) {
+	// Callbacks are kept in the registry keyed by their hook
+	lua_pushlightuserdata(script, hook);
+	lua_gettable(script, LUA_REGISTRYINDEX);
+}
+
+int knHook(lua_State *script) {
+	/**
+	 * (bool) success = knHook(symbolOrAddr, signature, callback)
+	 * 
+	 * Call `callback` with the arguments of every call to a native function
+	 * made on the script thread. Calls are queued and the callbacks run when
+	 * knRunHooks() is called. Each function can have one callback, so hooking
+	 * it again replaces the old one.
+	 */
+	
+	if (lua_gettop(script) < 3 || !lua_isfunction(script, 3)) {
+		lua_pushboolean(script, false);
+		return 1;
+	}
+	
+	void *addr = lua_type(script, 1) == LUA_TSTRING ? KNGetSymbolAddr(lua_tostring(script, 1)) : (void *) lua_tointeger(script, 1);
+	const char *signature = lua_tostring(script, 2);
+	char ret, args[KN_LUA_HOOK_MAX_ARGS];
+	size_t arg_count;
+	
+	if (!addr || !signature || !KNParseSignature(signature, &ret, args, &arg_count, KN_LUA_HOOK_MAX_ARGS)) {
+		lua_pushboolean(script, false);
+		return 1;
+	}
+	
+	KNLuaHook *hook = KNLuaHookFind(addr);
+	
+	if (!hook) {
+		hook = calloc(1, sizeof *hook);
+		
+		if (!hook) {
+			lua_pushboolean(script, false);
+			return 1;
+		}
+		
+		hook->addr = addr;
+		hook->next = gLuaHooks;
+		gLuaHooks = hook;
+	}
+	
+	// Shut the probe while the signature changes, in case it was hooked from
+	// another thread before. The script and thread are read by the probe on
+	// any thread, so they're only changed atomically.
+	__atomic_store_n(&hook->thread, 0, __ATOMIC_RELEASE);
+	memcpy(hook->args, args, arg_count);
+	hook->arg_count = arg_count;
+	__atomic_store_n(&hook->script, script, __ATOMIC_RELEASE);
+	
+	if (!hook->probed) {
+		if (!KNProbeThread(addr, KNLuaHookEnter, hook, &hook->thread)) {
+			__atomic_store_n(&hook->script, NULL, __ATOMIC_RELEASE);
+			lua_pushboolean(script, false);
+			return 1;
+		}
+		
+		hook->probed = true;
+	}
+	
+	// Last, since this is what lets calls through
+	__atomic_store_n(&hook->thread, LHThreadId(), __ATOMIC_RELEASE);
+	
+	lua_pushlightuserdata(script, hook);
+	lua_pushvalue(script, 3);
+	KNLuaSetTable(script, LUA_REGISTRYINDEX);
+	
+	lua_pushboolean(script, true);
+	return 1;
+}
+
+int knUnhook(lua_State *script) {
+	/**
+	 * knUnhook(symbolOrAddr)
+	 * 
+	 * Stop calling the callback for a function hooked with knHook() and
+	 * remove the probe. Calls that are already queued are dropped.
+	 */
+	
+	void *addr = lua_type(script, 1) == LUA_TSTRING ? KNGetSymbolAddr(lua_tostring(script, 1)) : (void *) lua_tointeger(script, 1);
+	KNLuaHook *hook = KNLuaHookFind(addr);
+	
+	if (hook && __atomic_load_n(&hook->script, __ATOMIC_ACQUIRE) == script) {
+		__atomic_store_n(&hook->thread, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&hook->script, NULL, __ATOMIC_RELEASE);
+		
+		// The hook itself is kept since queued calls and the old probe stub
+		// still point to it, and knHook() can use it again
+		if (KNUnprobe(addr)) {
+			hook->probed = false;
+		}
+		
+		lua_pushlightuserdata(script, hook);
+		lua_pushnil(script);
+		KNLuaSetTable(script, LUA_REGISTRYINDEX);
+	}
+	
+	return 0;
+}
+
+int knRunHooks(lua_State *script) {
+	/**
+	 * (int) count = knRunHooks()
+	 * 
+	 * Run the callbacks for calls queued since the last time this was called,
+	 * in the order the calls happened. This should be called once per frame.
+	 * Returns how many callbacks were run.
+	 */
+	
+	static bool running;
+	
+	if (running) {
+		lua_pushinteger(script, 0);
+		return 1;
+	}
+	
+	running = true;
+	
+	// Take the queue first so calls made by callbacks wait for the next batch
+	size_t count = gLuaHookQueueCount;
+	memcpy(gLuaHookRunning, gLuaHookQueue, count * sizeof *gLuaHookQueue);
+	gLuaHookQueueCount = 0;
+	
+	if (gLuaHookDropped) {
+		__android_log_print(ANDROID_LOG_WARN, TAG, "Dropped %zu hooked calls, knRunHooks() isn't keeping up", gLuaHookDropped);
+		gLuaHookDropped = 0;
+	}
+	
+	size_t run = 0;
+	
+	for (size_t i = 0; i < count; i++) {
+		KNLuaHookCall *call = &gLuaHookRunning[i];
+		KNLuaHook *hook = call->hook;
+		lua_State *owner = __atomic_load_n(&hook->script, __ATOMIC_ACQUIRE);
+		
+		if (owner != script) {
+			// Belongs to another script, which will run it
+			if (owner && gLuaHookQueueCount < KN_LUA_HOOK_QUEUE_SIZE) {
+				gLuaHookQueue[gLuaHookQueueCount++] = *call;
+			}
+			
+			continue;
+		}
+		
+		KNLuaHookPushCallback(script, hook);
+		
+		for (size_t j = 0; j < hook->arg_count; j++) {
+			switch (hook->args[j]) {
+				case 'i':
+					lua_pushinteger(script, (int32_t) call->args[j].i);
+					break;
+				case 'p':
+					lua_pushinteger(script, call->args[j].i);
+					break;
+				case 'f':
+					lua_pushnumber(script, call->args[j].f);
+					break;
+				case 'b':
+					lua_pushboolean(script, (uint8_t) call->args[j].i);
+					break;
+			}
+		}
+		
+		if (KNLuaPCall(script, hook->arg_count, 0, 0)) {
+			__android_log_print(ANDROID_LOG_ERROR, TAG, "Error in hook callback: %s", lua_tostring(script, -1));
+			lua_pop(script, 1);
+		}
+		
+		run++;
+	}
+	
+	lua_pushinteger(script, run);
+	return 1;
+}
+
+int knEnableLuaHook(lua_State *script) {
+	knRegisterFunc(script, knHook);
+	knRegisterFunc(script, knUnhook);
+	knRegisterFunc(script, knRunHooks);
+	
+	return 0;
+}
@@ -64,11 +64,15 @@ void KNOverlayInit(struct android_app *app, Leaf *leaf) {
 	// Needed for reloading templates
 	Game_loadTemplates = KNGetSymbolAddr("_ZN4Game13loadTemplatesEv");
 	
+	KNHookBegin();
+	
 	// Hook res man load
 	KNHookFunction(KNGetSymbolAddr("_ZN6ResMan4loadERK8QiStringR14QiOutputStream"), KNResMan_load, (void **) &ResMan_load);
 	
 	// Hook player zero
 	KNHookFunction(KNGetSymbolAddr("_ZN6Player4zeroEv"), KNPlayer_zero, (void **) &Player_zero);
+	
+	KNHookCommit();
 }
 
 bool KNOverlayMount(const char *path) {
@@ -0,0 +1,471 @@
+/**
+ * Patching bytes in the game's code in a way that can be undone. Each patch
+ * keeps the bytes it replaced, patches that overlap each other or a hook are
+ * refused instead of silently breaking each other (as are hooks over a
+ * patch), and writes can be batched so that every page is only unprotected
+ * and flushed once.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+#include "leafhook.h"
+
+struct KNPatch {
+	struct KNPatch *next;
+	int id;
+	uint8_t *addr;
+	size_t size;
+	char *owner;
+	uint8_t *original;
+};
+
+typedef struct KNPatchWrite {
+	uint8_t *addr;
+	size_t size;
+	uint8_t *data;
+} KNPatchWrite;
+
+KNPatch *gPatches;
+int gPatchNextId = 1;
+
+// Writes waiting for KNPatchCommit()
+KNPatchWrite *gPatchWrites;
+size_t gPatchWriteCount;
+bool gPatchBatching;
+
+static int KNPatchWriteCompare(const void *a, const void *b) {
+	const KNPatchWrite *x = a, *y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static bool KNPatchFlush(void) {
+	/**
+	 * Do all of the queued writes. The pages they touch are grouped into
+	 * ranges that each get one mprotect() and one instruction cache flush,
+	 * but the writes themselves happen in the order they were made. Pages
+	 * are put back to their old protection afterwards.
+	 */
+	
+	if (!gPatchWriteCount) {
+		return true;
+	}
+	
+	KNPatchWrite *sorted = malloc(gPatchWriteCount * sizeof *sorted);
+	
+	if (!sorted) {
+		return false;
+	}
+	
+	memcpy(sorted, gPatchWrites, gPatchWriteCount * sizeof *sorted);
+	qsort(sorted, gPatchWriteCount, sizeof *sorted, KNPatchWriteCompare);
+	
+	size_t page_size = getpagesize();
+	uintptr_t page_mask = ~((uintptr_t) page_size - 1);
+	bool success = true;
+	size_t range_count = 0;
+	
+	// Merge writes on the same or neighbouring pages into ranges, reusing the
+	// sorted list to hold them
+	for (size_t i = 0; i < gPatchWriteCount; i++) {
+		uint8_t *start = sorted[i].addr;
+		uint8_t *end = sorted[i].addr + sorted[i].size;
+		
+		if (range_count && ((uintptr_t) start & page_mask) <= (((uintptr_t) sorted[range_count - 1].addr + sorted[range_count - 1].size - 1) & page_mask) + ~page_mask + 1) {
+			KNPatchWrite *range = &sorted[range_count - 1];
+			
+			if (end > range->addr + range->size) {
+				range->size = end - range->addr;
+			}
+		}
+		else {
+			sorted[range_count].addr = start;
+			sorted[range_count].size = end - start;
+			range_count++;
+		}
+	}
+	
+	#define KN_RANGE_START(range) ((uintptr_t) (range)->addr & page_mask)
+	#define KN_RANGE_END(range) (((uintptr_t) (range)->addr + (range)->size + ~page_mask) & page_mask)
+	
+	// Every page in the ranges, in order, to look up their protections
+	size_t page_count = 0;
+	
+	for (size_t i = 0; i < range_count; i++) {
+		page_count += (KN_RANGE_END(&sorted[i]) - KN_RANGE_START(&sorted[i])) / page_size;
+	}
+	
+	uintptr_t *pages = malloc(page_count * sizeof *pages);
+	int *prots = malloc(page_count * sizeof *prots);
+	
+	if (!pages || !prots) {
+		free(pages);
+		free(prots);
+		free(sorted);
+		return false;
+	}
+	
+	for (size_t i = 0, p = 0; i < range_count; i++) {
+		for (uintptr_t page = KN_RANGE_START(&sorted[i]); page < KN_RANGE_END(&sorted[i]); page += page_size) {
+			pages[p++] = page;
+		}
+	}
+	
+	// Without the mappings, assume it's all normal code
+	if (!LHGetProtections(pages, prots, page_count)) {
+		for (size_t i = 0; i < page_count; i++) {
+			prots[i] = PROT_READ | PROT_EXEC;
+		}
+	}
+	
+	for (size_t i = 0, p = 0; i < range_count; i++) {
+		uintptr_t page_start = KN_RANGE_START(&sorted[i]);
+		uintptr_t page_end = KN_RANGE_END(&sorted[i]);
+		size_t range_pages = (page_end - page_start) / page_size;
+		
+		if (mprotect((void *) page_start, page_end - page_start, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+			__android_log_print(ANDROID_LOG_ERROR, TAG, "Could not unprotect <%p> for patching", sorted[i].addr);
+			success = false;
+			
+			// Don't write to anything in this range, or put it back after
+			for (size_t j = 0; j < gPatchWriteCount; j++) {
+				if (gPatchWrites[j].addr >= sorted[i].addr && gPatchWrites[j].addr < sorted[i].addr + sorted[i].size) {
+					gPatchWrites[j].size = 0;
+				}
+			}
+			
+			for (size_t j = p; j < p + range_pages; j++) {
+				prots[j] = -1;
+			}
+		}
+		
+		p += range_pages;
+	}
+	
+	for (size_t i = 0; i < gPatchWriteCount; i++) {
+		KNPatchWrite *write = &gPatchWrites[i];
+		
+		// Single instructions are written in one go in case they're running
+		if (write->size == 4 && !((uintptr_t) write->addr & 3)) {
+			uint32_t value;
+			memcpy(&value, write->data, sizeof value);
+			__atomic_store_n((uint32_t *) write->addr, value, __ATOMIC_RELEASE);
+		}
+		else {
+			memcpy(write->addr, write->data, write->size);
+		}
+		
+		free(write->data);
+	}
+	
+	for (size_t i = 0; i < range_count; i++) {
+		__builtin___clear_cache((char *) sorted[i].addr, (char *) sorted[i].addr + sorted[i].size);
+	}
+	
+	// Put back the old protections, grouping neighbouring pages that match
+	for (size_t i = 0; i < page_count;) {
+		size_t end = i + 1;
+		
+		while (end < page_count && pages[end] == pages[end - 1] + page_size && prots[end] == prots[i]) {
+			end++;
+		}
+		
+		if (prots[i] >= 0) {
+			mprotect((void *) pages[i], pages[end - 1] + page_size - pages[i], prots[i]);
+		}
+		
+		i = end;
+	}
+	
+	#undef KN_RANGE_START
+	#undef KN_RANGE_END
+	
+	free(pages);
+	free(prots);
+	free(sorted);
+	free(gPatchWrites);
+	gPatchWrites = NULL;
+	gPatchWriteCount = 0;
+	
+	return success;
+}
+
+static void KNPatchReadPending(uint8_t *addr, uint8_t *out, size_t size) {
+	/**
+	 * Read `size` bytes at `addr` as they will be once the queued writes are
+	 * done, for when a batch reverts a patch and then patches the same bytes
+	 * again.
+	 */
+	
+	memcpy(out, addr, size);
+	
+	for (size_t i = 0; i < gPatchWriteCount; i++) {
+		KNPatchWrite *write = &gPatchWrites[i];
+		uint8_t *start = write->addr > addr ? write->addr : addr;
+		uint8_t *end = write->addr + write->size < addr + size ? write->addr + write->size : addr + size;
+		
+		if (start < end) {
+			memcpy(out + (start - addr), write->data + (start - write->addr), end - start);
+		}
+	}
+}
+
+static bool KNPatchQueue(uint8_t *addr, const void *data, size_t size) {
+	/**
+	 * Queue a write, then do it straight away unless a batch is open.
+	 */
+	
+	KNPatchWrite *writes = realloc(gPatchWrites, (gPatchWriteCount + 1) * sizeof *gPatchWrites);
+	
+	if (!writes) {
+		return false;
+	}
+	
+	gPatchWrites = writes;
+	
+	KNPatchWrite *write = &gPatchWrites[gPatchWriteCount];
+	write->addr = addr;
+	write->size = size;
+	write->data = malloc(size);
+	
+	if (!write->data) {
+		return false;
+	}
+	
+	memcpy(write->data, data, size);
+	gPatchWriteCount++;
+	
+	uint8_t *queued = write->data;
+	
+	if (gPatchBatching || KNPatchFlush()) {
+		return true;
+	}
+	
+	// If the flush couldn't even start, the write is still queued. Nothing
+	// will keep track of it after this fails, so it can't be done later.
+	if (gPatchWriteCount && gPatchWrites[gPatchWriteCount - 1].data == queued) {
+		free(queued);
+		gPatchWriteCount--;
+	}
+	
+	return false;
+}
+
+void KNPatchBegin(void) {
+	/**
+	 * Start batching patches. Patches and reverts made before KNPatchCommit()
+	 * are checked and get their handles right away, but aren't written until
+	 * the commit.
+	 */
+	
+	gPatchBatching = true;
+}
+
+bool KNPatchCommit(void) {
+	/**
+	 * Write all of the patches and reverts made since KNPatchBegin().
+	 */
+	
+	gPatchBatching = false;
+	
+	return KNPatchFlush();
+}
+
+bool KNPatchOverlaps(void *addr, size_t size) {
+	/**
+	 * Check if a live patch owns any of [addr, addr + size), for hooks and
+	 * probes, which would otherwise keep the patched bytes as the original
+	 * and have them written back over their jump by the revert.
+	 */
+	
+	for (KNPatch *patch = gPatches; patch; patch = patch->next) {
+		if ((uint8_t *) addr < patch->addr + patch->size && patch->addr < (uint8_t *) addr + size) {
+			__android_log_print(ANDROID_LOG_WARN, TAG, "Hook or probe at <%p> overlaps patch %d by %s at <%p>", addr, patch->id, patch->owner, patch->addr);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+KNPatch *KNPatchApply(void *addr, const void *bytes, size_t size, const char *owner) {
+	/**
+	 * Replace `size` bytes at `addr` with `bytes`, keeping the old bytes so
+	 * it can be undone with KNPatchRevert(). `owner` names whoever made the
+	 * patch, for the message if another patch overlaps it. Returns NULL if
+	 * the patch overlaps an existing one, a hook or a probe, or on error.
+	 */
+	
+	if (!addr || !size) {
+		return NULL;
+	}
+	
+	// Hooks and probes keep their own copy of the bytes they replaced, which
+	// a patch under them would make wrong
+	if (KNHookOverlaps(addr, size)) {
+		__android_log_print(ANDROID_LOG_WARN, TAG, "Patch by %s at <%p> overlaps a hook or probe", owner, addr);
+		return NULL;
+	}
+	
+	for (KNPatch *other = gPatches; other; other = other->next) {
+		if ((uint8_t *) addr < other->addr + other->size && other->addr < (uint8_t *) addr + size) {
+			__android_log_print(ANDROID_LOG_WARN, TAG, "Patch by %s at <%p> overlaps patch %d by %s at <%p>", owner, addr, other->id, other->owner, other->addr);
+			return NULL;
+		}
+	}
+	
+	KNPatch *patch = calloc(1, sizeof *patch);
+	
+	if (!patch) {
+		return NULL;
+	}
+	
+	patch->addr = addr;
+	patch->size = size;
+	patch->owner = strdup(owner ? owner : "unknown");
+	patch->original = malloc(size);
+	
+	if (!patch->owner || !patch->original) {
+		free(patch->owner);
+		free(patch->original);
+		free(patch);
+		return NULL;
+	}
+	
+	// Nothing else can be patching these bytes, so they won't change before
+	// the write even if it's batched, other than by writes already queued
+	KNPatchReadPending(addr, patch->original, size);
+	
+	if (!KNPatchQueue(addr, bytes, size)) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Failed to write patch at <%p>", addr);
+		free(patch->owner);
+		free(patch->original);
+		free(patch);
+		return NULL;
+	}
+	
+	patch->id = gPatchNextId++;
+	patch->next = gPatches;
+	gPatches = patch;
+	
+	return patch;
+}
+
+bool KNPatchRevert(KNPatch *patch) {
+	/**
+	 * Put back the bytes that were there before a patch and free it. If they
+	 * can't be put back, the patch is kept and false is returned.
+	 */
+	
+	KNPatch **link = &gPatches;
+	
+	while (*link && *link != patch) {
+		link = &(*link)->next;
+	}
+	
+	if (!*link) {
+		return false;
+	}
+	
+	if (!KNPatchQueue(patch->addr, patch->original, patch->size)) {
+		return false;
+	}
+	
+	*link = patch->next;
+	
+	free(patch->owner);
+	free(patch->original);
+	free(patch);
+	
+	return true;
+}
+
+static KNPatch *KNPatchFind(int id) {
+	for (KNPatch *patch = gPatches; patch; patch = patch->next) {
+		if (patch->id == id) {
+			return patch;
+		}
+	}
+	
+	return NULL;
+}
+
+int knPatch(lua_State *script) {
+	/**
+	 * (int|nil) patch = knPatch(addr, bytes, [owner])
+	 * 
+	 * Write a string of bytes to `addr`, keeping the old bytes so it can be
+	 * undone with knUnpatch(). Returns nil if it overlaps another patch.
+	 */
+	
+	size_t addr = lua_type(script, 1) == LUA_TSTRING ? (size_t) KNGetSymbolAddr(lua_tostring(script, 1)) : (size_t) lua_tointeger(script, 1);
+	size_t size;
+	const char *bytes = lua_tolstring(script, 2, &size);
+	const char *owner = lua_isstring(script, 3) ? lua_tostring(script, 3) : "script";
+	
+	if (!bytes) {
+		knReturnNil(script);
+	}
+	
+	KNPatch *patch = KNPatchApply((void *) addr, bytes, size, owner);
+	
+	if (!patch) {
+		knReturnNil(script);
+	}
+	
+	lua_pushinteger(script, patch->id);
+	return 1;
+}
+
+int knUnpatch(lua_State *script) {
+	/**
+	 * (bool) success = knUnpatch(patch)
+	 * 
+	 * Undo a patch made with knPatch().
+	 */
+	
+	KNPatch *patch = KNPatchFind(lua_tointeger(script, 1));
+	
+	lua_pushboolean(script, patch && KNPatchRevert(patch));
+	return 1;
+}
+
+int knPatchBegin(lua_State *script) {
+	/**
+	 * knPatchBegin()
+	 * 
+	 * Batch patches until knPatchCommit().
+	 */
+	
+	KNPatchBegin();
+	return 0;
+}
+
+int knPatchCommit(lua_State *script) {
+	/**
+	 * (bool) success = knPatchCommit()
+	 * 
+	 * Write all patches made since knPatchBegin().
+	 */
+	
+	lua_pushboolean(script, KNPatchCommit());
+	return 1;
+}
+
+int knEnablePatch(lua_State *script) {
+	knRegisterFunc(script, knPatch);
+	knRegisterFunc(script, knUnpatch);
+	knRegisterFunc(script, knPatchBegin);
+	knRegisterFunc(script, knPatchCommit);
+	
+	return 0;
+}
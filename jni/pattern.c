@@ -0,0 +1,452 @@
+/**
+ * Finding code and data in libsmashhit by byte pattern, for things that
+ * aren't exported. Results are cached on disk for the same build of the game
+ * so later lookups don't need to scan at all.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+// Changed from KNPC when the entry count was dropped for appending
+#define KN_PATTERN_MAGIC ('K' | ('N' << 8) | ('P' << 16) | ('2' << 24))
+#define KN_PATTERN_MAX_SIZE 256
+
+extern Leaf *gLeaf;
+extern char *gAndroidInternalDataPath;
+
+typedef struct KNPatternCacheEntry {
+	char *key; // "segment:pattern"
+	int64_t offset; // From the start of the blob
+} KNPatternCacheEntry;
+
+KNPatternCacheEntry *gPatternCache;
+size_t gPatternCacheCount;
+uint64_t gPatternBinaryHash;
+bool gPatternCacheLoaded;
+bool gPatternCacheFileValid; // Has a header for this build, so can be appended to
+
+static size_t KNParsePattern(const char *pattern, uint8_t *bytes, uint8_t *mask) {
+	/**
+	 * Parse a pattern like "48 8b ?? 05" into bytes and a mask of which ones
+	 * have to match. Returns the length or zero if the pattern is invalid.
+	 */
+	
+	size_t length = 0;
+	
+	while (*pattern) {
+		if (*pattern == ' ') {
+			pattern++;
+			continue;
+		}
+		
+		if (length >= KN_PATTERN_MAX_SIZE) {
+			return 0;
+		}
+		
+		if (*pattern == '?') {
+			bytes[length] = 0;
+			mask[length] = 0;
+			pattern += pattern[1] == '?' ? 2 : 1;
+		}
+		else {
+			char hex[3] = { pattern[0], pattern[1], 0 };
+			char *end;
+			bytes[length] = strtoul(hex, &end, 16);
+			mask[length] = 0xff;
+			
+			if (end != hex + 2) {
+				return 0;
+			}
+			
+			pattern += 2;
+		}
+		
+		length++;
+	}
+	
+	return length;
+}
+
+static bool KNPatternMatches(const uint8_t *at, const uint8_t *bytes, const uint8_t *mask, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		if ((at[i] & mask[i]) != bytes[i]) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static const uint8_t *KNFindPatternIn(const uint8_t *start, size_t size, const uint8_t *bytes, const uint8_t *mask, size_t length) {
+	/**
+	 * Find the first match of a pattern in memory. Candidates are found by
+	 * looking for the first non-wildcard byte 16 at a time, and only those
+	 * are compared in full.
+	 */
+	
+	if (length > size) {
+		return NULL;
+	}
+	
+	size_t anchor = 0;
+	
+	while (anchor < length && !mask[anchor]) {
+		anchor++;
+	}
+	
+	if (anchor == length) {
+		return start;
+	}
+	
+	// Positions where the anchor byte can be for a whole match to fit
+	const uint8_t *first = start + anchor;
+	const uint8_t *last = start + size - length + anchor;
+	const uint8_t *at = first;
+
+#if defined(__ARM_NEON)
+	uint8x16_t needle = vdupq_n_u8(bytes[anchor]);
+	
+	for (; at + 16 <= last + 1; at += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8(at), needle);
+		
+		// Four bits per byte, since NEON has no movemask
+		uint64_t found = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		
+		while (found) {
+			size_t index = __builtin_ctzll(found) / 4;
+			
+			if (KNPatternMatches(at + index - anchor, bytes, mask, length)) {
+				return at + index - anchor;
+			}
+			
+			found &= ~(0xfull << (index * 4));
+		}
+	}
+#elif defined(__SSE2__)
+	__m128i needle = _mm_set1_epi8(bytes[anchor]);
+	
+	for (; at + 16 <= last + 1; at += 16) {
+		uint32_t found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) at), needle));
+		
+		while (found) {
+			size_t index = __builtin_ctz(found);
+			
+			if (KNPatternMatches(at + index - anchor, bytes, mask, length)) {
+				return at + index - anchor;
+			}
+			
+			found &= found - 1;
+		}
+	}
+#endif
+	
+	for (; at <= last; at++) {
+		if (*at == bytes[anchor] && KNPatternMatches(at - anchor, bytes, mask, length)) {
+			return at - anchor;
+		}
+	}
+	
+	return NULL;
+}
+
+static uint64_t KNHashBytes(uint64_t hash, const uint8_t *data, size_t size) {
+	// FNV-1a, but a word at a time since this can be the whole of the code
+	size_t i = 0;
+	
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof word);
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+	
+	for (; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	}
+	
+	return hash;
+}
+
+static uint64_t KNBinaryHash(Leaf *leaf) {
+	/**
+	 * Identify the build of libsmashhit, by its build ID if it has one or
+	 * else by its ELF and program headers and its dynamic symbols. Hashing
+	 * the code took milliseconds, would change with every hook, and any
+	 * rebuild that moves code moves symbols too. Cached results are checked
+	 * against the pattern before they're used anyway.
+	 */
+	
+	uint64_t hash = KNHashBytes(0xcbf29ce484222325ull, (const uint8_t *) &leaf->blob_length, sizeof leaf->blob_length);
+	hash = KNHashBytes(hash, (const uint8_t *) leaf->ehdr, sizeof *leaf->ehdr);
+	
+	for (size_t i = 0; i < leaf->ehdr->e_phnum; i++) {
+		LeafPhdr *phdr = leaf->phdrs[i];
+		
+		if (phdr->p_type != PT_NOTE) {
+			continue;
+		}
+		
+		const uint8_t *note = leaf->blob + phdr->p_vaddr;
+		const uint8_t *end = note + phdr->p_filesz;
+		
+		while (note + 12 <= end) {
+			const uint32_t *header = (const uint32_t *) note;
+			const uint8_t *desc = note + 12 + ((header[0] + 3) & ~3);
+			
+			if (header[2] == NT_GNU_BUILD_ID && header[0] == 4 && !memcmp(note + 12, "GNU", 4) && desc + header[1] <= end) {
+				return KNHashBytes(hash, desc, header[1]);
+			}
+			
+			note = desc + ((header[1] + 3) & ~3);
+		}
+	}
+	
+	for (size_t i = 0; i < leaf->ehdr->e_phnum; i++) {
+		hash = KNHashBytes(hash, (const uint8_t *) leaf->phdrs[i], sizeof *leaf->phdrs[i]);
+	}
+	
+	if (leaf->symtab) {
+		hash = KNHashBytes(hash, (const uint8_t *) leaf->symtab, leaf->sym_count * sizeof *leaf->symtab);
+	}
+	
+	return hash;
+}
+
+static char *KNPatternCachePath(void) {
+	if (!gAndroidInternalDataPath) {
+		return NULL;
+	}
+	
+	const char *base_path = "/patterns.kn";
+	char *path = malloc(strlen(gAndroidInternalDataPath) + strlen(base_path) + 1);
+	
+	if (path) {
+		strcpy(path, gAndroidInternalDataPath);
+		strcat(path, base_path);
+	}
+	
+	return path;
+}
+
+static bool KNPatternCacheAdd(const char *key, int64_t offset) {
+	KNPatternCacheEntry *cache = realloc(gPatternCache, (gPatternCacheCount + 1) * sizeof *gPatternCache);
+	
+	if (!cache) {
+		return false;
+	}
+	
+	gPatternCache = cache;
+	gPatternCache[gPatternCacheCount].key = strdup(key);
+	gPatternCache[gPatternCacheCount].offset = offset;
+	
+	if (!gPatternCache[gPatternCacheCount].key) {
+		return false;
+	}
+	
+	gPatternCacheCount++;
+	
+	return true;
+}
+
+static void KNPatternCacheLoad(void) {
+	/**
+	 * Load results saved by an earlier run, as long as they are for the same
+	 * build of the game.
+	 */
+	
+	gPatternCacheLoaded = true;
+	gPatternBinaryHash = KNBinaryHash(gLeaf);
+	
+	char *path = KNPatternCachePath();
+	FILE *file = path ? fopen(path, "rb") : NULL;
+	free(path);
+	
+	if (!file) {
+		return;
+	}
+	
+	uint32_t magic;
+	uint64_t hash;
+	
+	if (fread(&magic, sizeof magic, 1, file) != 1 || magic != KN_PATTERN_MAGIC
+		|| fread(&hash, sizeof hash, 1, file) != 1 || hash != gPatternBinaryHash) {
+		fclose(file);
+		return;
+	}
+	
+	gPatternCacheFileValid = true;
+	
+	// Entries go until the end of the file
+	for (;;) {
+		uint32_t key_length;
+		int64_t offset;
+		char key[KN_PATTERN_MAX_SIZE * 3 + 32];
+		
+		if (fread(&key_length, sizeof key_length, 1, file) != 1 || key_length >= sizeof key
+			|| fread(key, 1, key_length, file) != key_length
+			|| fread(&offset, sizeof offset, 1, file) != 1) {
+			break;
+		}
+		
+		key[key_length] = '\0';
+		
+		// Older runs also saved patterns that weren't found
+		if (offset >= 0) {
+			KNPatternCacheAdd(key, offset);
+		}
+	}
+	
+	fclose(file);
+}
+
+static void KNPatternCacheAppend(const KNPatternCacheEntry *entry) {
+	/**
+	 * Add one result to the end of the cache file, so a lookup that wasn't
+	 * cached doesn't rewrite all the others. The file is started over if it
+	 * was missing or for another build.
+	 */
+	
+	char *path = KNPatternCachePath();
+	FILE *file = path ? fopen(path, gPatternCacheFileValid ? "ab" : "wb") : NULL;
+	free(path);
+	
+	if (!file) {
+		return;
+	}
+	
+	if (!gPatternCacheFileValid) {
+		uint32_t magic = KN_PATTERN_MAGIC;
+		gPatternCacheFileValid = fwrite(&magic, sizeof magic, 1, file) == 1 && fwrite(&gPatternBinaryHash, sizeof gPatternBinaryHash, 1, file) == 1;
+	}
+	
+	uint32_t key_length = strlen(entry->key);
+	fwrite(&key_length, sizeof key_length, 1, file);
+	fwrite(entry->key, 1, key_length, file);
+	fwrite(&entry->offset, sizeof entry->offset, 1, file);
+	
+	fclose(file);
+}
+
+static bool KNSegmentWanted(LeafPhdr *phdr, const char *segment) {
+	if (phdr->p_type != PT_LOAD) {
+		return false;
+	}
+	
+	if (!strcmp(segment, "text")) {
+		return phdr->p_flags & PF_X;
+	}
+	else if (!strcmp(segment, "data")) {
+		return phdr->p_flags & PF_W;
+	}
+	else if (!strcmp(segment, "rodata")) {
+		return !(phdr->p_flags & (PF_X | PF_W));
+	}
+	
+	return true;
+}
+
+void *KNFindPattern(const char *pattern, const char *segment) {
+	/**
+	 * Find the first match of a pattern in libsmashhit's segments of the
+	 * given kind ("text", "data", "rodata" or "all"). Returns NULL if there
+	 * isn't one.
+	 */
+	
+	uint8_t bytes[KN_PATTERN_MAX_SIZE], mask[KN_PATTERN_MAX_SIZE];
+	size_t length = KNParsePattern(pattern, bytes, mask);
+	
+	if (!length || !gLeaf) {
+		return NULL;
+	}
+	
+	if (!gPatternCacheLoaded) {
+		KNPatternCacheLoad();
+	}
+	
+	// A key that doesn't fit would be cut off and could be the same as the
+	// key for another pattern, so those patterns just aren't cached
+	char key[KN_PATTERN_MAX_SIZE * 3 + 32];
+	int key_length = snprintf(key, sizeof key, "%s:%s", segment, pattern);
+	bool cached = key_length >= 0 && (size_t) key_length < sizeof key;
+	
+	// Newest first, since a result that went stale is appended again
+	for (size_t i = gPatternCacheCount; cached && i-- > 0;) {
+		if (strcmp(gPatternCache[i].key, key)) {
+			continue;
+		}
+		
+		int64_t offset = gPatternCache[i].offset;
+		
+		// Double check, in case the build ID didn't change when it should have
+		if (offset + length <= gLeaf->blob_length && KNPatternMatches(gLeaf->blob + offset, bytes, mask, length)) {
+			return gLeaf->blob + offset;
+		}
+		
+		gPatternCache[i].key[0] = '\0';
+		break;
+	}
+	
+	const uint8_t *found = NULL;
+	
+	for (size_t i = 0; i < gLeaf->ehdr->e_phnum && !found; i++) {
+		LeafPhdr *phdr = gLeaf->phdrs[i];
+		
+		if (KNSegmentWanted(phdr, segment)) {
+			found = KNFindPatternIn(gLeaf->blob + phdr->p_vaddr, phdr->p_filesz, bytes, mask, length);
+		}
+	}
+	
+	// Misses aren't cached, since the bytes might only be missing because
+	// they're hooked or patched right now
+	if (cached && found && KNPatternCacheAdd(key, found - (const uint8_t *) gLeaf->blob)) {
+		KNPatternCacheAppend(&gPatternCache[gPatternCacheCount - 1]);
+	}
+	
+	return (void *) found;
+}
+
+int knFindPattern(lua_State *script) {
+	/**
+	 * (int|nil) addr = knFindPattern(pattern, [segment])
+	 * 
+	 * Find the first match of a byte pattern like "48 8b ?? 05" in the game's
+	 * code (or the given segment) and return its address.
+	 */
+	
+	const char *pattern = lua_tostring(script, 1);
+	const char *segment = lua_isstring(script, 2) ? lua_tostring(script, 2) : "text";
+	
+	if (!pattern) {
+		knReturnNil(script);
+	}
+	
+	void *addr = KNFindPattern(pattern, segment);
+	
+	if (!addr) {
+		knReturnNil(script);
+	}
+	
+	lua_pushinteger(script, (size_t) addr);
+	return 1;
+}
+
+int knEnablePattern(lua_State *script) {
+	knRegisterFunc(script, knFindPattern);
+	
+	return 0;
+}
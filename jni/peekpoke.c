@@ -2,14 +2,24 @@
 #include <android/log.h>
 #include <dlfcn.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "lua/lua.h"
 #include "lua/lualib.h"
 #include "lua/lauxlib.h"
 
 #include "util.h"
+#include "smashhit.h"
 
-#define knGetAddress(SCRIPT, INDEX) (lua_isstring(SCRIPT, INDEX) ? (size_t)KNGetSymbolAddr(lua_tostring(SCRIPT, INDEX)) : (size_t)lua_tointeger(SCRIPT, INDEX))
+#define knGetAddress(SCRIPT, INDEX) (lua_type(SCRIPT, INDEX) == LUA_TSTRING ? (size_t)KNGetSymbolAddr(lua_tostring(SCRIPT, INDEX)) : (size_t)lua_tointeger(SCRIPT, INDEX))
 
 // MEMORY
 enum {
@@ -41,55 +51,125 @@ int knSymbolAddr(lua_State *script) {
 	return 1;
 }
 
-int knPeek(lua_State *script) {
+int knAddrToSymbol(lua_State *script) {
 	/**
-	 * value = knPeek(addr, type, [size])
+	 * symbolName, offset = knAddrToSymbol(addr)
 	 * 
-	 * Reads the value at `addr` of type `type` and returns it.
-	 * 
-	 * If type is KN_TYPE_BYTES, then a third argument (size) is required and is
-	 * the number of bytes to read.
+	 * Returns the name of the symbol containing `addr` and how far into the
+	 * symbol `addr` is, or nil if the address isn't part of any known symbol.
+	 * This is the reverse of knSymbolAddr.
 	 */
 	
-	if (lua_gettop(script) < 2) {
+	if (lua_gettop(script) < 1) {
 		lua_pushnil(script);
 		return 1;
 	}
 	
-	size_t addr = knGetAddress(script, 1);
-	int type = lua_tointeger(script, 2);
+	size_t offset;
+	const char *name = KNGetSymbolForAddr((void *) lua_tointeger(script, 1), &offset);
+	
+	if (!name) {
+		lua_pushnil(script);
+		return 1;
+	}
+	
+	lua_pushstring(script, name);
+	lua_pushinteger(script, offset);
+	return 2;
+}
+
+static bool knPushValue(lua_State *script, size_t addr, int type) {
+	/**
+	 * Push the value of the given type at `addr`. Returns false (and pushes
+	 * nothing) for types without a fixed size.
+	 */
 	
 	switch (type) {
 		case KN_TYPE_ADDR:
 			lua_pushinteger(script, *(size_t *)addr);
-			return 1;
+			return true;
 		case KN_TYPE_BOOL:
 			lua_pushboolean(script, *(unsigned char *)addr);
-			return 1;
+			return true;
 		case KN_TYPE_SHORT:
 			lua_pushinteger(script, *(short *)addr);
-			return 1;
+			return true;
 		case KN_TYPE_INT:
 			lua_pushinteger(script, *(int *)addr);
-			return 1;
+			return true;
 		case KN_TYPE_FLOAT:
 			lua_pushnumber(script, *(float *)addr);
-			return 1;
+			return true;
 		case KN_TYPE_STRING:
 			lua_pushstring(script, (const char *)addr);
-			return 1;
-		case KN_TYPE_BYTES:
-			if (lua_gettop(script) < 3) {
-				lua_pushnil(script);
-				return 1;
-			}
-			lua_pushlstring(script, (const char *)addr, lua_tointeger(script, 3));
-			return 1;
-		default: {
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool knWriteValue(lua_State *script, int index, size_t addr, int type) {
+	/**
+	 * Write the value at `index` on the stack to `addr` as the given type.
+	 * Returns false for types without a fixed size.
+	 */
+	
+	switch (type) {
+		case KN_TYPE_ADDR:
+			*((size_t *)addr) = (size_t) lua_tointeger(script, index);
+			return true;
+		case KN_TYPE_BOOL:
+			*((unsigned char *)addr) = (unsigned char) lua_toboolean(script, index);
+			return true;
+		case KN_TYPE_SHORT:
+			*((short *)addr) = (short) lua_tointeger(script, index);
+			return true;
+		case KN_TYPE_INT:
+			*((int *)addr) = (int) lua_tointeger(script, index);
+			return true;
+		case KN_TYPE_FLOAT:
+			*((float *)addr) = (float) lua_tonumber(script, index);
+			return true;
+		case KN_TYPE_STRING:
+			strcpy((char *)addr, lua_tostring(script, index));
+			return true;
+		default:
+			return false;
+	}
+}
+
+int knPeek(lua_State *script) {
+	/**
+	 * value = knPeek(addr, type, [size])
+	 * 
+	 * Reads the value at `addr` of type `type` and returns it.
+	 * 
+	 * If type is KN_TYPE_BYTES, then a third argument (size) is required and is
+	 * the number of bytes to read.
+	 */
+	
+	if (lua_gettop(script) < 2) {
+		lua_pushnil(script);
+		return 1;
+	}
+	
+	size_t addr = knGetAddress(script, 1);
+	int type = lua_tointeger(script, 2);
+	
+	if (type == KN_TYPE_BYTES) {
+		if (lua_gettop(script) < 3) {
 			lua_pushnil(script);
 			return 1;
 		}
+		lua_pushlstring(script, (const char *)addr, lua_tointeger(script, 3));
+		return 1;
+	}
+	
+	if (!knPushValue(script, addr, type)) {
+		lua_pushnil(script);
 	}
+	
+	return 1;
 }
 
 int knPoke(lua_State *script) {
@@ -111,40 +191,825 @@ int knPoke(lua_State *script) {
 	size_t addr = knGetAddress(script, 1);
 	int type = lua_tointeger(script, 2);
 	
-	switch (type) {
-		case KN_TYPE_ADDR:
-			*((size_t *)addr) = (size_t) lua_tointeger(script, 3);
-			break;
-		case KN_TYPE_BOOL:
-			*((unsigned char *)addr) = (unsigned char) lua_toboolean(script, 3);
-			break;
-		case KN_TYPE_SHORT:
-			*((short *)addr) = (short) lua_tointeger(script, 3);
-			break;
-		case KN_TYPE_INT:
-			*((int *)addr) = (int) lua_tointeger(script, 3);
-			break;
-		case KN_TYPE_FLOAT:
-			*((float *)addr) = (float) lua_tonumber(script, 3);
-			break;
-		case KN_TYPE_STRING:
-			strcpy((char *)addr, lua_tostring(script, 3));
+	if (type == KN_TYPE_BYTES) {
+		size_t size;
+		const char *string = KNToBytes(script, 3, &size);
+		
+		if (!string) {
+			knReturnNil(script);
+		}
+		
+		memcpy((char *)addr, string, size);
+	}
+	else if (!knWriteValue(script, 3, addr, type)) {
+		lua_pushnil(script);
+		return 1;
+	}
+	
+	lua_pushinteger(script, addr);
+	return 1;
+}
+
+#define KN_MAX_FIELDS 32
+
+typedef struct KNField {
+	size_t offset;
+	int type;
+} KNField;
+
+static size_t knToFields(lua_State *script, int index, KNField *fields) {
+	/**
+	 * Read a list of {offset, type} pairs into `fields`, returning how many
+	 * there are or zero if any are invalid.
+	 */
+	
+	size_t count = lua_objlen(script, index);
+	
+	if (count > KN_MAX_FIELDS) {
+		return 0;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		lua_rawgeti(script, index, i + 1);
+		lua_rawgeti(script, -1, 1);
+		lua_rawgeti(script, -2, 2);
+		fields[i].offset = lua_tointeger(script, -2);
+		fields[i].type = lua_tointeger(script, -1);
+		lua_pop(script, 3);
+		
+		if (fields[i].type == KN_TYPE_BYTES || fields[i].type < KN_TYPE_ADDR || fields[i].type > KN_TYPE_STRING) {
+			return 0;
+		}
+	}
+	
+	return count;
+}
+
+int knPeekMany(lua_State *script) {
+	/**
+	 * values = knPeekMany(addr, stride, count, type)
+	 * rows = knPeekMany(addr, stride, count, {{offset, type}, ...})
+	 * bytes = knPeekMany(addr, stride, count, KN_TYPE_BYTES, size)
+	 * 
+	 * Read `count` values spaced `stride` bytes apart starting at `addr`, all
+	 * in one call. With a type, returns a list of the values. With a list of
+	 * fields, returns a list of rows, each being a list of the fields at their
+	 * offsets. With KN_TYPE_BYTES, returns the `size` bytes at each element
+	 * packed into one string, or nil unless `size` and `count` are positive.
+	 */
+	
+	if (lua_gettop(script) < 4) {
+		knReturnNil(script);
+	}
+	
+	size_t addr = knGetAddress(script, 1);
+	size_t stride = lua_tointeger(script, 2);
+	int count = lua_tointeger(script, 3);
+	
+	if (count < 0) {
+		knReturnNil(script);
+	}
+	
+	if (lua_istable(script, 4)) {
+		KNField fields[KN_MAX_FIELDS];
+		size_t field_count = knToFields(script, 4, fields);
+		
+		if (!field_count) {
+			knReturnNil(script);
+		}
+		
+		KNLuaCreateTable(script, count, 0);
+		
+		for (int i = 0; i < count; i++, addr += stride) {
+			lua_pushinteger(script, i + 1);
+			KNLuaCreateTable(script, field_count, 0);
+			
+			for (size_t j = 0; j < field_count; j++) {
+				lua_pushinteger(script, j + 1);
+				knPushValue(script, addr + fields[j].offset, fields[j].type);
+				KNLuaSetTable(script, -3);
+			}
+			
+			KNLuaSetTable(script, -3);
+		}
+		
+		return 1;
+	}
+	
+	int type = lua_tointeger(script, 4);
+	
+	if (type == KN_TYPE_BYTES) {
+		lua_Integer size = lua_tointeger(script, 5);
+		
+		// A missing or zero size reads as 0, and size * count can't overflow
+		if (size <= 0 || count <= 0 || (size_t) count > SIZE_MAX / (size_t) size) {
+			knReturnNil(script);
+		}
+		
+		char *buffer = malloc((size_t) size * count);
+		
+		if (!buffer) {
+			knReturnNil(script);
+		}
+		
+		for (int i = 0; i < count; i++, addr += stride) {
+			memcpy(buffer + i * size, (const char *)addr, size);
+		}
+		
+		lua_pushlstring(script, buffer, size * count);
+		free(buffer);
+		return 1;
+	}
+	
+	if (type < KN_TYPE_ADDR || type > KN_TYPE_STRING) {
+		knReturnNil(script);
+	}
+	
+	KNLuaCreateTable(script, count, 0);
+	
+	for (int i = 0; i < count; i++, addr += stride) {
+		lua_pushinteger(script, i + 1);
+		knPushValue(script, addr, type);
+		KNLuaSetTable(script, -3);
+	}
+	
+	return 1;
+}
+
+int knPokeMany(lua_State *script) {
+	/**
+	 * count = knPokeMany(addr, stride, type, values)
+	 * count = knPokeMany(addr, stride, {{offset, type}, ...}, rows)
+	 * count = knPokeMany(addr, stride, KN_TYPE_BYTES, bytes, size)
+	 * 
+	 * The opposite of knPeekMany: write each of `values` (or each row of
+	 * fields, or each `size` byte chunk of `bytes`) to elements `stride` bytes
+	 * apart starting at `addr`. Returns the number of elements written, or
+	 * nil if the arguments are invalid.
+	 */
+	
+	if (lua_gettop(script) < 4) {
+		knReturnNil(script);
+	}
+	
+	size_t addr = knGetAddress(script, 1);
+	size_t stride = lua_tointeger(script, 2);
+	size_t count;
+	
+	if (lua_istable(script, 3)) {
+		KNField fields[KN_MAX_FIELDS];
+		size_t field_count = knToFields(script, 3, fields);
+		
+		if (!field_count || !lua_istable(script, 4)) {
+			knReturnNil(script);
+		}
+		
+		count = lua_objlen(script, 4);
+		
+		for (size_t i = 0; i < count; i++, addr += stride) {
+			lua_rawgeti(script, 4, i + 1);
+			
+			for (size_t j = 0; j < field_count; j++) {
+				lua_rawgeti(script, -1, j + 1);
+				knWriteValue(script, -1, addr + fields[j].offset, fields[j].type);
+				lua_pop(script, 1);
+			}
+			
+			lua_pop(script, 1);
+		}
+	}
+	else if (lua_tointeger(script, 3) == KN_TYPE_BYTES) {
+		size_t length;
+		const char *bytes = lua_tolstring(script, 4, &length);
+		size_t size = lua_tointeger(script, 5);
+		
+		if (!bytes || !size) {
+			knReturnNil(script);
+		}
+		
+		count = length / size;
+		
+		for (size_t i = 0; i < count; i++, addr += stride) {
+			memcpy((char *)addr, bytes + i * size, size);
+		}
+	}
+	else {
+		int type = lua_tointeger(script, 3);
+		
+		if (type < KN_TYPE_ADDR || type > KN_TYPE_STRING || !lua_istable(script, 4)) {
+			knReturnNil(script);
+		}
+		
+		count = lua_objlen(script, 4);
+		
+		for (size_t i = 0; i < count; i++, addr += stride) {
+			lua_rawgeti(script, 4, i + 1);
+			knWriteValue(script, -1, addr, type);
+			lua_pop(script, 1);
+		}
+	}
+	
+	lua_pushinteger(script, count);
+	return 1;
+}
+
+#define KN_MAX_CHAIN 16
+
+typedef struct KNChain {
+	size_t base;
+	size_t length;
+	size_t offsets[KN_MAX_CHAIN];
+	int type;
+} KNChain;
+
+KNChain *gChains;
+size_t gChainCount;
+
+static bool knToChain(lua_State *script, KNChain *chain) {
+	/**
+	 * Read the base, offsets and type of a chain from the first three
+	 * arguments.
+	 */
+	
+	chain->base = knGetAddress(script, 1);
+	chain->type = lua_tointeger(script, 3);
+	chain->length = lua_istable(script, 2) ? lua_objlen(script, 2) : 0;
+	
+	if (!chain->base || chain->length > KN_MAX_CHAIN || chain->type < KN_TYPE_ADDR || chain->type > KN_TYPE_STRING) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < chain->length; i++) {
+		lua_rawgeti(script, 2, i + 1);
+		chain->offsets[i] = lua_tointeger(script, -1);
+		lua_pop(script, 1);
+	}
+	
+	return true;
+}
+
+static int knPushChain(lua_State *script, KNChain *chain) {
+	/**
+	 * Follow a chain and push the value at the end of it, or nil if one of the
+	 * pointers along the way is NULL.
+	 */
+	
+	size_t addr = chain->base;
+	
+	for (size_t i = 0; i < chain->length; i++) {
+		addr = *(size_t *)addr;
+		
+		if (!addr) {
+			knReturnNil(script);
+		}
+		
+		addr += chain->offsets[i];
+	}
+	
+	knPushValue(script, addr, chain->type);
+	return 1;
+}
+
+int knPeekChain(lua_State *script) {
+	/**
+	 * value = knPeekChain(base, {offset1, offset2, ...}, type)
+	 * value = knPeekChain(chain)
+	 * 
+	 * Follow a chain of pointers: for each offset, read the pointer at the
+	 * current address and add the offset to it. Then read the value of the
+	 * given type at the end. Returns nil if any pointer along the way is NULL.
+	 * 
+	 * With one argument, follow a chain made by knCompileChain instead.
+	 */
+	
+	if (lua_gettop(script) == 1) {
+		size_t handle = lua_tointeger(script, 1);
+		
+		if (handle >= gChainCount) {
+			knReturnNil(script);
+		}
+		
+		return knPushChain(script, &gChains[handle]);
+	}
+	
+	KNChain chain;
+	
+	if (!knToChain(script, &chain)) {
+		knReturnNil(script);
+	}
+	
+	return knPushChain(script, &chain);
+}
+
+int knCompileChain(lua_State *script) {
+	/**
+	 * chain = knCompileChain(base, {offset1, offset2, ...}, type)
+	 * 
+	 * Save a pointer chain so it can be followed with knPeekChain(chain)
+	 * without having to pass the offsets or look up the base symbol each
+	 * time. Returns nil if the chain is invalid.
+	 */
+	
+	KNChain chain;
+	
+	if (!knToChain(script, &chain)) {
+		knReturnNil(script);
+	}
+	
+	KNChain *chains = realloc(gChains, (gChainCount + 1) * sizeof *gChains);
+	
+	if (!chains) {
+		knReturnNil(script);
+	}
+	
+	gChains = chains;
+	gChains[gChainCount] = chain;
+	
+	lua_pushinteger(script, gChainCount++);
+	return 1;
+}
+
+#define KN_SNAPSHOT_MAGIC ('K' | ('N' << 8) | ('S' << 16) | ('N' << 24))
+#define KN_SNAPSHOT_BLOCK 64
+
+typedef struct KNSnapshot {
+	uint32_t magic;
+	size_t addr;
+	size_t length;
+	uint8_t data[];
+} KNSnapshot;
+
+static KNSnapshot *knToSnapshot(lua_State *script, int index) {
+	KNSnapshot *snapshot = lua_touserdata(script, index);
+	
+	if (!snapshot || lua_objlen(script, index) < sizeof *snapshot || snapshot->magic != KN_SNAPSHOT_MAGIC) {
+		return NULL;
+	}
+	
+	return snapshot;
+}
+
+static bool knBlockEqual(const uint8_t *a, const uint8_t *b) {
+	/**
+	 * Compare one cache line sized block of two snapshots.
+	 */
+	
+#if defined(__ARM_NEON)
+	uint8x16_t diff = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+	diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)));
+	diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + 32), vld1q_u8(b + 32)));
+	diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + 48), vld1q_u8(b + 48)));
+	
+	uint64x2_t halves = vreinterpretq_u64_u8(diff);
+	return !(vgetq_lane_u64(halves, 0) | vgetq_lane_u64(halves, 1));
+#elif defined(__SSE2__)
+	__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a), _mm_loadu_si128((const __m128i *) b));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + 16)), _mm_loadu_si128((const __m128i *) (b + 16))));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + 32)), _mm_loadu_si128((const __m128i *) (b + 32))));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + 48)), _mm_loadu_si128((const __m128i *) (b + 48))));
+	
+	return _mm_movemask_epi8(eq) == 0xffff;
+#else
+	return !memcmp(a, b, KN_SNAPSHOT_BLOCK);
+#endif
+}
+
+int knSnapshot(lua_State *script) {
+	/**
+	 * snapshot = knSnapshot(addr, length)
+	 * snapshot = knSnapshot(snapshot)
+	 * 
+	 * Copy `length` bytes of memory at `addr` so they can be compared with
+	 * knDiff() later. With a snapshot, copy the same memory into it again
+	 * instead of making a new one.
+	 */
+	
+	KNSnapshot *snapshot = knToSnapshot(script, 1);
+	
+	if (snapshot) {
+		memcpy(snapshot->data, (const void *) snapshot->addr, snapshot->length);
+		lua_pushvalue(script, 1);
+		return 1;
+	}
+	
+	size_t addr = knGetAddress(script, 1);
+	lua_Integer length = lua_tointeger(script, 2);
+	
+	if (!addr || length <= 0) {
+		knReturnNil(script);
+	}
+	
+	snapshot = lua_newuserdata(script, sizeof *snapshot + length);
+	snapshot->magic = KN_SNAPSHOT_MAGIC;
+	snapshot->addr = addr;
+	snapshot->length = length;
+	memcpy(snapshot->data, (const void *) addr, length);
+	
+	return 1;
+}
+
+static void knPushRange(lua_State *script, size_t *count, size_t start, size_t end) {
+	lua_pushinteger(script, ++*count);
+	KNLuaCreateTable(script, 2, 0);
+	
+	lua_pushinteger(script, 1);
+	lua_pushinteger(script, start);
+	KNLuaSetTable(script, -3);
+	
+	lua_pushinteger(script, 2);
+	lua_pushinteger(script, end - start);
+	KNLuaSetTable(script, -3);
+	
+	KNLuaSetTable(script, -3);
+}
+
+static void knDiffBytes(lua_State *script, size_t *count, const uint8_t *a, const uint8_t *b, size_t from, size_t to, size_t *start, bool *in_range) {
+	/**
+	 * Compare bytes one at a time, continuing a range that was started before
+	 * `from` if there is one.
+	 */
+	
+	for (size_t i = from; i < to; i++) {
+		bool differs = a[i] != b[i];
+		
+		if (differs && !*in_range) {
+			*start = i;
+			*in_range = true;
+		}
+		else if (!differs && *in_range) {
+			knPushRange(script, count, *start, i);
+			*in_range = false;
+		}
+	}
+}
+
+int knDiff(lua_State *script) {
+	/**
+	 * ranges = knDiff(snapshotA, snapshotB)
+	 * 
+	 * Compare two snapshots of the same length and return a list of
+	 * {offset, length} for each run of bytes that is different between them.
+	 * Blocks of 64 bytes are compared at a time and only the ones with a
+	 * difference are looked at byte by byte.
+	 */
+	
+	KNSnapshot *a = knToSnapshot(script, 1);
+	KNSnapshot *b = knToSnapshot(script, 2);
+	
+	if (!a || !b || a->length != b->length) {
+		knReturnNil(script);
+	}
+	
+	KNLuaCreateTable(script, 0, 0);
+	
+	size_t count = 0;
+	size_t length = a->length;
+	size_t start = 0;
+	bool in_range = false;
+	size_t i = 0;
+	
+	for (; i + KN_SNAPSHOT_BLOCK <= length; i += KN_SNAPSHOT_BLOCK) {
+		if (knBlockEqual(a->data + i, b->data + i)) {
+			if (in_range) {
+				knPushRange(script, &count, start, i);
+				in_range = false;
+			}
+			
+			continue;
+		}
+		
+		knDiffBytes(script, &count, a->data, b->data, i, i + KN_SNAPSHOT_BLOCK, &start, &in_range);
+	}
+	
+	knDiffBytes(script, &count, a->data, b->data, i, length, &start, &in_range);
+	
+	if (in_range) {
+		knPushRange(script, &count, start, length);
+	}
+	
+	return 1;
+}
+
+typedef struct KNStructField {
+	char *name;
+	size_t offset;
+	int type;
+} KNStructField;
+
+typedef struct KNStruct {
+	char *name;
+	size_t field_count;
+	KNStructField *fields;
+} KNStruct;
+
+KNStruct *gStructs;
+size_t gStructCount;
+
+static int knCompareStructFields(const void *a, const void *b) {
+	const KNStructField *field_a = a, *field_b = b;
+	return (field_a->offset > field_b->offset) - (field_a->offset < field_b->offset);
+}
+
+static void knFreeStructFields(KNStructField *fields, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		free(fields[i].name);
+	}
+	
+	free(fields);
+}
+
+static int knFindStruct(const char *name) {
+	for (size_t i = 0; i < gStructCount; i++) {
+		if (!strcmp(gStructs[i].name, name)) {
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+static int knAddStruct(const char *name, KNStructField *fields, size_t field_count) {
+	/**
+	 * Add a struct schema or replace the fields of an existing one, taking
+	 * ownership of `fields`. Returns the handle or -1 on failure.
+	 */
+	
+	qsort(fields, field_count, sizeof *fields, knCompareStructFields);
+	
+	int handle = knFindStruct(name);
+	
+	if (handle >= 0) {
+		knFreeStructFields(gStructs[handle].fields, gStructs[handle].field_count);
+	}
+	else {
+		KNStruct *structs = realloc(gStructs, (gStructCount + 1) * sizeof *gStructs);
+		char *name_copy = strdup(name);
+		
+		if (!structs || !name_copy) {
+			if (structs) {
+				gStructs = structs;
+			}
+			
+			free(name_copy);
+			knFreeStructFields(fields, field_count);
+			return -1;
+		}
+		
+		gStructs = structs;
+		handle = gStructCount++;
+		gStructs[handle].name = name_copy;
+	}
+	
+	gStructs[handle].fields = fields;
+	gStructs[handle].field_count = field_count;
+	
+	return handle;
+}
+
+static KNStruct *knToStruct(lua_State *script, int index) {
+	/**
+	 * Get a struct schema from either its handle or its name. Anything else
+	 * (including nil) isn't a schema.
+	 */
+	
+	lua_Integer handle;
+	
+	switch (lua_type(script, index)) {
+		case LUA_TSTRING:
+			handle = knFindStruct(lua_tostring(script, index));
 			break;
-		case KN_TYPE_BYTES: {
-			size_t size;
-			const char *string = lua_tolstring(script, 3, &size);
-			memcpy((char *)addr, string, size);
+		case LUA_TNUMBER:
+			handle = lua_tointeger(script, index);
 			break;
-		}
 		default:
-			lua_pushnil(script);
-			return 1;
+			return NULL;
 	}
 	
-	lua_pushinteger(script, addr);
+	if (handle < 0 || (size_t) handle >= gStructCount) {
+		return NULL;
+	}
+	
+	return &gStructs[handle];
+}
+
+int knDefineStruct(lua_State *script) {
+	/**
+	 * (int|nil) schema = knDefineStruct(name, fields)
+	 * 
+	 * Define a struct schema, where `fields` maps each field name to an
+	 * {offset, type} pair. The offset can also be a table mapping ABI names
+	 * (as returned by knSystemAbi) to the offset for that ABI; fields without
+	 * an offset for the current ABI are left out. Returns a handle to use
+	 * with knStructGet and knStructSet, which also accept the name.
+	 */
+	
+	const char *name = lua_tostring(script, 1);
+	
+	if (!name || !lua_istable(script, 2)) {
+		knReturnNil(script);
+	}
+	
+	size_t field_count = 0, field_alloc = 8;
+	KNStructField *fields = malloc(field_alloc * sizeof *fields);
+	
+	if (!fields) {
+		knReturnNil(script);
+	}
+	
+	lua_pushnil(script);
+	
+	while (lua_next(script, 2)) {
+		// Stack: key, {offset, type}
+		if (lua_type(script, -2) != LUA_TSTRING || !lua_istable(script, -1)) {
+			lua_pop(script, 2);
+			knFreeStructFields(fields, field_count);
+			knReturnNil(script);
+		}
+		
+		lua_rawgeti(script, -1, 1);
+		
+		if (lua_istable(script, -1)) {
+			lua_getfield(script, -1, KN_ARCH_STRING);
+			lua_remove(script, -2);
+		}
+		
+		lua_rawgeti(script, -2, 2);
+		
+		bool has_offset = lua_isnumber(script, -2);
+		size_t offset = lua_tointeger(script, -2);
+		int type = lua_tointeger(script, -1);
+		lua_pop(script, 3);
+		
+		if (type < KN_TYPE_ADDR || type > KN_TYPE_STRING) {
+			lua_pop(script, 1);
+			knFreeStructFields(fields, field_count);
+			knReturnNil(script);
+		}
+		
+		if (!has_offset) {
+			continue;
+		}
+		
+		if (field_count == field_alloc) {
+			field_alloc *= 2;
+			KNStructField *new_fields = realloc(fields, field_alloc * sizeof *fields);
+			
+			if (!new_fields) {
+				lua_pop(script, 1);
+				knFreeStructFields(fields, field_count);
+				knReturnNil(script);
+			}
+			
+			fields = new_fields;
+		}
+		
+		fields[field_count].name = strdup(lua_tostring(script, -1));
+		
+		if (!fields[field_count].name) {
+			lua_pop(script, 1);
+			knFreeStructFields(fields, field_count);
+			knReturnNil(script);
+		}
+		
+		fields[field_count].offset = offset;
+		fields[field_count].type = type;
+		field_count++;
+	}
+	
+	int handle = knAddStruct(name, fields, field_count);
+	
+	if (handle < 0) {
+		knReturnNil(script);
+	}
+	
+	lua_pushinteger(script, handle);
 	return 1;
 }
 
+int knStructGet(lua_State *script) {
+	/**
+	 * (table|nil) values = knStructGet(addr, schema)
+	 * 
+	 * Read every field of the struct at `addr` into a table keyed by field
+	 * name.
+	 */
+	
+	size_t addr = knGetAddress(script, 1);
+	KNStruct *schema = knToStruct(script, 2);
+	
+	if (!addr || !schema) {
+		knReturnNil(script);
+	}
+	
+	KNLuaCreateTable(script, 0, schema->field_count);
+	
+	for (size_t i = 0; i < schema->field_count; i++) {
+		KNStructField *field = &schema->fields[i];
+		lua_pushstring(script, field->name);
+		knPushValue(script, addr + field->offset, field->type);
+		KNLuaSetTable(script, -3);
+	}
+	
+	return 1;
+}
+
+int knStructSet(lua_State *script) {
+	/**
+	 * (bool) success = knStructSet(addr, schema, values)
+	 * 
+	 * Write the fields in `values` (keyed by field name) to the struct at
+	 * `addr`. Fields that aren't in `values` are left alone.
+	 */
+	
+	size_t addr = knGetAddress(script, 1);
+	KNStruct *schema = knToStruct(script, 2);
+	
+	if (!addr || !schema || !lua_istable(script, 3)) {
+		lua_pushboolean(script, false);
+		return 1;
+	}
+	
+	for (size_t i = 0; i < schema->field_count; i++) {
+		KNStructField *field = &schema->fields[i];
+		lua_getfield(script, 3, field->name);
+		
+		if (!lua_isnil(script, -1)) {
+			knWriteValue(script, -1, addr + field->offset, field->type);
+		}
+		
+		lua_pop(script, 1);
+	}
+	
+	lua_pushboolean(script, true);
+	return 1;
+}
+
+#if defined(__arm__) || defined(__i386__) || defined(__aarch64__)
+#define KN_STRUCT_FIELD(STRUCT, FIELD, TYPE) { #FIELD, offsetof(STRUCT, FIELD), TYPE }
+
+static void knAddBuiltinStruct(const char *name, const KNStructField *fields, size_t count) {
+	KNStructField *copy = malloc(count * sizeof *copy);
+	
+	if (!copy) {
+		return;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		copy[i] = fields[i];
+		copy[i].name = strdup(fields[i].name);
+		
+		if (!copy[i].name) {
+			knFreeStructFields(copy, i);
+			return;
+		}
+	}
+	
+	knAddStruct(name, copy, count);
+}
+
+static void knAddBuiltinStructs(void) {
+	/**
+	 * Schemas for the structs in smashhit.h, so they have the right offsets
+	 * for each ABI without scripts needing to know them.
+	 */
+	
+	static const KNStructField player[] = {
+		KN_STRUCT_FIELD(Player, balls, KN_TYPE_INT),
+		KN_STRUCT_FIELD(Player, streak, KN_TYPE_INT),
+		KN_STRUCT_FIELD(Player, mode, KN_TYPE_INT),
+	};
+	
+	static const KNStructField level[] = {
+		KN_STRUCT_FIELD(Level, offsetZ, KN_TYPE_FLOAT),
+	};
+	
+	static const KNStructField game[] = {
+		KN_STRUCT_FIELD(Game, device, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, input, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, display, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, renderer, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, resman, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, audio, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, debug, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, gfx, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, scene1, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, scene2, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, scene3, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, level, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, player, KN_TYPE_ADDR),
+		KN_STRUCT_FIELD(Game, http_thread, KN_TYPE_ADDR),
+	};
+	
+	knAddBuiltinStruct("Player", player, sizeof player / sizeof *player);
+	knAddBuiltinStruct("Level", level, sizeof level / sizeof *level);
+	knAddBuiltinStruct("Game", game, sizeof game / sizeof *game);
+}
+#else
+static void knAddBuiltinStructs(void) {
+	// smashhit.h doesn't have this platform's layouts
+}
+#endif
+
 int knSystemAbi(lua_State *script) {
 	/**
 	 * abi = knSystemAbi()
@@ -195,8 +1060,18 @@ int knInvertBranch(lua_State *script) {
 
 int knEnablePeekPoke(lua_State *script) {
 	lua_register(script, "knSymbolAddr", knSymbolAddr);
+	lua_register(script, "knAddrToSymbol", knAddrToSymbol);
 	lua_register(script, "knPeek", knPeek);
 	lua_register(script, "knPoke", knPoke);
+	lua_register(script, "knPeekMany", knPeekMany);
+	lua_register(script, "knPokeMany", knPokeMany);
+	lua_register(script, "knPeekChain", knPeekChain);
+	lua_register(script, "knCompileChain", knCompileChain);
+	lua_register(script, "knSnapshot", knSnapshot);
+	lua_register(script, "knDiff", knDiff);
+	lua_register(script, "knDefineStruct", knDefineStruct);
+	lua_register(script, "knStructGet", knStructGet);
+	lua_register(script, "knStructSet", knStructSet);
 	lua_register(script, "knSystemAbi", knSystemAbi);
 	lua_register(script, "knInvertBranch", knInvertBranch);
 	
@@ -209,5 +1084,10 @@ int knEnablePeekPoke(lua_State *script) {
 	knLuaPushEnum(script, KN_TYPE_STRING);
 	knLuaPushEnum(script, KN_TYPE_BYTES);
 	
+	// Struct schemas from smashhit.h
+	if (!gStructCount) {
+		knAddBuiltinStructs();
+	}
+	
 	return 0;
 }
@@ -27,7 +27,7 @@ static KH_Dict *GetReg(void) {
 	return gRegistry;
 }
 
-#define knToString(BASESYM, INDEX) size_t BASESYM ## _size; const char * BASESYM = lua_tolstring(script, INDEX, &BASESYM ## _size);
+#define knToString(BASESYM, INDEX) size_t BASESYM ## _size; const char * BASESYM = KNToBytes(script, INDEX, &BASESYM ## _size);
 #define knBufToBlob(BASESYM) KH_CreateBlob((const uint8_t *) BASESYM, BASESYM ## _size)
 
 int knRegSet(lua_State *script) {
@@ -108,7 +108,7 @@ int knRegKeys(lua_State *script) {
 	// heap memory will corrupt shortly after trying to use them. Figure out
 	// what SH has changed about Lua such that it crashes unless we lookup the
 	// symbol, which is slower...
-	((void (*)(lua_State *, int, int)) KNGetSymbolAddr("lua_createtable"))(script, 0, 0);
+	KNLuaCreateTable(script, 0, 0);
 	
 	for (size_t i = 0; i < KH_DictLen(GetReg()); i++) {
 		lua_pushinteger(script, i + 1);
@@ -116,7 +116,7 @@ int knRegKeys(lua_State *script) {
 		KH_Blob *blob = KH_DictKeyIter(GetReg(), i);
 		
 		lua_pushlstring(script, (const char *) blob->data, blob->length);
-		((void (*)(lua_State *, int)) KNGetSymbolAddr("lua_settable"))(script, 1);
+		KNLuaSetTable(script, 1);
 	}
 	
 	return 1;
@@ -20,40 +20,356 @@ int knEnableRegistry(lua_State *script);
 int knEnableDatabase(lua_State *script);
 int knEnableFile(lua_State *script);
 int knEnableGamectl(lua_State *script);
+int knEnableTimeline(lua_State *script);
+int knEnableHotPages(lua_State *script);
+int knEnableInstrument(lua_State *script);
+int knEnableLuaHook(lua_State *script);
+int knEnablePattern(lua_State *script);
+int knEnablePatch(lua_State *script);
+int knEnableBind(lua_State *script);
+int knEnableWorker(lua_State *script);
+int knEnableBuffer(lua_State *script);
+#ifdef HYPERSPACE
+int knEnableOverlay(lua_State *script);
+#endif
 
 extern char *gAndroidInternalDataPath;
 extern char *gAndroidExternalDataPath;
 
-#ifndef HYPERSPACE
-int load_lua_libs(lua_State *script) {
-	// __android_log_print(ANDROID_LOG_INFO, TAG, "Hello from lua! Opening libs..");
+typedef struct KNLuaModule {
+	const char *name;
+	lua_CFunction enable;
+} KNLuaModule;
+
+static const KNLuaModule gLuaModules[] = {
+	{ "log", knEnableLog }, // Logging tools
+	{ "mem", knEnablePeekPoke }, // Memory manipulation
+	{ "http", knEnableHttp },
+	{ "sys", knEnableSystem }, // System utilities
+	{ "reg", knEnableRegistry },
+	{ "db", knEnableDatabase },
+	{ "file", knEnableFile }, // Better file reading and writing
+	{ "game", knEnableGamectl }, // Game control
+	{ "timeline", knEnableTimeline }, // Startup timings
+	{ "hotpages", knEnableHotPages },
+	{ "instrument", knEnableInstrument }, // Function call stats
+	{ "hook", knEnableLuaHook }, // Native hooks
+	{ "pattern", knEnablePattern }, // Byte patterns
+	{ "patch", knEnablePatch }, // Code patches
+	{ "bind", knEnableBind }, // Calling native functions
+	{ "worker", knEnableWorker }, // Background Lua states
+	{ "buffer", knEnableBuffer }, // String building
+#ifdef HYPERSPACE
+	{ "overlay", knEnableOverlay },
+#endif
+	{ NULL, NULL },
+};
+
+typedef struct KNLuaGlobal {
+	const char *name;
+	const char *module;
+} KNLuaGlobal;
+
+// Which module each of the old global names is in, so using one only loads
+// its own module and names that aren't in any module don't load anything.
+// Has to be kept up to date with what the modules register.
+static const KNLuaGlobal gLuaGlobals[] = {
+	{ "knLog", "log" },
+	{ "LOG_INFO", "log" },
+	{ "LOG_WARN", "log" },
+	{ "LOG_ERROR", "log" },
+	{ "knSymbolAddr", "mem" },
+	{ "knAddrToSymbol", "mem" },
+	{ "knPeek", "mem" },
+	{ "knPoke", "mem" },
+	{ "knPeekMany", "mem" },
+	{ "knPokeMany", "mem" },
+	{ "knPeekChain", "mem" },
+	{ "knCompileChain", "mem" },
+	{ "knSnapshot", "mem" },
+	{ "knDiff", "mem" },
+	{ "knDefineStruct", "mem" },
+	{ "knStructGet", "mem" },
+	{ "knStructSet", "mem" },
+	{ "knSystemAbi", "mem" },
+	{ "knInvertBranch", "mem" },
+	{ "KN_TYPE_ADDR", "mem" },
+	{ "KN_TYPE_BOOL", "mem" },
+	{ "KN_TYPE_SHORT", "mem" },
+	{ "KN_TYPE_INT", "mem" },
+	{ "KN_TYPE_FLOAT", "mem" },
+	{ "KN_TYPE_STRING", "mem" },
+	{ "KN_TYPE_BYTES", "mem" },
+	{ "knHttpRequest", "http" },
+	{ "knHttpUpdate", "http" },
+	{ "knHttpData", "http" },
+	{ "knHttpDataSize", "http" },
+	{ "knHttpContentType", "http" },
+	{ "knHttpError", "http" },
+	{ "knHttpErrorCode", "http" },
+	{ "knHttpRelease", "http" },
+	{ "knHttpExtractNxArchive", "http" },
+	{ "KN_HTTP_PENDING", "http" },
+	{ "KN_HTTP_DONE", "http" },
+	{ "KN_HTTP_ERROR", "http" },
+	{ "knGetShimVersion", "sys" },
+	{ "knGetInternalDataPath", "sys" },
+	{ "knGetExternalDataPath", "sys" },
+	{ "knRegSet", "reg" },
+	{ "knRegGet", "reg" },
+	{ "knRegHas", "reg" },
+	{ "knRegDelete", "reg" },
+	{ "knRegCount", "reg" },
+	{ "knRegKeys", "reg" },
+	{ "knDbSet", "db" },
+	{ "knDbGet", "db" },
+	{ "knDbHas", "db" },
+	{ "knDbDelete", "db" },
+	{ "knWriteFile", "file" },
+	{ "knReadFile", "file" },
+	{ "knRenameFile", "file" },
+	{ "knDeleteFile", "file" },
+	{ "knIsFile", "file" },
+	{ "knMakeDir", "file" },
+	{ "knSetBalls", "game" },
+	{ "knGetBalls", "game" },
+	{ "knSetStreak", "game" },
+	{ "knGetStreak", "game" },
+	{ "knSetNoclip", "game" },
+	{ "knGetNoclip", "game" },
+	{ "knDownloadFile", "game" },
+	{ "knHttpPost", "game" },
+	{ "knConnectAssetServer", "game" },
+	{ "knDisconnectAssetServer", "game" },
+	{ "knIsConnectedToAssetServer", "game" },
+	{ "knEnableReloading", "game" },
+	{ "knReload", "game" },
+	{ "knShitpost", "game" },
+	{ "knLevelHitSomething", "game" },
+	{ "knLevelStreakAbort", "game" },
+	{ "knLevelStreakInc", "game" },
+	{ "knLevelAddScore", "game" },
+	{ "knLevelExplosion", "game" },
+	{ "knGetStartupTimeline", "timeline" },
+	{ "knSaveHotPages", "hotpages" },
+	{ "knInstrumentFunction", "instrument" },
+	{ "knGetFunctionStats", "instrument" },
+	{ "knHook", "hook" },
+	{ "knUnhook", "hook" },
+	{ "knRunHooks", "hook" },
+	{ "knFindPattern", "pattern" },
+	{ "knPatch", "patch" },
+	{ "knUnpatch", "patch" },
+	{ "knPatchBegin", "patch" },
+	{ "knPatchCommit", "patch" },
+	{ "knBindFunction", "bind" },
+	{ "knSpawnWorker", "worker" },
+	{ "knPost", "worker" },
+	{ "knPoll", "worker" },
+	{ "knStopWorker", "worker" },
+	{ "knBuffer", "buffer" },
+#ifdef HYPERSPACE
+	{ "knMountOverlay", "overlay" },
+	{ "knUnmountOverlay", "overlay" },
+	{ "knLoadTemplates", "overlay" },
+	{ "knSetPlayerZeroState", "overlay" },
+#endif
+	{ NULL, NULL },
+};
+
+static void knNamespaceKey(lua_State *script, const char *name) {
+	/**
+	 * Push the name something has inside of its module's table: the same as
+	 * its global name, but functions lose the "kn", so knHttpRequest becomes
+	 * kn.http.httpRequest.
+	 */
 	
-	// Open default libs
-	luaL_openlibs(script);
+	if (name[0] == 'k' && name[1] == 'n' && name[2] >= 'A' && name[2] <= 'Z') {
+		char first = name[2] - 'A' + 'a';
+		lua_pushlstring(script, &first, 1);
+		lua_pushstring(script, name + 3);
+		lua_concat(script, 2);
+	}
+	else {
+		lua_pushstring(script, name);
+	}
+}
+
+static int knEnableModule(lua_State *script) {
+	/**
+	 * Run the enable function of the module at 2 (a light userdata) with the
+	 * table at 1 as the globals. Called protected, so the real globals can be
+	 * put back even if it fails.
+	 */
+	
+	const KNLuaModule *module = lua_touserdata(script, 2);
+	
+	lua_pushvalue(script, 1);
+	lua_replace(script, LUA_GLOBALSINDEX);
+	module->enable(script);
+	
+	return 0;
+}
+
+static void knLoadModule(lua_State *script, int kn, const KNLuaModule *module) {
+	/**
+	 * Build the table for a module and save it in the kn table, which is at
+	 * `kn` on the stack. Leaves the module's table on the stack, or nil if
+	 * the module failed to load.
+	 */
+	
+	int top = lua_gettop(script);
+	
+	// The modules register everything as globals, so they get a table of
+	// their own as the globals while they're being set up
+	KNLuaCreateTable(script, 0, 16);
+	int registered = lua_gettop(script);
+	lua_pushvalue(script, LUA_GLOBALSINDEX);
+	int globals = lua_gettop(script);
+	
+	lua_pushcfunction(script, knEnableModule);
+	lua_pushvalue(script, registered);
+	lua_pushlightuserdata(script, (void *) module);
+	int error = KNLuaPCall(script, 2, 0, 0);
+	
+	lua_pushvalue(script, globals);
+	lua_replace(script, LUA_GLOBALSINDEX);
+	
+	if (error) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Failed to load module %s: %s", module->name, lua_tostring(script, -1));
+		lua_settop(script, top);
+		lua_pushnil(script);
+		return;
+	}
+	
+	lua_settop(script, globals);
+	
+	KNLuaCreateTable(script, 0, 16);
+	int namespace = lua_gettop(script);
+	lua_pushnil(script);
+	
+	while (lua_next(script, registered)) {
+		knNamespaceKey(script, lua_tostring(script, -2));
+		lua_pushvalue(script, -2);
+		KNLuaSetTable(script, namespace);
+		lua_pop(script, 1);
+	}
+	
+	lua_pushstring(script, module->name);
+	lua_pushvalue(script, namespace);
+	KNLuaSetTable(script, kn);
+	
+	lua_replace(script, top + 1);
+	lua_settop(script, top + 1);
+}
+
+static int knIndexModules(lua_State *script) {
+	/**
+	 * __index for the kn table, which loads modules the first time they are
+	 * used.
+	 */
+	
+	const char *name = lua_tostring(script, 2);
+	
+	for (size_t i = 0; name && gLuaModules[i].name; i++) {
+		if (!strcmp(gLuaModules[i].name, name)) {
+			knLoadModule(script, 1, &gLuaModules[i]);
+			return 1;
+		}
+	}
+	
+	knReturnNil(script);
+}
+
+static int knIndexGlobals(lua_State *script) {
+	/**
+	 * __index for the globals, so scripts using the old global names still
+	 * work. Each name is looked up in its module the first time it is used
+	 * and then saved as a global, so it's only slow once.
+	 */
+	
+	const char *name = lua_tostring(script, 2);
+	
+	if (!name || (strncmp(name, "kn", 2) && strncmp(name, "KN_", 3) && strncmp(name, "LOG_", 4))) {
+		knReturnNil(script);
+	}
+	
+	const KNLuaGlobal *global = gLuaGlobals;
+	
+	while (global->name && strcmp(global->name, name)) {
+		global++;
+	}
+	
+	if (!global->name) {
+		knReturnNil(script);
+	}
+	
+	lua_getfield(script, lua_upvalueindex(1), global->module);
+	
+	if (!lua_istable(script, -1)) {
+		knReturnNil(script);
+	}
+	
+	knNamespaceKey(script, name);
+	lua_rawget(script, -2);
 	
-	// Logging tools
-	knEnableLog(script);
+	if (!lua_isnil(script, -1)) {
+		lua_pushvalue(script, 2);
+		lua_pushvalue(script, -2);
+		lua_rawset(script, 1);
+	}
 	
-	// Memory manipulation
-	knEnablePeekPoke(script);
+	return 1;
+}
+
+static void knOpenModules(lua_State *script) {
+	/**
+	 * Make the modules available as kn.log, kn.mem, kn.http and so on. They
+	 * are only loaded when they're first used.
+	 */
 	
-	// HTTP
-	knEnableHttp(script);
+	KNLuaCreateTable(script, 0, 0);
+	int kn = lua_gettop(script);
 	
-	// System utilities
-	knEnableSystem(script);
+	KNLuaCreateTable(script, 0, 1);
+	lua_pushstring(script, "__index");
+	lua_pushcfunction(script, knIndexModules);
+	KNLuaSetTable(script, -3);
+	lua_setmetatable(script, kn);
 	
-	// Registry
-	knEnableRegistry(script);
+	lua_pushvalue(script, kn);
+	lua_setglobal(script, "kn");
+	
+	// Old global names, unless something else is already using the globals'
+	// metatable, in which case everything is just registered up front
+	if (lua_getmetatable(script, LUA_GLOBALSINDEX)) {
+		lua_pop(script, 1);
+		
+		for (size_t i = 0; gLuaModules[i].name; i++) {
+			gLuaModules[i].enable(script);
+		}
+	}
+	else {
+		KNLuaCreateTable(script, 0, 1);
+		lua_pushstring(script, "__index");
+		lua_pushvalue(script, kn);
+		lua_pushcclosure(script, knIndexGlobals, 1);
+		KNLuaSetTable(script, -3);
+		lua_setmetatable(script, LUA_GLOBALSINDEX);
+	}
 	
-	// Database
-	knEnableDatabase(script);
+	lua_pop(script, 1);
+}
+
+#ifndef HYPERSPACE
+int load_lua_libs(lua_State *script) {
+	// __android_log_print(ANDROID_LOG_INFO, TAG, "Hello from lua! Opening libs..");
 	
-	// Better file reading and writing
-	knEnableFile(script);
+	// Open default libs
+	luaL_openlibs(script);
 	
-	// Game control
-	knEnableGamectl(script);
+	// Our modules
+	knOpenModules(script);
 	
 	return 0;
 }
@@ -85,8 +401,6 @@ void KNInitLua(struct android_app *app, Leaf *leaf) {
 
 #else
 
-int knEnableOverlay(lua_State *script);
-
 void (*real_script_load_func)(Script *this, QiString *path);
 
 static void script_load_hook(Script *this, QiString *path) {
@@ -101,15 +415,7 @@ static void script_load_hook(Script *this, QiString *path) {
 		__android_log_print(ANDROID_LOG_INFO, TAG, "Injecting functions into %s", path_string);
 		
 		luaL_openlibs(script);
-		knEnableLog(script);
-		knEnablePeekPoke(script);
-		knEnableHttp(script);
-		knEnableSystem(script);
-		knEnableRegistry(script);
-		knEnableDatabase(script);
-		knEnableFile(script);
-		knEnableGamectl(script);
-		knEnableOverlay(script);
+		knOpenModules(script);
 	}
 }
 
@@ -13,6 +13,9 @@ Leaf *gLeaf;
 
 typedef void (*AndroidMainFunc)(struct android_app *app);
 
+void KNHotPagesLoad(struct android_app *app, Leaf *leaf);
+void KNHotPagesRelease(Leaf *leaf);
+
 void KNInitLua(struct android_app *app, Leaf *leaf);
 // void KNDebugLogInit(struct android_app *app, Leaf *leaf);
 void KNDatabaseInit(struct android_app *app, Leaf *leaf);
@@ -23,17 +26,24 @@ void KNCipherInit(struct android_app *app, Leaf *leaf);
 void KNOverlayInit(struct android_app *app, Leaf *leaf);
 #endif
 
-ModuleInitFunc gModuleInitFuncs[] = {
-	KNInitLua,
-	// KNDebugLogInit,
-	KNDatabaseInit,
+typedef struct KNModule {
+	const char *name;
+	ModuleInitFunc init;
+} KNModule;
+
+#define KN_MODULE(FUNC) { #FUNC, FUNC }
+
+KNModule gModuleInitFuncs[] = {
+	KN_MODULE(KNInitLua),
+	// KN_MODULE(KNDebugLogInit),
+	KN_MODULE(KNDatabaseInit),
 #ifdef BUILD_CIPHER
-	KNCipherInit,
+	KN_MODULE(KNCipherInit),
 #endif
 #ifdef HYPERSPACE
-	KNOverlayInit,
+	KN_MODULE(KNOverlayInit),
 #endif
-	NULL,
+	{ NULL, NULL },
 };
 
 AAsset *load_libsmashhit(struct android_app *app, const void **data, size_t *length) {
@@ -53,6 +63,9 @@ AAsset *load_libsmashhit(struct android_app *app, const void **data, size_t *len
 }
 
 void android_main(struct android_app *app) {
+	uint64_t startup_start = KNTimeNs();
+	uint64_t phase_start = startup_start;
+	
 	// Create an instance of Leaf for loading the main binary
 	gLeaf = LeafInit();
 	
@@ -65,6 +78,7 @@ void android_main(struct android_app *app) {
 	}
 	
 	// Load the contents of LSH
+	phase_start = KNTimeNs();
 	const void *data;
 	size_t length;
 	AAsset *asset = load_libsmashhit(app, &data, &length);
@@ -77,8 +91,17 @@ void android_main(struct android_app *app) {
 		__android_log_print(ANDROID_LOG_INFO, TAG, "Loaded libsmashhit.so from native directory");
 	}
 	
+	KNTimelineAdd("asset", KNTimeNs() - phase_start);
+	
+	// Set loader options
+#ifdef KN_HUGEPAGES
+	gLeaf->flags |= LEAF_FLAG_HUGEPAGES;
+#endif
+	KNHotPagesLoad(app, gLeaf);
+	
 	// Load from the buffer we just read
 	const char *error = LeafLoadFromBuffer(gLeaf, (void *) data, length);
+	KNHotPagesRelease(gLeaf);
 	
 	if (error) {
 		__android_log_print(ANDROID_LOG_FATAL, TAG, "Leaf loading elf failed: %s", error);
@@ -88,14 +111,25 @@ void android_main(struct android_app *app) {
 		__android_log_print(ANDROID_LOG_INFO, TAG, "Loading elf succeeded");
 	}
 	
+	KNTimelineAddLeaf(gLeaf);
+	
 	// Close asset handle, not needed anymore
 	AAsset_close(asset);
 	
-	// Install modules
-	for (size_t i = 0; gModuleInitFuncs[i] != NULL; i++) {
-		(gModuleInitFuncs[i])(app, gLeaf);
+	// Install modules. Their hooks are batched and written all at once after
+	// every module has been set up.
+	KNHookBegin();
+	
+	for (size_t i = 0; gModuleInitFuncs[i].init != NULL; i++) {
+		phase_start = KNTimeNs();
+		(gModuleInitFuncs[i].init)(app, gLeaf);
+		KNTimelineAdd(gModuleInitFuncs[i].name, KNTimeNs() - phase_start);
 	}
 	
+	phase_start = KNTimeNs();
+	KNHookCommit();
+	KNTimelineAdd("hooks", KNTimeNs() - phase_start);
+	
 	// Get main func and call
 	AndroidMainFunc func = LeafSymbolAddr(gLeaf, "android_main");
 	
@@ -107,5 +141,12 @@ void android_main(struct android_app *app) {
 		__android_log_print(ANDROID_LOG_INFO, TAG, "Found android_main() at %p", func);
 	}
 	
+	// Everything up to handing off to the game
+	KNTimelineAdd("total", KNTimeNs() - startup_start);
+	KNTimelineLog();
+	
 	func(app);
+	
+	// The game has finished, so this is the last chance to see the stats
+	KNInstrumentLog();
 }
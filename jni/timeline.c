@@ -0,0 +1,110 @@
+/**
+ * Startup phase timings, so that cold start regressions can be tracked
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+#define KN_TIMELINE_MAX 64
+
+typedef struct KNTimelineEntry {
+	char name[32];
+	uint64_t ns;
+} KNTimelineEntry;
+
+KNTimelineEntry gTimeline[KN_TIMELINE_MAX];
+size_t gTimelineCount;
+
+uint64_t KNTimeNs(void) {
+	/**
+	 * Monotonic clock in nanoseconds
+	 */
+	
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void KNTimelineAdd(const char *name, uint64_t ns) {
+	/**
+	 * Record how long the named startup phase took. Phases past the limit are
+	 * dropped.
+	 */
+	
+	if (gTimelineCount >= KN_TIMELINE_MAX) {
+		return;
+	}
+	
+	KNTimelineEntry *entry = &gTimeline[gTimelineCount++];
+	snprintf(entry->name, sizeof entry->name, "%s", name);
+	entry->ns = ns;
+}
+
+void KNTimelineAddLeaf(Leaf *leaf) {
+	/**
+	 * Record the loader stages that Leaf timed for us.
+	 */
+	
+	KNTimelineAdd("leaf.map", leaf->timings.map_ns);
+	KNTimelineAdd("leaf.copy", leaf->timings.copy_ns);
+	KNTimelineAdd("leaf.deps", leaf->timings.deps_ns);
+	KNTimelineAdd("leaf.imports", leaf->timings.imports_ns);
+	KNTimelineAdd("leaf.symbols", leaf->timings.symbols_ns);
+	KNTimelineAdd("leaf.relocs", leaf->timings.relocs_ns);
+	
+	for (size_t i = 0; i < leaf->timings.init_func_count; i++) {
+		char name[32];
+		snprintf(name, sizeof name, "leaf.init[%zu]", i);
+		KNTimelineAdd(name, leaf->timings.init_func_ns[i]);
+	}
+	
+	KNTimelineAdd("leaf.init", leaf->timings.init_ns);
+}
+
+void KNTimelineLog(void) {
+	/**
+	 * Log all of the phases as one line.
+	 */
+	
+	char line[2048];
+	size_t used = snprintf(line, sizeof line, "Startup timeline (ms):");
+	
+	for (size_t i = 0; i < gTimelineCount && used < sizeof line; i++) {
+		used += snprintf(line + used, sizeof line - used, " %s=%.3f", gTimeline[i].name, gTimeline[i].ns / 1000000.0);
+	}
+	
+	__android_log_print(ANDROID_LOG_INFO, TAG, "%s", line);
+}
+
+int knGetStartupTimeline(lua_State *script) {
+	/**
+	 * (table) timeline = knGetStartupTimeline()
+	 * 
+	 * Return a table mapping each startup phase name to how long it took in
+	 * milliseconds.
+	 */
+	
+	KNLuaCreateTable(script, 0, gTimelineCount);
+	
+	for (size_t i = 0; i < gTimelineCount; i++) {
+		lua_pushstring(script, gTimeline[i].name);
+		lua_pushnumber(script, gTimeline[i].ns / 1000000.0);
+		KNLuaSetTable(script, -3);
+	}
+	
+	return 1;
+}
+
+int knEnableTimeline(lua_State *script) {
+	knRegisterFunc(script, knGetStartupTimeline);
+	
+	return 0;
+}
@@ -59,6 +59,15 @@ void *KNGetSymbolAddr(const char *name) {
 	return LeafSymbolAddr(gLeaf, name);
 }
 
+const char *KNGetSymbolForAddr(void *addr, size_t *offset) {
+	/**
+	 * Get the name of the libsmashhit.so symbol containing the given address
+	 * and the offset into it, or NULL if there isn't one.
+	 */
+	
+	return LeafSymbolForAddr(gLeaf, addr, offset);
+}
+
 int invert_branch(void *addr) {
 	/**
 	 * Invert the branch at the given address.
@@ -113,32 +122,40 @@ int invert_branch(void *addr) {
 	#endif
 }
 
-#if defined(__ARM_ARCH_7A__)
-#define LH_AARCH32
-#elif defined(__aarch64__)
-#define LH_AARCH64
-#endif
 #define LEAFHOOK_IMPLEMENTATION
 #include "leafhook.h"
 
 LHHooker *gHooker;
 
+static bool KNHookCheckPatch(void *addr, size_t size, void *userdata) {
+	return !KNPatchOverlaps(addr, size);
+}
+
 static bool KNHookInit(void) {
 	gHooker = LHHookerCreate();
 	
+	if (gHooker) {
+		// Hooks and probes can't go over bytes a KNPatch owns
+		LHHookerSetPatchCheck(gHooker, KNHookCheckPatch, NULL);
+	}
+	
 	return !!gHooker;
 }
 
+static bool KNHookEnsureInit(void) {
+	if (!gHooker && !KNHookInit()) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Could not init leafhook hooker");
+		return false;
+	}
+	
+	return true;
+}
+
 bool KNHookFunction(void *func, void *hook, void **orig) {
 	bool success;
 	
-	if (!gHooker) {
-		success = KNHookInit();
-		
-		if (!success) {
-			__android_log_print(ANDROID_LOG_ERROR, TAG, "Could not init leafhook hooker");
-			return success;
-		}
+	if (!KNHookEnsureInit()) {
+		return false;
 	}
 	
 	success = LHHookerHookFunction(gHooker, func, hook, orig);
@@ -150,6 +167,135 @@ bool KNHookFunction(void *func, void *hook, void **orig) {
 	return success;
 }
 
+bool KNUnhookFunction(void *func, void *hook) {
+	/**
+	 * Remove a hook made with KNHookFunction(). Other hooks on the same
+	 * function keep working.
+	 */
+	
+	if (!gHooker) {
+		return false;
+	}
+	
+	bool success = LHHookerUnhook(gHooker, func, hook);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error unhooking function!");
+	}
+	
+	return success;
+}
+
+bool KNProbe(void *addr, LHProbeCallback callback, void *userdata) {
+	/**
+	 * Call `callback` with the registers every time the instruction at `addr`
+	 * is about to run. See LHHookerProbe().
+	 */
+	
+	if (!KNHookEnsureInit()) {
+		return false;
+	}
+	
+	bool success = LHHookerProbe(gHooker, addr, callback, userdata);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error probing instruction at <%p>!", addr);
+	}
+	
+	return success;
+}
+
+bool KNProbeThread(void *addr, LHProbeCallback callback, void *userdata, const uintptr_t *thread) {
+	/**
+	 * KNProbe(), but only calling `callback` on the thread whose
+	 * LHThreadId() is in `*thread`. See LHHookerProbeThread().
+	 */
+	
+	if (!KNHookEnsureInit()) {
+		return false;
+	}
+	
+	bool success = LHHookerProbeThread(gHooker, addr, callback, userdata, thread);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error probing instruction at <%p>!", addr);
+	}
+	
+	return success;
+}
+
+bool KNUnprobe(void *addr) {
+	/**
+	 * Remove a probe made with KNProbe() or KNProbeThread().
+	 */
+	
+	if (!gHooker) {
+		return false;
+	}
+	
+	bool success = LHHookerUnprobe(gHooker, addr);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error removing probe at <%p>!", addr);
+	}
+	
+	return success;
+}
+
+bool KNHookOverlaps(void *addr, size_t size) {
+	/**
+	 * Check if a hook or probe has written over any of [addr, addr + size).
+	 */
+	
+	return gHooker && LHHookerIsPatched(gHooker, addr, size);
+}
+
+void KNHookBegin(void) {
+	/**
+	 * Start batching hooks. Functions hooked before KNHookCommit() get their
+	 * orig pointers right away but aren't patched until the commit, which
+	 * does all of them with one mprotect() and cache flush per page range.
+	 */
+	
+	if (KNHookEnsureInit()) {
+		LHHookerBegin(gHooker);
+	}
+}
+
+bool KNHookCommit(void) {
+	/**
+	 * Patch all the functions hooked since KNHookBegin().
+	 */
+	
+	if (!gHooker) {
+		return false;
+	}
+	
+	bool success = LHHookerCommit(gHooker);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error committing hooks!");
+	}
+	
+	return success;
+}
+
+bool KNInterposeImport(const char *name, void *replacement, void **orig) {
+	/**
+	 * Redirect libsmashhit's calls to an imported function (e.g. malloc or
+	 * glDrawElements) to `replacement`. This is much cheaper than hooking the
+	 * function itself since only the GOT entries are changed.
+	 */
+	
+	bool success = LeafInterposeImport(gLeaf, name, replacement, orig);
+	
+	if (!success) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error interposing import %s!", name);
+	}
+	
+	return success;
+}
+
 bool KNLoadExt(const char *name, struct android_app *app, Leaf *leaf) {
 	/**
 	 * Loads a KnShim optional module (e.g. asset crypto) by its libname
@@ -171,3 +317,44 @@ bool KNLoadExt(const char *name, struct android_app *app, Leaf *leaf) {
 	
 	return true;
 }
+
+void KNLuaCreateTable(struct lua_State *script, int narr, int nrec) {
+	/**
+	 * Smash Hit corrupts its heap shortly after tables are created with our
+	 * copy of Lua, so tables have to be created and filled using the game's
+	 * own functions. See knRegKeys().
+	 */
+	
+	static void (*createtable)(struct lua_State *, int, int);
+	
+	if (!createtable) {
+		createtable = KNGetSymbolAddr("lua_createtable");
+	}
+	
+	createtable(script, narr, nrec);
+}
+
+void KNLuaSetTable(struct lua_State *script, int index) {
+	static void (*settable)(struct lua_State *, int);
+	
+	if (!settable) {
+		settable = KNGetSymbolAddr("lua_settable");
+	}
+	
+	settable(script, index);
+}
+
+int KNLuaPCall(struct lua_State *script, int nargs, int nresults, int errfunc) {
+	/**
+	 * Call a Lua function using the game's lua_pcall(), for the same reasons
+	 * as above.
+	 */
+	
+	static int (*pcall)(struct lua_State *, int, int, int);
+	
+	if (!pcall) {
+		pcall = KNGetSymbolAddr("lua_pcall");
+	}
+	
+	return pcall(script, nargs, nresults, errfunc);
+}
@@ -20,10 +20,25 @@ typedef uint32_t shortop_t;
 #define KN_ARCH_STRING "x86"
 #define KN_RET 0xc3
 typedef uint8_t shortop_t;
+#elif defined(__x86_64__)
+#define KN_ARCH_STRING "x86_64"
+#define KN_RET 0xc3
+typedef uint8_t shortop_t;
 #else
 #define KN_ARCH_STRING "unknown"
 #endif
 
+// Backend for leafhook.h, which needs to be the same everywhere it's included
+#if defined(__ARM_ARCH_7A__)
+#define LH_AARCH32
+#elif defined(__aarch64__)
+#define LH_AARCH64
+#elif defined(__i386__)
+#define LH_X86
+#elif defined(__x86_64__)
+#define LH_X86_64
+#endif
+
 typedef struct KNHookManager {
 	void *code;
 	size_t code_alloced;
@@ -33,13 +48,54 @@ typedef struct KNHookManager {
 
 typedef void (*ModuleInitFunc)(struct android_app *app, Leaf *leaf);
 
+struct lua_State;
+struct LHProbeContext;
+
 void *KNGetSymbolAddr(const char *name);
+const char *KNGetSymbolForAddr(void *addr, size_t *offset);
 int invert_branch(void *addr);
 int replace_function(void *from, void *to);
 
 bool KNHookFunction(void *func, void *hook, void **orig);
+bool KNUnhookFunction(void *func, void *hook);
+bool KNHookOverlaps(void *addr, size_t size);
+void KNHookBegin(void);
+bool KNHookCommit(void);
+bool KNProbe(void *addr, void (*callback)(struct LHProbeContext *, void *), void *userdata);
+bool KNProbeThread(void *addr, void (*callback)(struct LHProbeContext *, void *), void *userdata, const uintptr_t *thread);
+bool KNUnprobe(void *addr);
+bool KNInterposeImport(const char *name, void *replacement, void **orig);
 bool KNLoadExt(const char *name, struct android_app *app, Leaf *leaf);
 
+void KNLuaCreateTable(struct lua_State *script, int narr, int nrec);
+void KNLuaSetTable(struct lua_State *script, int index);
+int KNLuaPCall(struct lua_State *script, int nargs, int nresults, int errfunc);
+const char *KNToBytes(struct lua_State *script, int index, size_t *size);
+bool KNParseSignature(const char *signature, char *ret, char *args, size_t *arg_count, size_t max_args);
+
+typedef struct KNBuffer KNBuffer;
+
+KNBuffer *KNToBuffer(struct lua_State *script, int index);
+char *KNBufferDetach(KNBuffer *buffer, size_t *size, size_t *alloced);
+void KNPushBuffer(struct lua_State *script, char *data, size_t size, size_t alloced);
+void KNOpenBuffers(struct lua_State *script, void (*createtable)(struct lua_State *, int, int), void (*settable)(struct lua_State *, int));
+
+uint64_t KNTimeNs(void);
+void KNTimelineAdd(const char *name, uint64_t ns);
+void KNTimelineAddLeaf(Leaf *leaf);
+void KNTimelineLog(void);
+
+typedef struct KNPatch KNPatch;
+
+void KNPatchBegin(void);
+bool KNPatchCommit(void);
+KNPatch *KNPatchApply(void *addr, const void *bytes, size_t size, const char *owner);
+bool KNPatchRevert(KNPatch *patch);
+bool KNPatchOverlaps(void *addr, size_t size);
+
+bool KNInstrumentFunction(const char *symbol);
+void KNInstrumentLog(void);
+
 #define knRegisterFunc(SCRIPT, NAME) lua_register(SCRIPT, #NAME, NAME)
 #define knLuaPushEnum(SCRIPT, ENUM_NAME) lua_pushinteger(SCRIPT, ENUM_NAME); lua_setglobal(SCRIPT, #ENUM_NAME);
 #define knReturnNil(SCRIPT) lua_pushnil(SCRIPT); return 1;
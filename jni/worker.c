@@ -0,0 +1,675 @@
+/**
+ * Running Lua on background threads. Each worker has its own Lua state using
+ * the shim's copy of Lua, which only has the standard libraries and the
+ * functions for sending messages and knBuffer(), so it can't touch the game.
+ * Messages are copied between states in a serialized form, except for the
+ * memory of buffers, which is handed over to the other side.
+ */
+
+#include <android_native_app_glue.h>
+#include <android/log.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "util.h"
+
+#define KN_WORKER_MAX 8
+#define KN_MESSAGE_MAX_DEPTH 32
+
+int knBuffer(lua_State *script);
+
+enum {
+	KN_MESSAGE_NIL = 0,
+	KN_MESSAGE_FALSE,
+	KN_MESSAGE_TRUE,
+	KN_MESSAGE_NUMBER,
+	KN_MESSAGE_STRING,
+	KN_MESSAGE_TABLE,
+	KN_MESSAGE_TABLE_END,
+	KN_MESSAGE_BUFFER,
+};
+
+// What follows KN_MESSAGE_BUFFER. The message owns `data` until it's read.
+typedef struct KNMessageBuffer {
+	char *data;
+	size_t size;
+	size_t alloced;
+} KNMessageBuffer;
+
+typedef struct KNMessage {
+	struct KNMessage *next;
+	size_t size;
+	uint8_t data[];
+} KNMessage;
+
+typedef struct KNMessageQueue {
+	KNMessage *first;
+	KNMessage *last;
+} KNMessageQueue;
+
+typedef struct KNWorker {
+	struct KNWorker *next;
+	int id;
+	int refs; // One for the script that made it and one for its thread
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	KNMessageQueue inbox; // Script to worker
+	KNMessageQueue outbox; // Worker to script
+	bool stopping;
+	lua_State *script;
+	char *source;
+	size_t source_length;
+} KNWorker;
+
+// A buffer to take the memory of once the message is done, and where in the
+// message it goes
+typedef struct KNMessageMove {
+	KNBuffer *buffer;
+	size_t offset;
+} KNMessageMove;
+
+typedef struct KNMessageWriter {
+	uint8_t *data;
+	size_t size;
+	size_t alloced;
+	KNMessageMove *moves;
+	size_t move_count;
+	size_t moves_alloced;
+} KNMessageWriter;
+
+// The functions used to make tables when reading a message, since the game's
+// states need the game's ones and workers need ours
+typedef struct KNTableFuncs {
+	void (*create)(lua_State *script, int narr, int nrec);
+	void (*set)(lua_State *script, int index);
+} KNTableFuncs;
+
+static const KNTableFuncs gGameTableFuncs = { KNLuaCreateTable, KNLuaSetTable };
+static const KNTableFuncs gWorkerTableFuncs = { lua_createtable, lua_settable };
+
+// Only touched from the script thread
+KNWorker *gWorkers;
+size_t gWorkerCount;
+int gWorkerNextId = 1;
+
+static bool KNMessageWrite(KNMessageWriter *writer, const void *data, size_t size) {
+	if (writer->size + size > writer->alloced) {
+		size_t alloced = writer->alloced ? writer->alloced * 2 : 64;
+		
+		while (alloced < writer->size + size) {
+			alloced *= 2;
+		}
+		
+		uint8_t *new_data = realloc(writer->data, alloced);
+		
+		if (!new_data) {
+			return false;
+		}
+		
+		writer->data = new_data;
+		writer->alloced = alloced;
+	}
+	
+	memcpy(writer->data + writer->size, data, size);
+	writer->size += size;
+	
+	return true;
+}
+
+static bool KNMessageWriteTag(KNMessageWriter *writer, uint8_t tag) {
+	return KNMessageWrite(writer, &tag, sizeof tag);
+}
+
+static bool KNMessageHasBuffer(KNMessageWriter *writer, KNBuffer *buffer) {
+	for (size_t i = 0; i < writer->move_count; i++) {
+		if (writer->moves[i].buffer == buffer) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static bool KNMessageWriteBuffer(KNMessageWriter *writer, KNBuffer *buffer) {
+	/**
+	 * Leave space for a buffer, which is only taken once the whole message has
+	 * been written so nothing is lost if it can't be sent.
+	 */
+	
+	if (writer->move_count == writer->moves_alloced) {
+		size_t moves_alloced = writer->moves_alloced ? writer->moves_alloced * 2 : 4;
+		KNMessageMove *moves = realloc(writer->moves, moves_alloced * sizeof *moves);
+		
+		if (!moves) {
+			return false;
+		}
+		
+		writer->moves = moves;
+		writer->moves_alloced = moves_alloced;
+	}
+	
+	KNMessageBuffer empty = { 0 };
+	
+	if (!KNMessageWriteTag(writer, KN_MESSAGE_BUFFER)) {
+		return false;
+	}
+	
+	writer->moves[writer->move_count].buffer = buffer;
+	writer->moves[writer->move_count].offset = writer->size;
+	writer->move_count++;
+	
+	return KNMessageWrite(writer, &empty, sizeof empty);
+}
+
+static bool KNSerialize(lua_State *script, int index, KNMessageWriter *writer, int depth) {
+	/**
+	 * Write the value at `index` to a message. Only nil, booleans, numbers,
+	 * strings, buffers and tables of those can be sent.
+	 */
+	
+	switch (lua_type(script, index)) {
+		case LUA_TNIL: {
+			return KNMessageWriteTag(writer, KN_MESSAGE_NIL);
+		}
+		case LUA_TBOOLEAN: {
+			return KNMessageWriteTag(writer, lua_toboolean(script, index) ? KN_MESSAGE_TRUE : KN_MESSAGE_FALSE);
+		}
+		case LUA_TNUMBER: {
+			lua_Number number = lua_tonumber(script, index);
+			return KNMessageWriteTag(writer, KN_MESSAGE_NUMBER) && KNMessageWrite(writer, &number, sizeof number);
+		}
+		case LUA_TUSERDATA: {
+			KNBuffer *buffer = KNToBuffer(script, index);
+			
+			if (!buffer) {
+				return false;
+			}
+			
+			// The same buffer twice has to be copied the second time
+			if (!KNMessageHasBuffer(writer, buffer)) {
+				return KNMessageWriteBuffer(writer, buffer);
+			}
+			
+			// fall through
+		}
+		case LUA_TSTRING: {
+			size_t length;
+			const char *string = KNToBytes(script, index, &length);
+			
+			if (!string) {
+				return false;
+			}
+			
+			uint32_t length32 = length;
+			return KNMessageWriteTag(writer, KN_MESSAGE_STRING) && KNMessageWrite(writer, &length32, sizeof length32) && KNMessageWrite(writer, string, length);
+		}
+		case LUA_TTABLE: {
+			// Also stops tables that contain themselves
+			if (depth >= KN_MESSAGE_MAX_DEPTH || !lua_checkstack(script, 3) || !KNMessageWriteTag(writer, KN_MESSAGE_TABLE)) {
+				return false;
+			}
+			
+			if (index < 0) {
+				index = lua_gettop(script) + index + 1;
+			}
+			
+			lua_pushnil(script);
+			
+			while (lua_next(script, index)) {
+				if (!KNSerialize(script, -2, writer, depth + 1) || !KNSerialize(script, -1, writer, depth + 1)) {
+					lua_pop(script, 2);
+					return false;
+				}
+				
+				lua_pop(script, 1);
+			}
+			
+			return KNMessageWriteTag(writer, KN_MESSAGE_TABLE_END);
+		}
+		default: {
+			return false;
+		}
+	}
+}
+
+static bool KNDeserialize(lua_State *script, uint8_t **at, const uint8_t *end, const KNTableFuncs *funcs) {
+	/**
+	 * Push the next value in a message.
+	 */
+	
+	if (*at >= end || !lua_checkstack(script, 3)) {
+		return false;
+	}
+	
+	uint8_t tag = *(*at)++;
+	
+	switch (tag) {
+		case KN_MESSAGE_NIL: {
+			lua_pushnil(script);
+			return true;
+		}
+		case KN_MESSAGE_FALSE:
+		case KN_MESSAGE_TRUE: {
+			lua_pushboolean(script, tag == KN_MESSAGE_TRUE);
+			return true;
+		}
+		case KN_MESSAGE_NUMBER: {
+			lua_Number number;
+			memcpy(&number, *at, sizeof number);
+			*at += sizeof number;
+			lua_pushnumber(script, number);
+			return true;
+		}
+		case KN_MESSAGE_STRING: {
+			uint32_t length;
+			memcpy(&length, *at, sizeof length);
+			*at += sizeof length;
+			lua_pushlstring(script, (const char *) *at, length);
+			*at += length;
+			return true;
+		}
+		case KN_MESSAGE_BUFFER: {
+			// Hand the memory over, so the message won't free it
+			KNMessageBuffer buffer;
+			memcpy(&buffer, *at, sizeof buffer);
+			KNPushBuffer(script, buffer.data, buffer.size, buffer.alloced);
+			memset(*at, 0, sizeof buffer);
+			*at += sizeof buffer;
+			return true;
+		}
+		case KN_MESSAGE_TABLE: {
+			funcs->create(script, 0, 0);
+			
+			while (*at < end && **at != KN_MESSAGE_TABLE_END) {
+				if (!KNDeserialize(script, at, end, funcs) || !KNDeserialize(script, at, end, funcs)) {
+					return false;
+				}
+				
+				funcs->set(script, -3);
+			}
+			
+			(*at)++;
+			return true;
+		}
+		default: {
+			return false;
+		}
+	}
+}
+
+static bool KNMessageSend(KNWorker *worker, KNMessageQueue *queue, lua_State *script, int index) {
+	/**
+	 * Serialize a value and add it to one of a worker's queues.
+	 */
+	
+	KNMessageWriter writer = { 0 };
+	KNMessage header = { 0 };
+	
+	// Leave space for the header so the buffer can be used as the message
+	if (!KNMessageWrite(&writer, &header, sizeof header) || !KNSerialize(script, index, &writer, 0)) {
+		free(writer.data);
+		free(writer.moves);
+		return false;
+	}
+	
+	// Now it can't fail, take the memory of the buffers being sent
+	for (size_t i = 0; i < writer.move_count; i++) {
+		KNMessageBuffer buffer;
+		buffer.data = KNBufferDetach(writer.moves[i].buffer, &buffer.size, &buffer.alloced);
+		memcpy(writer.data + writer.moves[i].offset, &buffer, sizeof buffer);
+	}
+	
+	free(writer.moves);
+	
+	KNMessage *message = (KNMessage *) writer.data;
+	message->size = writer.size - sizeof header;
+	
+	pthread_mutex_lock(&worker->lock);
+	
+	if (queue->last) {
+		queue->last->next = message;
+	}
+	else {
+		queue->first = message;
+	}
+	
+	queue->last = message;
+	
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	
+	return true;
+}
+
+static void KNMessageFree(KNMessage *message) {
+	/**
+	 * Free a message and the memory of any buffers in it that haven't been
+	 * handed over.
+	 */
+	
+	uint8_t *at = message->data;
+	uint8_t *end = message->data + message->size;
+	
+	while (at < end) {
+		switch (*at++) {
+			case KN_MESSAGE_NUMBER: {
+				at += sizeof (lua_Number);
+				break;
+			}
+			case KN_MESSAGE_STRING: {
+				uint32_t length;
+				memcpy(&length, at, sizeof length);
+				at += sizeof length + length;
+				break;
+			}
+			case KN_MESSAGE_BUFFER: {
+				KNMessageBuffer buffer;
+				memcpy(&buffer, at, sizeof buffer);
+				free(buffer.data);
+				at += sizeof buffer;
+				break;
+			}
+		}
+	}
+	
+	free(message);
+}
+
+static int KNMessageReceive(KNWorker *worker, KNMessageQueue *queue, lua_State *script, const KNTableFuncs *funcs, bool wait) {
+	/**
+	 * Take the next message from a queue and push its value, or push nil if
+	 * there isn't one. If `wait` is set, wait for a message unless the worker
+	 * is being stopped.
+	 */
+	
+	pthread_mutex_lock(&worker->lock);
+	
+	while (wait && !queue->first && !worker->stopping) {
+		pthread_cond_wait(&worker->cond, &worker->lock);
+	}
+	
+	KNMessage *message = queue->first;
+	
+	if (message) {
+		queue->first = message->next;
+		
+		if (!queue->first) {
+			queue->last = NULL;
+		}
+	}
+	
+	pthread_mutex_unlock(&worker->lock);
+	
+	if (!message) {
+		knReturnNil(script);
+	}
+	
+	int top = lua_gettop(script);
+	uint8_t *at = message->data;
+	
+	if (!KNDeserialize(script, &at, message->data + message->size, funcs)) {
+		lua_settop(script, top);
+		lua_pushnil(script);
+	}
+	
+	KNMessageFree(message);
+	return 1;
+}
+
+static void KNMessageQueueFree(KNMessageQueue *queue) {
+	while (queue->first) {
+		KNMessage *next = queue->first->next;
+		KNMessageFree(queue->first);
+		queue->first = next;
+	}
+}
+
+static void KNWorkerRelease(KNWorker *worker) {
+	pthread_mutex_lock(&worker->lock);
+	int refs = --worker->refs;
+	pthread_mutex_unlock(&worker->lock);
+	
+	if (refs) {
+		return;
+	}
+	
+	KNMessageQueueFree(&worker->inbox);
+	KNMessageQueueFree(&worker->outbox);
+	pthread_mutex_destroy(&worker->lock);
+	pthread_cond_destroy(&worker->cond);
+	free(worker->source);
+	free(worker);
+}
+
+static int knWorkerPost(lua_State *script) {
+	/**
+	 * (bool) success = knPost(value)
+	 * 
+	 * In a worker, send a value to the script that started it. Values are the
+	 * same as for the other knPost().
+	 */
+	
+	KNWorker *worker = lua_touserdata(script, lua_upvalueindex(1));
+	
+	lua_pushboolean(script, !lua_isnoneornil(script, 1) && KNMessageSend(worker, &worker->outbox, script, 1));
+	return 1;
+}
+
+static int knWorkerPoll(lua_State *script) {
+	/**
+	 * value = knPoll([wait])
+	 * 
+	 * In a worker, get the next value sent by the script that started it, or
+	 * nil if there isn't one. If `wait` is true, wait until there is one, or
+	 * return nil if the worker is being stopped.
+	 */
+	
+	KNWorker *worker = lua_touserdata(script, lua_upvalueindex(1));
+	
+	return KNMessageReceive(worker, &worker->inbox, script, &gWorkerTableFuncs, lua_toboolean(script, 1));
+}
+
+static void *KNWorkerMain(void *userdata) {
+	KNWorker *worker = userdata;
+	lua_State *script = worker->script;
+	
+	if (luaL_loadbuffer(script, worker->source, worker->source_length, "worker") || lua_pcall(script, 0, 0, 0)) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Error in worker %d: %s", worker->id, lua_tostring(script, -1));
+	}
+	
+	lua_close(script);
+	KNWorkerRelease(worker);
+	return NULL;
+}
+
+static lua_State *KNWorkerCreateState(KNWorker *worker) {
+	/**
+	 * Make the Lua state for a worker, with the parts of the standard library
+	 * that don't touch anything outside of it.
+	 */
+	
+	lua_State *script = luaL_newstate();
+	
+	if (!script) {
+		return NULL;
+	}
+	
+	static const luaL_Reg libs[] = {
+		{ "", luaopen_base },
+		{ LUA_TABLIBNAME, luaopen_table },
+		{ LUA_STRLIBNAME, luaopen_string },
+		{ LUA_MATHLIBNAME, luaopen_math },
+	};
+	
+	for (size_t i = 0; i < sizeof libs / sizeof *libs; i++) {
+		lua_pushcfunction(script, libs[i].func);
+		lua_pushstring(script, libs[i].name);
+		lua_call(script, 1, 0);
+	}
+	
+	lua_pushlightuserdata(script, worker);
+	lua_pushcclosure(script, knWorkerPost, 1);
+	lua_setglobal(script, "knPost");
+	
+	lua_pushlightuserdata(script, worker);
+	lua_pushcclosure(script, knWorkerPoll, 1);
+	lua_setglobal(script, "knPoll");
+	
+	KNOpenBuffers(script, lua_createtable, lua_settable);
+	lua_register(script, "knBuffer", knBuffer);
+	
+	return script;
+}
+
+static KNWorker *KNWorkerFind(int id) {
+	for (KNWorker *worker = gWorkers; worker; worker = worker->next) {
+		if (worker->id == id) {
+			return worker;
+		}
+	}
+	
+	return NULL;
+}
+
+int knSpawnWorker(lua_State *script) {
+	/**
+	 * (int|nil) worker = knSpawnWorker(source)
+	 * 
+	 * Run some Lua code in a new Lua state on a background thread. It only has
+	 * the base, table, string and math libraries, plus knPost and knPoll to
+	 * send values to and from this script and knBuffer.
+	 */
+	
+	size_t source_length;
+	const char *source = lua_tolstring(script, 1, &source_length);
+	
+	if (!source || gWorkerCount >= KN_WORKER_MAX) {
+		knReturnNil(script);
+	}
+	
+	KNWorker *worker = calloc(1, sizeof *worker);
+	
+	if (!worker) {
+		knReturnNil(script);
+	}
+	
+	worker->refs = 2;
+	worker->source = malloc(source_length);
+	worker->source_length = source_length;
+	worker->script = KNWorkerCreateState(worker);
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	
+	if (!worker->source || !worker->script) {
+		worker->refs = 1;
+		
+		if (worker->script) {
+			lua_close(worker->script);
+		}
+		
+		KNWorkerRelease(worker);
+		knReturnNil(script);
+	}
+	
+	memcpy(worker->source, source, source_length);
+	worker->id = gWorkerNextId++;
+	
+	if (pthread_create(&worker->thread, NULL, KNWorkerMain, worker)) {
+		__android_log_print(ANDROID_LOG_ERROR, TAG, "Failed to start worker thread");
+		lua_close(worker->script);
+		worker->refs = 1;
+		KNWorkerRelease(worker);
+		knReturnNil(script);
+	}
+	
+	pthread_detach(worker->thread);
+	
+	worker->next = gWorkers;
+	gWorkers = worker;
+	gWorkerCount++;
+	
+	lua_pushinteger(script, worker->id);
+	return 1;
+}
+
+int knPost(lua_State *script) {
+	/**
+	 * (bool) success = knPost(worker, value)
+	 * 
+	 * Send a value to a worker, which it can get with knPoll(). Values can be
+	 * nil, booleans, numbers, strings, buffers or tables of those. Buffers are
+	 * moved rather than copied, so they're left empty.
+	 */
+	
+	KNWorker *worker = KNWorkerFind(lua_tointeger(script, 1));
+	
+	lua_pushboolean(script, worker && !lua_isnoneornil(script, 2) && KNMessageSend(worker, &worker->inbox, script, 2));
+	return 1;
+}
+
+int knPoll(lua_State *script) {
+	/**
+	 * value = knPoll(worker)
+	 * 
+	 * Get the next value a worker has sent with knPost(), or nil if there
+	 * isn't one yet. This never waits.
+	 */
+	
+	KNWorker *worker = KNWorkerFind(lua_tointeger(script, 1));
+	
+	if (!worker) {
+		knReturnNil(script);
+	}
+	
+	return KNMessageReceive(worker, &worker->outbox, script, &gGameTableFuncs, false);
+}
+
+int knStopWorker(lua_State *script) {
+	/**
+	 * knStopWorker(worker)
+	 * 
+	 * Ask a worker to stop, which makes knPoll(true) return nil in it, and
+	 * forget about it. Values it hasn't sent yet are dropped.
+	 */
+	
+	int id = lua_tointeger(script, 1);
+	KNWorker **link = &gWorkers;
+	
+	while (*link && (*link)->id != id) {
+		link = &(*link)->next;
+	}
+	
+	if (!*link) {
+		return 0;
+	}
+	
+	KNWorker *worker = *link;
+	*link = worker->next;
+	gWorkerCount--;
+	
+	pthread_mutex_lock(&worker->lock);
+	worker->stopping = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	
+	KNWorkerRelease(worker);
+	return 0;
+}
+
+int knEnableWorker(lua_State *script) {
+	knRegisterFunc(script, knSpawnWorker);
+	knRegisterFunc(script, knPost);
+	knRegisterFunc(script, knPoll);
+	knRegisterFunc(script, knStopWorker);
+	
+	// Buffers can come back from workers before the buffer module is loaded
+	KNOpenBuffers(script, KNLuaCreateTable, KNLuaSetTable);
+	
+	return 0;
+}
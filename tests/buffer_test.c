@@ -0,0 +1,97 @@
+/**
+ * Runs knBuffer and its methods in our copy of Lua.
+ */
+
+#include "lua_test.h"
+
+#include "util.h"
+
+int knEnableBuffer(lua_State *script);
+
+int main(void) {
+	lua_State *script = TestLuaState();
+	knEnableBuffer(script);
+	
+	TEST_LUA(script,
+		"local b = knBuffer()\n"
+		"assert(#b == 0 and tostring(b) == '')\n"
+		"assert(b:append('ab', 12, knBuffer():append('cd')) == b)\n"
+		"assert(tostring(b) == 'ab12cd' and #b == 6)\n"
+		"assert(b:clear() == b and #b == 0)\n"
+		"assert(b:append('x'):tostring() == 'x')\n"
+	);
+	
+	TEST_LUA(script,
+		"local b = knBuffer()\n"
+		"b:appendf('%d|%5.2f|%-4s|%x|%c|%%|%s', -12, 3.14159, 'ab', 255, 65, 'end')\n"
+		"assert(tostring(b) == string.format('%d|%5.2f|%-4s|%x|%c|%%|%s', -12, 3.14159, 'ab', 255, 65, 'end'))\n"
+		"b:clear():appendf('%.2s|%5s', knBuffer():append('wxyz'), knBuffer():append('q'))\n"
+		"assert(tostring(b) == 'wx|    q')\n"
+		"assert(b:appendf('%q', 'x') == nil)\n"
+	);
+	
+	TEST_LUA(script,
+		"local b = knBuffer():pack('bBhHiIlfd', -1, 255, -2, 65535, -3, 4294967295, 5, 0.5, 0.25)\n"
+		"assert(#b == 1 + 1 + 2 + 2 + 4 + 4 + 8 + 4 + 8)\n"
+		"local s = tostring(b)\n"
+		"assert(s:byte(1) == 255 and s:byte(2) == 255)\n"
+		"assert(b:pack('z', 1) == nil)\n"
+	);
+	
+	// Every conversion, with flags, width and precision, against string.format()
+	TEST_LUA(script,
+		"local function same(format, ...)\n"
+		"	local b = knBuffer():append('<'):appendf(format, ...)\n"
+		"	assert(b, format)\n"
+		"	assert(tostring(b) == '<' .. string.format(format, ...), format)\n"
+		"end\n"
+		"same('%i %u %o %X %#x %+d % d %05d', 7, 4000000000, 8, 48879, 255, 3, 4, -42)\n"
+		"same('%e|%E|%.3g|%G|%10.3f|%-9.1f|', 12345.678, 0.00012, 2 / 3, 1e20, -3.5, 2.25)\n"
+		"same('%c%c%c', 107, 110, 33)\n"
+		"same('%-8s|%8s|%.3s|%s|%s', 'left', 'right', 'truncated', 12, '')\n"
+		"same('no conversions')\n"
+	);
+	
+	TEST_LUA(script,
+		"local b = knBuffer()\n"
+		"assert(b:appendf('%') == nil)\n"
+		"assert(b:clear():appendf('%z', 1) == nil)\n"
+		"assert(b:clear():appendf('%0000000000000000000000000000000d', 1) == nil)\n"
+		"assert(b:clear():appendf('%s', {}) == nil)\n"
+		"assert(knBuffer():appendf('%d %s', 5, knBuffer()):tostring() == '5 ')\n"
+		"assert(knBuffer():appendf('%300d|%-200s|', 1, 'wide'):tostring() == string.rep(' ', 299) .. '1|wide' .. string.rep(' ', 196) .. '|')\n"
+		"assert(knBuffer():appendf('%s|%c', 'a\\0b', 0):tostring() == 'a\\0b|\\0')\n"
+	);
+	
+	// Device byte order, which is little endian everywhere the game runs
+	TEST_LUA(script,
+		"local function bytes(b)\n"
+		"	return (tostring(b):gsub('.', function(c) return c:byte() .. ' ' end):sub(1, -2))\n"
+		"end\n"
+		"assert(bytes(knBuffer():pack('bBhH', -2, 263, 0x0102, -1)) == '254 7 2 1 255 255')\n"
+		"assert(bytes(knBuffer():pack('iI', -2, 0x01020304)) == '254 255 255 255 4 3 2 1')\n"
+		"assert(bytes(knBuffer():pack('lL', -2, 0x0102030405)) == '254 255 255 255 255 255 255 255 5 4 3 2 1 0 0 0')\n"
+		"assert(bytes(knBuffer():pack('fd', 1, -2)) == '0 0 128 63 0 0 0 0 0 0 0 192')\n"
+		"local b = knBuffer():append('x')\n"
+		"assert(b:pack('') == b and tostring(b) == 'x')\n"
+		"for i = 1, 100 do b:pack('i', i) end\n"
+		"assert(#b == 401 and tostring(b):sub(398) == string.char(100, 0, 0, 0))\n"
+	);
+	
+	// Appending a buffer to itself, enough times that it has to grow
+	TEST_LUA(script,
+		"local b = knBuffer():append('0123456789')\n"
+		"local s = '0123456789'\n"
+		"for i = 1, 10 do b:append(b) s = s .. s end\n"
+		"assert(tostring(b) == s)\n"
+		"local c = knBuffer():append(string.rep('ab', 40))\n"
+		"local t = tostring(c)\n"
+		"for i = 1, 6 do c:appendf('%s', c) t = t .. t end\n"
+		"assert(tostring(c) == t)\n"
+		"for i = 1, 4 do c:appendf('<%-3s>', c) t = t .. '<' .. t .. '>' end\n"
+		"assert(tostring(c) == t)\n"
+	);
+	
+	lua_close(script);
+	return TEST_RESULT();
+}
@@ -0,0 +1,109 @@
+/**
+ * Runs knSnapshot and knDiff in our copy of Lua, over memory the test
+ * changes from Lua through testFlip().
+ */
+
+#include "lua_test.h"
+
+#include "util.h"
+
+int knEnablePeekPoke(lua_State *script);
+
+static uint8_t gMemory[300];
+
+// The rest of peekpoke.c needs these, but the snapshots don't use them
+void *KNGetSymbolAddr(const char *name) {
+	return NULL;
+}
+
+const char *KNGetSymbolForAddr(void *addr, size_t *offset) {
+	return NULL;
+}
+
+const char *KNToBytes(struct lua_State *script, int index, size_t *size) {
+	return NULL;
+}
+
+int invert_branch(void *addr) {
+	return 0;
+}
+
+static int testFlip(lua_State *script) {
+	/**
+	 * testFlip(offset, length)
+	 * 
+	 * Change `length` bytes of the memory starting at `offset`.
+	 */
+	
+	lua_Integer offset = luaL_checkinteger(script, 1);
+	lua_Integer length = luaL_optinteger(script, 2, 1);
+	
+	luaL_argcheck(script, offset >= 0 && length >= 0 && offset + length <= (lua_Integer) sizeof gMemory, 1, "out of range");
+	
+	for (lua_Integer i = offset; i < offset + length; i++) {
+		gMemory[i] ^= 0x5a;
+	}
+	
+	return 0;
+}
+
+int main(void) {
+	lua_State *script = TestLuaState();
+	knEnablePeekPoke(script);
+	lua_register(script, "testFlip", testFlip);
+	lua_pushinteger(script, (lua_Integer) (uintptr_t) gMemory);
+	lua_setglobal(script, "memory");
+	
+	// Diffs of the whole memory as "offset+length ..." after some flips
+	TEST_LUA(script,
+		"local a = knSnapshot(memory, 300)\n"
+		"local b = knSnapshot(memory, 300)\n"
+		"function diff(flips)\n"
+		"	assert(knSnapshot(a) == a)\n"
+		"	for _, flip in ipairs(flips) do testFlip(flip[1], flip[2]) end\n"
+		"	assert(knSnapshot(b) == b)\n"
+		"	local out = ''\n"
+		"	for i, range in ipairs(knDiff(a, b)) do\n"
+		"		out = out .. (i > 1 and ' ' or '') .. range[1] .. '+' .. range[2]\n"
+		"	end\n"
+		"	return out\n"
+		"end\n"
+	);
+	
+	TEST_LUA(script,
+		"assert(diff({}) == '')\n"
+		"assert(diff({{5}}) == '5+1')\n"
+		"assert(diff({{1}, {3}, {4}}) == '1+1 3+2')\n"
+		"assert(diff({{0, 300}}) == '0+300')\n"
+	);
+	
+	// Runs meeting block edges, inside and across the 64 byte blocks
+	TEST_LUA(script,
+		"assert(diff({{60, 4}}) == '60+4')\n"
+		"assert(diff({{64, 4}}) == '64+4')\n"
+		"assert(diff({{60, 10}}) == '60+10')\n"
+		"assert(diff({{63, 67}}) == '63+67')\n"
+		"assert(diff({{0, 64}, {128, 64}}) == '0+64 128+64')\n"
+		"assert(diff({{0, 64}, {64, 64}}) == '0+128')\n"
+		"assert(diff({{10, 5}, {70, 1}, {127, 2}}) == '10+5 70+1 127+2')\n"
+	);
+	
+	// The last 44 bytes don't make a whole block
+	TEST_LUA(script,
+		"assert(diff({{255}}) == '255+1')\n"
+		"assert(diff({{299}}) == '299+1')\n"
+		"assert(diff({{250, 50}}) == '250+50')\n"
+		"assert(diff({{190, 20}}) == '190+20')\n"
+		"assert(diff({{192, 64}, {256, 3}}) == '192+67')\n"
+	);
+	
+	TEST_LUA(script,
+		"local short = knSnapshot(memory, 299)\n"
+		"assert(knDiff(knSnapshot(memory, 300), short) == nil)\n"
+		"assert(knDiff(short, {}) == nil)\n"
+		"assert(knSnapshot(memory, 0) == nil)\n"
+	);
+	
+	lua_close(script);
+	return TEST_RESULT();
+}
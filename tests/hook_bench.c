@@ -0,0 +1,92 @@
+/**
+ * Times calls to a hooked or probed function against calls to the same
+ * function without either, and calls past a probe meant for another thread.
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+
+#define LEAFHOOK_IMPLEMENTATION
+#include "leafhook.h"
+
+volatile int gBenchLast;
+
+// Needs to be long enough to have a hook patched over it
+__attribute__((noinline)) int BenchTarget(int x) {
+	gBenchLast = x;
+	return x + 1;
+}
+
+__attribute__((noinline)) int BenchProbeTarget(int x) {
+	gBenchLast = x;
+	return x + 1;
+}
+
+static int (*gBenchOrig)(int);
+static long gBenchProbeHits;
+
+static int BenchHook(int x) {
+	return gBenchOrig(x);
+}
+
+static void BenchProbe(LHProbeContext *ctx, void *userdata) {
+	gBenchProbeHits++;
+}
+
+static double BenchCalls(int (*func)(int), int count) {
+	/**
+	 * Average time of a call through `func` in nanoseconds.
+	 */
+	
+	volatile int sink = 0;
+	uint64_t start = TestTimeNs();
+	
+	for (int i = 0; i < count; i++) {
+		sink += func(i);
+	}
+	
+	return (double) (TestTimeNs() - start) / count;
+}
+
+int main(int argc, const char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 10000000;
+	int (*volatile target)(int) = BenchTarget;
+	
+	double plain = BenchCalls(target, count);
+	
+	LHHooker *hooker = LHHookerCreate();
+	
+	if (!hooker || !LHHookerHookFunction(hooker, BenchTarget, BenchHook, (void **) &gBenchOrig)) {
+		fprintf(stderr, "Could not hook the benchmark function\n");
+		return 1;
+	}
+	
+	double hooked = BenchCalls(target, count);
+	
+	int (*volatile probe_target)(int) = BenchProbeTarget;
+	
+	if (!LHHookerProbe(hooker, BenchProbeTarget, BenchProbe, NULL)) {
+		fprintf(stderr, "Could not probe the benchmark function\n");
+		return 1;
+	}
+	
+	double probed = BenchCalls(probe_target, count);
+	
+	// A probe for another thread, which only checks the thread and goes on
+	uintptr_t other_thread = 0;
+	
+	if (!LHHookerUnprobe(hooker, BenchProbeTarget) || !LHHookerProbeThread(hooker, BenchProbeTarget, BenchProbe, NULL, &other_thread)) {
+		fprintf(stderr, "Could not probe the benchmark function for another thread\n");
+		return 1;
+	}
+	
+	double skipped = BenchCalls(probe_target, count);
+	
+	printf("plain call  %6.2f ns\n", plain);
+	printf("hooked call %6.2f ns (+%.2f ns)\n", hooked, hooked - plain);
+	printf("probed call %6.2f ns (+%.2f ns, %ld hits)\n", probed, probed - plain, gBenchProbeHits);
+	printf("other thread %5.2f ns (+%.2f ns)\n", skipped, skipped - plain);
+	
+	return 0;
+}
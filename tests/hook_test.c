@@ -0,0 +1,379 @@
+/**
+ * Hooks functions with LeafHook and checks they still work, including while
+ * other threads are calling them. The functions are written in assembly so
+ * their first few instructions are known; only x86_64 has them for now.
+ */
+
+#include "test.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define LEAFHOOK_IMPLEMENTATION
+#include "leafhook.h"
+
+#ifdef __x86_64__
+
+int RipLoad(int x);
+int ShortBranch(int x);
+int CallHelper(int x);
+int FramePointer(int x);
+int LoopBranch(int a, int b, int c, int d);
+int CallNextPop(int x);
+int LongNop(int x);
+int TooShort(int x);
+int ProbeCompare(int a, int b);
+extern uint8_t ProbeCompareAt[], ProbeCompareSkip[];
+
+int gValue = 100;
+
+__asm__(
+	".intel_syntax noprefix\n"
+	".text\n"
+	"RipLoad: mov eax, dword ptr [rip + gValue]\n add eax, edi\n ret\n"
+	"ShortBranch: test edi, edi\n je 1f\n mov eax, 1\n ret\n1: mov eax, 2\n ret\n"
+	"Helper: mov eax, 41\n ret\n"
+	"CallHelper: call Helper\n add eax, edi\n ret\n"
+	"FramePointer: push rbp\n mov rbp, rsp\n lea eax, [rdi + rdi]\n pop rbp\n ret\n"
+	"LoopBranch: jrcxz 1f\n mov eax, 5\n ret\n1: mov eax, 6\n ret\n"
+	// Returns x if the call pushed its real return address, otherwise -1
+	"CallNextPop: call 1f\n1: pop rax\n lea rcx, [rip + 1b]\n cmp rax, rcx\n mov eax, edi\n mov edx, -1\n cmovne eax, edx\n ret\n"
+	// One 5 byte instruction, so no thread can be part way through the patch.
+	// The nops are spelled out since the assembler picks the 4 byte form.
+	"LongNop: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n lea eax, [rdi + 1]\n ret\n"
+	// Returns before there are enough bytes for a jump, so can't be relocated
+	"TooShort: ret\n int3\n int3\n int3\n int3\n"
+	// a + b if a >= b, otherwise -(a + b), with the probe between the compare
+	// and the branch
+	"ProbeCompare: lea eax, [rdi + rsi]\n cmp edi, esi\n"
+	"ProbeCompareAt: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n jl 1f\n ret\n1: neg eax\n ret\n"
+	"ProbeCompareSkip: mov eax, 77\n ret\n"
+	".att_syntax\n"
+);
+
+static int (*RipLoadOrig)(int), (*ShortBranchOrig)(int), (*CallHelperOrig)(int), (*FramePointerOrig)(int), (*CallNextPopOrig)(int), (*LongNopOrig)(int);
+static int (*LoopBranchOrig)(int, int, int, int);
+
+static int RipLoadHook(int x) { return RipLoadOrig(x) + 1000; }
+static int ShortBranchHook(int x) { return ShortBranchOrig(x) + 1000; }
+static int CallHelperHook(int x) { return CallHelperOrig(x) + 1000; }
+static int FramePointerHook(int x) { return FramePointerOrig(x) + 1000; }
+static int LoopBranchHook(int a, int b, int c, int d) { return LoopBranchOrig(a, b, c, d) + 1000; }
+static int CallNextPopHook(int x) { return CallNextPopOrig(x) + 1000; }
+static int LongNopHook(int x) { return LongNopOrig(x) + 1000; }
+
+static int (*gChainOrig[2])(int);
+static int ChainHook0(int x) { return gChainOrig[0](x) + 10; }
+static int ChainHook1(int x) { return gChainOrig[1](x) * 2; }
+
+static void TestRelocation(LHHooker *hooker) {
+	/**
+	 * Each kind of instruction that has to be fixed up when it's moved into
+	 * a trampoline.
+	 */
+	
+	LHHookerBegin(hooker);
+	TEST_CHECK(LHHookerHookFunction(hooker, RipLoad, RipLoadHook, (void **) &RipLoadOrig));
+	TEST_CHECK(LHHookerHookFunction(hooker, ShortBranch, ShortBranchHook, (void **) &ShortBranchOrig));
+	TEST_CHECK(LHHookerHookFunction(hooker, CallHelper, CallHelperHook, (void **) &CallHelperOrig));
+	TEST_CHECK(LHHookerHookFunction(hooker, FramePointer, FramePointerHook, (void **) &FramePointerOrig));
+	TEST_CHECK(LHHookerHookFunction(hooker, LoopBranch, LoopBranchHook, (void **) &LoopBranchOrig));
+	TEST_CHECK(LHHookerHookFunction(hooker, CallNextPop, CallNextPopHook, (void **) &CallNextPopOrig));
+	
+	// Nothing changes until the commit
+	TEST_CHECK(RipLoad(5) == 105);
+	TEST_CHECK(LHHookerCommit(hooker));
+	
+	TEST_CHECK(RipLoad(5) == 1105);
+	TEST_CHECK(ShortBranch(0) == 1002);
+	TEST_CHECK(ShortBranch(1) == 1001);
+	TEST_CHECK(CallHelper(1) == 1042);
+	TEST_CHECK(FramePointer(3) == 1006);
+	TEST_CHECK(LoopBranch(0, 0, 0, 0) == 1006);
+	TEST_CHECK(LoopBranch(0, 0, 0, 1) == 1005);
+	TEST_CHECK(CallNextPop(7) == 1007);
+}
+
+static void TestChain(LHHooker *hooker) {
+	/**
+	 * Two hooks on one function, removed in both orders.
+	 */
+	
+	TEST_CHECK(LHHookerHookFunction(hooker, LongNop, ChainHook0, (void **) &gChainOrig[0]));
+	TEST_CHECK(LHHookerHookFunction(hooker, LongNop, ChainHook1, (void **) &gChainOrig[1]));
+	TEST_CHECK(LongNop(1) == (2 + 10) * 2);
+	
+	TEST_CHECK(LHHookerUnhook(hooker, LongNop, ChainHook0));
+	TEST_CHECK(LongNop(1) == 2 * 2);
+	TEST_CHECK(!LHHookerUnhook(hooker, LongNop, ChainHook0));
+	
+	TEST_CHECK(LHHookerUnhook(hooker, LongNop, ChainHook1));
+	TEST_CHECK(LongNop(1) == 2);
+	TEST_CHECK(((uint8_t *) LongNop)[0] == 0x0f);
+}
+
+static size_t TestHookerUsed(LHHooker *hooker) {
+	size_t used = 0;
+	
+	for (LHBlock *block = hooker->blocks; block; block = block->next) {
+		used += block->used;
+	}
+	
+	return used;
+}
+
+static void TestFailedHook(LHHooker *hooker) {
+	/**
+	 * A hook that fails must give back the relay it made to reach the hook.
+	 */
+	
+	uint8_t *far = mmap((void *) 0x7e0000000000, getpagesize(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (far == MAP_FAILED || LHX86Reachable((uint8_t *) TooShort + 5, far)) {
+		fprintf(stderr, "Could not map a hook out of range, skipping the failed hook test\n");
+		return;
+	}
+	
+	far[0] = 0xc3;
+	
+	void *orig;
+	size_t used = TestHookerUsed(hooker);
+	TEST_CHECK(!LHHookerHookFunction(hooker, TooShort, far, &orig));
+	TEST_CHECK(TestHookerUsed(hooker) == used);
+	
+	munmap(far, getpagesize());
+	
+	// A copy of LongNop that can't be made writable, so writing the patch
+	// fails and the hook has to be taken back out
+	int fd = memfd_create("hook_test", 0);
+	int read_fd = -1;
+	uint8_t *code = MAP_FAILED;
+	
+	if (fd >= 0 && write(fd, LongNop, 16) == 16) {
+		char path[64];
+		snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+		read_fd = open(path, O_RDONLY);
+		code = read_fd < 0 ? MAP_FAILED : mmap(NULL, getpagesize(), PROT_READ | PROT_EXEC, MAP_SHARED, read_fd, 0);
+	}
+	
+	if (code == MAP_FAILED) {
+		fprintf(stderr, "Could not map read-only code, skipping the failed patch test\n");
+	}
+	else {
+		orig = (void *) 1;
+		TEST_CHECK(!LHHookerHookFunction(hooker, code, LongNopHook, &orig));
+		TEST_CHECK(orig == (void *) 1);
+		TEST_CHECK(!LHHookerIsPatched(hooker, code, 1));
+		TEST_CHECK(!LHHookerUnhook(hooker, code, LongNopHook));
+		TEST_CHECK(((int (*)(int)) code)(1) == 2);
+		munmap(code, getpagesize());
+	}
+	
+	if (read_fd >= 0) {
+		close(read_fd);
+	}
+	
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static bool TestRefusePatch(void *addr, size_t size, void *userdata) {
+	// Refuses anything over the byte at `userdata`
+	return !((uint8_t *) addr <= (uint8_t *) userdata && (uint8_t *) userdata < (uint8_t *) addr + size);
+}
+
+static void TestPatchCheck(LHHooker *hooker) {
+	/**
+	 * The patch check can refuse hooks and probes over bytes someone else has
+	 * patched, using the real size of what would be written.
+	 */
+	
+	void *orig = (void *) 1;
+	LHHookerSetPatchCheck(hooker, TestRefusePatch, (uint8_t *) LongNop + 4);
+	TEST_CHECK(!LHHookerHookFunction(hooker, LongNop, LongNopHook, &orig));
+	TEST_CHECK(orig == (void *) 1);
+	TEST_CHECK(!LHHookerIsPatched(hooker, LongNop, 5));
+	TEST_CHECK(!LHHookerProbe(hooker, LongNop, NULL, NULL));
+	TEST_CHECK(LongNop(1) == 2);
+	
+	// Just past the jump is fine
+	LHHookerSetPatchCheck(hooker, TestRefusePatch, (uint8_t *) LongNop + 5);
+	TEST_CHECK(LHHookerHookFunction(hooker, LongNop, LongNopHook, (void **) &LongNopOrig));
+	TEST_CHECK(LongNop(1) == 1002);
+	TEST_CHECK(LHHookerUnhook(hooker, LongNop, LongNopHook));
+	TEST_CHECK(LongNop(1) == 2);
+	
+	LHHookerSetPatchCheck(hooker, NULL, NULL);
+}
+
+enum {
+	PROBE_WATCH,
+	PROBE_ADD,
+	PROBE_FLIP_OF,
+	PROBE_SKIP,
+};
+
+static int gProbeMode;
+static uintptr_t gProbeIp, gProbeAx;
+static uint8_t gProbeOriginal[8];
+
+static void TestProbeCallback(LHProbeContext *ctx, void *userdata) {
+	gProbeIp = ctx->ip;
+	gProbeAx = ctx->gpr[0];
+	
+	switch (*(int *) userdata) {
+		case PROBE_ADD: ctx->gpr[0] += 100; break;
+		case PROBE_FLIP_OF: ctx->flags ^= 0x800; break;
+		case PROBE_SKIP: ctx->ip = (uintptr_t) ProbeCompareSkip; break;
+	}
+}
+
+static void TestProbe(LHHooker *hooker) {
+	/**
+	 * A probe sees the registers and flags at the probed instruction, and
+	 * changes to them are used when the function continues.
+	 */
+	
+	memcpy(gProbeOriginal, ProbeCompareAt, sizeof gProbeOriginal);
+	TEST_CHECK(LHHookerProbe(hooker, ProbeCompareAt, TestProbeCallback, &gProbeMode));
+	
+	gProbeMode = PROBE_WATCH;
+	TEST_CHECK(ProbeCompare(5, 3) == 8);
+	TEST_CHECK(gProbeIp == (uintptr_t) ProbeCompareAt && gProbeAx == 8);
+	TEST_CHECK(ProbeCompare(2, 3) == -5);
+	
+	gProbeMode = PROBE_ADD;
+	TEST_CHECK(ProbeCompare(5, 3) == 108);
+	TEST_CHECK(ProbeCompare(2, 3) == -105);
+	
+	gProbeMode = PROBE_FLIP_OF;
+	TEST_CHECK(ProbeCompare(5, 3) == -8);
+	TEST_CHECK(ProbeCompare(2, 3) == 5);
+	
+	gProbeMode = PROBE_SKIP;
+	TEST_CHECK(ProbeCompare(5, 3) == 77);
+	
+	gProbeMode = PROBE_WATCH;
+	TEST_CHECK(ProbeCompare(5, 3) == 8);
+}
+
+static uintptr_t gProbeThread;
+
+static void *TestProbeOtherThread(void *result) {
+	*(int *) result = ProbeCompare(5, 3);
+	return NULL;
+}
+
+static void TestProbeThread(LHHooker *hooker) {
+	/**
+	 * A probe limited to one thread doesn't call back on any other, which
+	 * still see the right registers and flags, and removing a probe puts the
+	 * original code back.
+	 */
+	
+	TEST_CHECK(LHHookerUnprobe(hooker, ProbeCompareAt));
+	TEST_CHECK(!LHHookerUnprobe(hooker, ProbeCompareAt));
+	TEST_CHECK(!memcmp(ProbeCompareAt, gProbeOriginal, sizeof gProbeOriginal));
+	
+	gProbeMode = PROBE_ADD;
+	gProbeThread = 0;
+	TEST_CHECK(ProbeCompare(5, 3) == 8);
+	
+	TEST_CHECK(LHHookerProbeThread(hooker, ProbeCompareAt, TestProbeCallback, &gProbeMode, &gProbeThread));
+	TEST_CHECK(!LHHookerProbe(hooker, ProbeCompareAt, TestProbeCallback, &gProbeMode));
+	TEST_CHECK(LHHookerIsPatched(hooker, ProbeCompareAt + 4, 1) && !LHHookerIsPatched(hooker, ProbeCompareAt + 5, 1));
+	TEST_CHECK(ProbeCompare(5, 3) == 8);
+	TEST_CHECK(ProbeCompare(2, 3) == -5);
+	
+	gProbeThread = LHThreadId();
+	TEST_CHECK(ProbeCompare(5, 3) == 108);
+	TEST_CHECK(ProbeCompare(2, 3) == -105);
+	
+	int other = 0;
+	pthread_t thread;
+	pthread_create(&thread, NULL, TestProbeOtherThread, &other);
+	pthread_join(thread, NULL);
+	TEST_CHECK(other == 8);
+	
+	TEST_CHECK(LHHookerUnprobe(hooker, ProbeCompareAt));
+	TEST_CHECK(!LHHookerIsPatched(hooker, ProbeCompareAt, 5));
+	TEST_CHECK(ProbeCompare(5, 3) == 8);
+}
+
+static int gStop;
+static long gBadResults;
+
+static void *TestCaller(void *arg) {
+	while (!__atomic_load_n(&gStop, __ATOMIC_RELAXED)) {
+		int result = LongNop(1);
+		
+		if (result != 2 && result != 1002) {
+			__atomic_add_fetch(&gBadResults, 1, __ATOMIC_RELAXED);
+		}
+	}
+	
+	return NULL;
+}
+
+static void TestConcurrent(LHHooker *hooker) {
+	/**
+	 * Hook and unhook a function over and over while other threads call it.
+	 */
+	
+	pthread_t threads[4];
+	
+	for (size_t i = 0; i < 4; i++) {
+		pthread_create(&threads[i], NULL, TestCaller, NULL);
+	}
+	
+	for (int i = 0; i < 5000; i++) {
+		if (!LHHookerHookFunction(hooker, LongNop, LongNopHook, (void **) &LongNopOrig) || !LHHookerUnhook(hooker, LongNop, LongNopHook)) {
+			TEST_CHECK(!"hook and unhook");
+			break;
+		}
+	}
+	
+	__atomic_store_n(&gStop, 1, __ATOMIC_RELAXED);
+	
+	for (size_t i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	
+	TEST_CHECK(gBadResults == 0);
+	
+	// The code page has to be left as it was
+	uintptr_t page = (uintptr_t) LongNop & ~((uintptr_t) getpagesize() - 1);
+	int prot;
+	TEST_CHECK(LHGetProtections(&page, &prot, 1) && prot == (PROT_READ | PROT_EXEC));
+}
+
+int main(void) {
+	LHHooker *hooker = LHHookerCreate();
+	
+	TEST_CHECK(hooker != NULL);
+	
+	if (!hooker) {
+		return TEST_RESULT();
+	}
+	
+	TestRelocation(hooker);
+	TestChain(hooker);
+	TestFailedHook(hooker);
+	TestPatchCheck(hooker);
+	TestProbe(hooker);
+	TestProbeThread(hooker);
+	TestConcurrent(hooker);
+	
+	return TEST_RESULT();
+}
+
+#else
+
+int main(void) {
+	fprintf(stderr, "hook_test only has functions for x86_64, skipping\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,15 @@
+/**
+ * Logging goes to stderr on a desktop, the same way as in andrleaf.h.
+ */
+
+#ifndef KN_TEST_ANDROID_LOG
+#define KN_TEST_ANDROID_LOG
+
+#include <stdio.h>
+
+#define ANDROID_LOG_INFO 4
+#define ANDROID_LOG_WARN 5
+#define ANDROID_LOG_ERROR 6
+#define __android_log_print(prio, tag, ...) fprintf(stderr, __VA_ARGS__)
+
+#endif
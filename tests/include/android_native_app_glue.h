@@ -0,0 +1,14 @@
+/**
+ * Just enough of the NDK for the shim's sources to build on a desktop.
+ */
+
+#ifndef KN_TEST_ANDROID_NATIVE_APP_GLUE
+#define KN_TEST_ANDROID_NATIVE_APP_GLUE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <android/log.h>
+
+struct android_app;
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * Times loading a shared object through Leaf, with the time spent in each
+ * stage of the loader.
+ */
+
+#define LEAF_IMPLEMENTATION
+#include "andrleaf.h"
+#include "test.h"
+
+int main(int argc, const char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "./libsynth.so";
+	int count = argc > 2 ? atoi(argv[2]) : 1000;
+	
+	LeafTimings total = { 0 };
+	uint64_t start = TestTimeNs();
+	
+	for (int i = 0; i < count; i++) {
+		Leaf *leaf = LeafInit();
+		const char *error = LeafLoadFromFile(leaf, path);
+		
+		if (error) {
+			fprintf(stderr, "Could not load %s: %s\n", path, error);
+			return 1;
+		}
+		
+		total.map_ns += leaf->timings.map_ns;
+		total.copy_ns += leaf->timings.copy_ns;
+		total.deps_ns += leaf->timings.deps_ns;
+		total.imports_ns += leaf->timings.imports_ns;
+		total.symbols_ns += leaf->timings.symbols_ns;
+		total.relocs_ns += leaf->timings.relocs_ns;
+		total.init_ns += leaf->timings.init_ns;
+		
+		LeafFree(leaf);
+	}
+	
+	double elapsed = TestTimeNs() - start;
+	
+	printf("%s: %d loads, %.1f us per load (including free)\n", path, count, elapsed / count / 1000.0);
+	printf("  map     %8.1f us\n", total.map_ns / 1000.0 / count);
+	printf("  copy    %8.1f us\n", total.copy_ns / 1000.0 / count);
+	printf("  deps    %8.1f us\n", total.deps_ns / 1000.0 / count);
+	printf("  imports %8.1f us\n", total.imports_ns / 1000.0 / count);
+	printf("  symbols %8.1f us\n", total.symbols_ns / 1000.0 / count);
+	printf("  relocs  %8.1f us\n", total.relocs_ns / 1000.0 / count);
+	printf("  init    %8.1f us\n", total.init_ns / 1000.0 / count);
+	
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Loads libsynth.so through Leaf and calls into it.
+ */
+
+#define LEAF_IMPLEMENTATION
+#include "andrleaf.h"
+#include "test.h"
+
+static size_t (*gTestOrigStrlen)(const char *);
+
+static size_t TestStrlen(const char *string) {
+	return gTestOrigStrlen(string) + 100;
+}
+
+int main(int argc, const char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "./libsynth.so";
+	
+	Leaf *leaf = LeafInit();
+	const char *error = LeafLoadFromFile(leaf, path);
+	
+	if (error) {
+		fprintf(stderr, "Could not load %s: %s\n", path, error);
+		return 1;
+	}
+	
+	int (*synth_add)(int, int) = LeafSymbolAddr(leaf, "synth_add");
+	size_t (*synth_len)(void) = LeafSymbolAddr(leaf, "synth_len");
+	
+	TEST_CHECK(synth_add != NULL);
+	TEST_CHECK(synth_len != NULL);
+	
+	if (synth_add && synth_len) {
+		// The constructor sets the counter to 42
+		TEST_CHECK(synth_add(1, 2) == 45);
+		TEST_CHECK(synth_len() == 12);
+	}
+	
+	// Symbol lookups by address
+	TEST_CHECK(LeafBuildAddrIndex(leaf));
+	
+	size_t offset;
+	const char *name = LeafSymbolForAddr(leaf, (uint8_t *) synth_add + 1, &offset);
+	TEST_CHECK(name && !strcmp(name, "synth_add") && offset == 1);
+	TEST_CHECK(!LeafSymbolForAddr(leaf, (uint8_t *) leaf->blob + leaf->blob_length, &offset));
+	TEST_CHECK(!LeafSymbolForAddr(leaf, (uint8_t *) leaf->blob + leaf->blob_length + 0x1000, &offset));
+	TEST_CHECK(!LeafSymbolForAddr(leaf, (uint8_t *) leaf->blob - 1, &offset));
+	
+	// Interposing an import after loading patches the GOT in place, for both
+	// the PLT call and the pointer to strlen() in libsynth's data
+	void **strlen_ptr = LeafSymbolAddr(leaf, "strlen_ptr");
+	
+	TEST_CHECK(LeafInterposeImport(leaf, "strlen", TestStrlen, (void **) &gTestOrigStrlen));
+	TEST_CHECK(gTestOrigStrlen && gTestOrigStrlen != TestStrlen && gTestOrigStrlen("abc") == 3);
+	TEST_CHECK(strlen_ptr && *strlen_ptr == (void *) TestStrlen);
+	TEST_CHECK(synth_len && synth_len() == 212);
+	
+	void *replaced;
+	TEST_CHECK(LeafInterposeImport(leaf, "strlen", gTestOrigStrlen, &replaced));
+	TEST_CHECK(replaced == TestStrlen);
+	TEST_CHECK(synth_len && synth_len() == 12);
+	
+	// Only imports can be interposed
+	TEST_CHECK(!LeafInterposeImport(leaf, "synth_add", TestStrlen, NULL));
+	TEST_CHECK(!LeafInterposeImport(leaf, "not_a_symbol", TestStrlen, NULL));
+	
+	TEST_CHECK(LeafLoadFromFile(LeafInit(), "./does-not-exist.so") != NULL);
+	
+	LeafFree(leaf);
+	
+	// Hot pages from a profile are only touched if they are in the image
+	static const uint32_t pages[] = { 0, 1, 0x100000, 0xffffffff };
+	leaf = LeafInit();
+	LeafSetPrefaultPages(leaf, pages, sizeof pages / sizeof *pages);
+	TEST_CHECK(LeafLoadFromFile(leaf, path) == NULL);
+	LeafFree(leaf);
+	
+	// Interposing before loading is applied when the imports are resolved
+	gTestOrigStrlen = NULL;
+	leaf = LeafInit();
+	TEST_CHECK(LeafInterposeImport(leaf, "strlen", TestStrlen, (void **) &gTestOrigStrlen));
+	TEST_CHECK(LeafLoadFromFile(leaf, path) == NULL);
+	TEST_CHECK(gTestOrigStrlen && gTestOrigStrlen != TestStrlen && gTestOrigStrlen("abc") == 3);
+	synth_len = LeafSymbolAddr(leaf, "synth_len");
+	TEST_CHECK(synth_len && synth_len() == 212);
+	LeafFree(leaf);
+	
+	return TEST_RESULT();
+}
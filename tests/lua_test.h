@@ -0,0 +1,48 @@
+/**
+ * Helpers for testing the shim's Lua functions on a desktop, using our own
+ * copy of Lua in place of the game's.
+ */
+
+#ifndef KN_LUA_TEST_HEADER
+#define KN_LUA_TEST_HEADER
+
+#include "test.h"
+
+#include "lua/lua.h"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+// The shim gets these from the game, which uses the same Lua
+void KNLuaCreateTable(struct lua_State *script, int narr, int nrec) {
+	lua_createtable(script, narr, nrec);
+}
+
+void KNLuaSetTable(struct lua_State *script, int index) {
+	lua_settable(script, index);
+}
+
+int KNLuaPCall(struct lua_State *script, int nargs, int nresults, int errfunc) {
+	return lua_pcall(script, nargs, nresults, errfunc);
+}
+
+static lua_State *TestLuaState(void) {
+	lua_State *script = luaL_newstate();
+	
+	lua_pushcfunction(script, luaopen_base);
+	lua_call(script, 0, 0);
+	lua_pushcfunction(script, luaopen_string);
+	lua_call(script, 0, 0);
+	
+	return script;
+}
+
+// Run some Lua, which checks things with assert()
+#define TEST_LUA(SCRIPT, CODE) do { \
+	if (luaL_dostring(SCRIPT, CODE)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, lua_tostring(SCRIPT, -1)); \
+		lua_pop(SCRIPT, 1); \
+		gTestFailures++; \
+	} \
+} while (0)
+
+#endif
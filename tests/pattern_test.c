@@ -0,0 +1,136 @@
+/**
+ * Checks the pattern parser and scanner from pattern.c against a plain
+ * byte-at-a-time search.
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// For the static functions
+#include "pattern.c"
+
+Leaf *gLeaf;
+char *gAndroidInternalDataPath;
+
+static uint32_t gTestSeed = 1;
+
+static uint8_t TestRandom(void) {
+	gTestSeed = gTestSeed * 1103515245 + 12345;
+	return gTestSeed >> 16;
+}
+
+static const uint8_t *TestFindSlow(const uint8_t *start, size_t size, const uint8_t *bytes, const uint8_t *mask, size_t length) {
+	for (size_t i = 0; i + length <= size; i++) {
+		if (KNPatternMatches(start + i, bytes, mask, length)) {
+			return start + i;
+		}
+	}
+	
+	return NULL;
+}
+
+static void TestParse(void) {
+	uint8_t bytes[KN_PATTERN_MAX_SIZE], mask[KN_PATTERN_MAX_SIZE];
+	
+	TEST_CHECK(KNParsePattern("48 8b ?? 05 ? fF", bytes, mask) == 6);
+	TEST_CHECK(bytes[0] == 0x48 && bytes[1] == 0x8b && bytes[3] == 0x05 && bytes[5] == 0xff);
+	TEST_CHECK(mask[0] == 0xff && mask[1] == 0xff && !mask[2] && mask[3] == 0xff && !mask[4] && mask[5] == 0xff);
+	TEST_CHECK(bytes[2] == 0 && bytes[4] == 0);
+	TEST_CHECK(KNParsePattern("488b", bytes, mask) == 2);
+	
+	TEST_CHECK(KNParsePattern("", bytes, mask) == 0);
+	TEST_CHECK(KNParsePattern("   ", bytes, mask) == 0);
+	TEST_CHECK(KNParsePattern("4", bytes, mask) == 0);
+	TEST_CHECK(KNParsePattern("48 8", bytes, mask) == 0);
+	TEST_CHECK(KNParsePattern("zz", bytes, mask) == 0);
+	TEST_CHECK(KNParsePattern("4g", bytes, mask) == 0);
+	
+	// The longest pattern fits, and one more byte doesn't
+	char text[KN_PATTERN_MAX_SIZE * 3 + 4] = "";
+	
+	for (size_t i = 0; i < KN_PATTERN_MAX_SIZE; i++) {
+		strcat(text, i % 3 ? "a5 " : "?? ");
+	}
+	
+	TEST_CHECK(KNParsePattern(text, bytes, mask) == KN_PATTERN_MAX_SIZE);
+	strcat(text, "01");
+	TEST_CHECK(KNParsePattern(text, bytes, mask) == 0);
+}
+
+static void TestFindAt(void) {
+	// Every place a match can be, so it's found by both the 16 byte loop and
+	// the tail after it
+	uint8_t memory[80];
+	uint8_t bytes[] = { 0, 0x11, 0x22, 0, 0x33 };
+	uint8_t mask[] = { 0, 0xff, 0xff, 0, 0xff };
+	size_t length = sizeof bytes;
+	
+	for (size_t size = 0; size <= sizeof memory; size++) {
+		for (size_t pos = 0; pos + length <= size; pos++) {
+			memset(memory, 0x11, sizeof memory);
+			memcpy(memory + pos, (uint8_t []) { 0xaa, 0x11, 0x22, 0xbb, 0x33 }, length);
+			
+			const uint8_t *found = KNFindPatternIn(memory, size, bytes, mask, length);
+			
+			if (found != memory + pos) {
+				fprintf(stderr, "size %zu: expected match at %zu, got %td\n", size, pos, found ? found - memory : -1);
+				gTestFailures++;
+			}
+		}
+		
+		// A match cut off by the end of the memory isn't one
+		if (size >= 3) {
+			memset(memory, 0x11, sizeof memory);
+			memcpy(memory + size - 3, (uint8_t []) { 0xaa, 0x11, 0x22 }, 3);
+			TEST_CHECK(!KNFindPatternIn(memory, size, bytes, mask, length));
+		}
+	}
+	
+	// Too long for the memory, and nothing but wildcards
+	TEST_CHECK(!KNFindPatternIn(memory, 4, bytes, mask, length));
+	TEST_CHECK(KNFindPatternIn(memory, 8, bytes, (uint8_t [5]) { 0 }, length) == memory);
+}
+
+static void TestFindRandom(void) {
+	// Few distinct bytes, so there are lots of anchor hits that don't match
+	uint8_t memory[300];
+	uint8_t bytes[8], mask[8];
+	
+	for (int round = 0; round < 20000; round++) {
+		size_t size = TestRandom() % sizeof memory;
+		size_t length = 1 + TestRandom() % sizeof bytes;
+		size_t offset = TestRandom() % 16;
+		
+		if (offset + size > sizeof memory) {
+			size = sizeof memory - offset;
+		}
+		
+		for (size_t i = 0; i < size; i++) {
+			memory[offset + i] = TestRandom() % 3;
+		}
+		
+		for (size_t i = 0; i < length; i++) {
+			mask[i] = TestRandom() % 4 ? 0xff : 0;
+			bytes[i] = (TestRandom() % 3) & mask[i];
+		}
+		
+		const uint8_t *start = memory + offset;
+		const uint8_t *found = KNFindPatternIn(start, size, bytes, mask, length);
+		const uint8_t *expected = TestFindSlow(start, size, bytes, mask, length);
+		
+		if (found != expected) {
+			fprintf(stderr, "round %d: size %zu, length %zu: expected %td, got %td\n", round, size, length, expected ? expected - start : -1, found ? found - start : -1);
+			gTestFailures++;
+		}
+	}
+}
+
+int main(void) {
+	TestParse();
+	TestFindAt();
+	TestFindRandom();
+	
+	return TEST_RESULT();
+}
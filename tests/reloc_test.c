@@ -0,0 +1,448 @@
+/**
+ * Table driven tests for moving ARM code into trampolines. The first few
+ * instructions of each case are rewritten with LHAArch64EmitBlock or
+ * LHAArch32EmitBlock, then the case is run starting from the trampoline on a
+ * tiny emulator that knows just the instructions used here, so they run on any
+ * host. Build with -DLH_AARCH64 or -DLH_AARCH32 to pick which one is tested.
+ */
+
+#if !defined(LH_AARCH64) && !defined(LH_AARCH32)
+#error "Define LH_AARCH64 or LH_AARCH32 to pick which relocator to test"
+#endif
+
+#include "test.h"
+
+#include <sys/mman.h>
+
+#define LEAFHOOK_IMPLEMENTATION
+#include "leafhook.h"
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+#define TEST_MEMORY_SIZE 0x10000
+#define TEST_CODE_OFFSET 0x1000
+#define TEST_TRAMPOLINE_OFFSET 0x8000
+#define TEST_MAX_STEPS 100
+
+enum {
+	RESULT_VALUE, // The result is `result`
+	RESULT_CODE,  // The result is the address of instruction `result`
+	RESULT_PAGE,  // The result is the page of the code plus `result`
+};
+
+typedef struct RelocCase {
+	const char *name;
+	uint32_t code[8];
+	size_t entry; // First instruction of the function
+	size_t block; // How many instructions are moved to the trampoline
+	uint64_t arg;
+	int kind;
+	uint64_t result;
+} RelocCase;
+
+// Where the code is, so a bad jump doesn't take the emulator out of it
+static uint8_t *gTestMemory;
+
+static bool TestFetch(uintptr_t pc, uint32_t *ins) {
+	if (pc < (uintptr_t) gTestMemory || pc + 4 > (uintptr_t) gTestMemory + TEST_MEMORY_SIZE || (pc & 3)) {
+		fprintf(stderr, "Jumped out of the code to <%p>\n", (void *) pc);
+		return false;
+	}
+	
+	memcpy(ins, (void *) pc, sizeof *ins);
+	return true;
+}
+
+static bool TestCondition(uint32_t cond, uint32_t nzcv) {
+	/**
+	 * Check an ARM condition code against the NZCV flags.
+	 */
+	
+	bool n = nzcv & 8, z = nzcv & 4, c = nzcv & 2, v = nzcv & 1;
+	bool result = true;
+	
+	switch (cond >> 1) {
+		case 0: result = z; break;
+		case 1: result = c; break;
+		case 2: result = n; break;
+		case 3: result = v; break;
+		case 4: result = c && !z; break;
+		case 5: result = n == v; break;
+		case 6: result = n == v && !z; break;
+	}
+	
+	return (cond & 1) && cond != 0xf ? !result : result;
+}
+
+static uint32_t TestSubFlags(uint64_t a, uint64_t b, int bits) {
+	/**
+	 * NZCV after a - b, for CMP.
+	 */
+	
+	uint64_t mask = bits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1;
+	uint64_t top = (uint64_t) 1 << (bits - 1);
+	a &= mask;
+	b &= mask;
+	uint64_t r = (a - b) & mask;
+	
+	return ((r & top) ? 8 : 0) | (!r ? 4 : 0) | (a >= b ? 2 : 0) | (((a ^ b) & (a ^ r) & top) ? 1 : 0);
+}
+
+#ifdef LH_AARCH64
+
+#define TestEmitBlock LHAArch64EmitBlock
+
+static int64_t TestSext(uint64_t value, int bits) {
+	return (int64_t) (value << (64 - bits)) >> (64 - bits);
+}
+
+static bool TestRun(uintptr_t pc, uintptr_t sentinel, uint64_t arg, uint64_t *result) {
+	/**
+	 * Run AArch64 code from `pc` until it returns to `sentinel`.
+	 */
+	
+	uint64_t x[32] = { arg };
+	uint32_t nzcv = 0;
+	x[30] = sentinel;
+	
+	for (int step = 0; step < TEST_MAX_STEPS; step++) {
+		if (pc == sentinel) {
+			*result = x[0];
+			return true;
+		}
+		
+		uint32_t ins;
+		
+		if (!TestFetch(pc, &ins)) {
+			return false;
+		}
+		
+		uintptr_t next = pc + 4;
+		uint32_t rd = ins & 0x1f, rn = (ins >> 5) & 0x1f;
+		bool sf = ins >> 31;
+		
+		if (ins == 0xd503201f) {
+			// nop
+		}
+		else if ((ins & 0x1f800000) == 0x11000000) {
+			// add/sub/adds/subs (immediate)
+			uint64_t imm = ((ins >> 10) & 0xfff) << (((ins >> 22) & 1) ? 12 : 0);
+			uint64_t a = sf ? x[rn] : (uint32_t) x[rn];
+			uint64_t r = ((ins >> 30) & 1) ? a - imm : a + imm;
+			
+			if ((ins >> 29) & 1) {
+				nzcv = ((ins >> 30) & 1) ? TestSubFlags(a, imm, sf ? 64 : 32) : 0;
+			}
+			
+			if (rd != 31) {
+				x[rd] = sf ? r : (uint32_t) r;
+			}
+		}
+		else if ((ins & 0x7f800000) == 0x52800000) {
+			// movz
+			x[rd] = (uint64_t) ((ins >> 5) & 0xffff) << (((ins >> 21) & 3) * 16);
+		}
+		else if ((ins & 0xffe0ffe0) == 0xaa0003e0) {
+			// mov (register)
+			x[rd] = x[(ins >> 16) & 0x1f];
+		}
+		else if ((ins & 0x7c000000) == 0x14000000) {
+			// b, bl
+			if (sf) {
+				x[30] = pc + 4;
+			}
+			
+			next = pc + TestSext(ins & 0x3ffffff, 26) * 4;
+		}
+		else if ((ins & 0xff000010) == 0x54000000) {
+			// b.cond
+			if (TestCondition(ins & 0xf, nzcv)) {
+				next = pc + TestSext((ins >> 5) & 0x7ffff, 19) * 4;
+			}
+		}
+		else if ((ins & 0x7e000000) == 0x34000000) {
+			// cbz, cbnz
+			uint64_t value = sf ? x[rd] : (uint32_t) x[rd];
+			
+			if ((value != 0) == ((ins >> 24) & 1)) {
+				next = pc + TestSext((ins >> 5) & 0x7ffff, 19) * 4;
+			}
+		}
+		else if ((ins & 0x7e000000) == 0x36000000) {
+			// tbz, tbnz
+			uint32_t bit = (sf << 5) | ((ins >> 19) & 0x1f);
+			
+			if (((x[rd] >> bit) & 1) == ((ins >> 24) & 1)) {
+				next = pc + TestSext((ins >> 5) & 0x3fff, 14) * 4;
+			}
+		}
+		else if ((ins & 0x3f000000) == 0x18000000) {
+			// ldr, ldrsw (literal)
+			uint8_t *addr = (uint8_t *) (pc + TestSext((ins >> 5) & 0x7ffff, 19) * 4);
+			uint32_t word;
+			memcpy(&word, addr, sizeof word);
+			
+			switch (ins >> 30) {
+				case 0: x[rd] = word; break;
+				case 1: memcpy(&x[rd], addr, sizeof x[rd]); break;
+				case 2: x[rd] = (int64_t) (int32_t) word; break;
+				default: return false;
+			}
+		}
+		else if ((ins & 0x1f000000) == 0x10000000) {
+			// adr, adrp
+			int64_t imm = TestSext((((ins >> 5) & 0x7ffff) << 2) | ((ins >> 29) & 3), 21);
+			x[rd] = sf ? (pc & ~(uintptr_t) 0xfff) + imm * 0x1000 : pc + imm;
+		}
+		else if ((ins & 0xfffffc1f) == 0xd61f0000 || (ins & 0xfffffc1f) == 0xd65f0000) {
+			// br, ret
+			next = x[rn];
+		}
+		else if ((ins & 0xfffffc1f) == 0xd63f0000) {
+			// blr
+			next = x[rn];
+			x[30] = pc + 4;
+		}
+		else {
+			fprintf(stderr, "Can't run instruction %08x at <%p>\n", ins, (void *) pc);
+			return false;
+		}
+		
+		pc = next;
+	}
+	
+	return false;
+}
+
+static const RelocCase gRelocCases[] = {
+	// cmp x0, #0; b.eq 1f; mov x0, #1; ret; 1: mov x0, #2; ret
+	{ "b.eq taken", { 0xf100001f, 0x54000060, 0xd2800020, 0xd65f03c0, 0xd2800040, 0xd65f03c0 }, 0, 2, 0, RESULT_VALUE, 2 },
+	{ "b.eq not taken", { 0xf100001f, 0x54000060, 0xd2800020, 0xd65f03c0, 0xd2800040, 0xd65f03c0 }, 0, 2, 5, RESULT_VALUE, 1 },
+	// cbnz w0, 1f; mov x0, #3; ret; 1: mov x0, #4; ret
+	{ "cbnz taken", { 0x35000060, 0xd2800060, 0xd65f03c0, 0xd2800080, 0xd65f03c0 }, 0, 1, 1, RESULT_VALUE, 4 },
+	{ "cbnz not taken", { 0x35000060, 0xd2800060, 0xd65f03c0, 0xd2800080, 0xd65f03c0 }, 0, 1, 0, RESULT_VALUE, 3 },
+	// tbz x0, #3, 1f; mov x0, #5; ret; 1: mov x0, #6; ret
+	{ "tbz taken", { 0x36180060, 0xd28000a0, 0xd65f03c0, 0xd28000c0, 0xd65f03c0 }, 0, 1, 0, RESULT_VALUE, 6 },
+	{ "tbz not taken", { 0x36180060, 0xd28000a0, 0xd65f03c0, 0xd28000c0, 0xd65f03c0 }, 0, 1, 8, RESULT_VALUE, 5 },
+	// mov x9, x30; bl 2f; add x0, x0, #1; ret x9; 2: mov x0, #41; ret
+	{ "bl", { 0xaa1e03e9, 0x94000003, 0x91000400, 0xd65f0120, 0xd2800520, 0xd65f03c0 }, 0, 2, 0, RESULT_VALUE, 42 },
+	// b 1f; mov x0, #7; ret; 1: mov x0, #8; ret
+	{ "b", { 0x14000003, 0xd28000e0, 0xd65f03c0, 0xd2800100, 0xd65f03c0 }, 0, 1, 0, RESULT_VALUE, 8 },
+	// cbz x0, 1f; add x0, x0, #10; 1: add x0, x0, #1; ret
+	{ "cbz inside block taken", { 0xb4000040, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 3, 0, RESULT_VALUE, 1 },
+	{ "cbz inside block not taken", { 0xb4000040, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 3, 5, RESULT_VALUE, 16 },
+	// tbnz x0, #0, 1f; add x0, x0, #10; 1: add x0, x0, #1; ret
+	{ "tbnz inside block taken", { 0x37000040, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 3, 1, RESULT_VALUE, 2 },
+	{ "tbnz inside block not taken", { 0x37000040, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 3, 2, RESULT_VALUE, 13 },
+	// cmp x0, #3; b.gt 1f; add x0, x0, #10; 1: add x0, x0, #1; ret
+	{ "b.gt inside block taken", { 0xf1000c1f, 0x5400004c, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 4, 5, RESULT_VALUE, 6 },
+	{ "b.gt inside block not taken", { 0xf1000c1f, 0x5400004c, 0x91002800, 0x91000400, 0xd65f03c0 }, 0, 4, 1, RESULT_VALUE, 12 },
+	// cbz x0, 1f; b 2f; 1: mov x0, #9; 2: ret
+	{ "cbz inside and b outside", { 0xb4000040, 0x14000002, 0xd2800120, 0xd65f03c0 }, 0, 3, 0, RESULT_VALUE, 9 },
+	{ "b outside after cbz", { 0xb4000040, 0x14000002, 0xd2800120, 0xd65f03c0 }, 0, 3, 5, RESULT_VALUE, 5 },
+	// ldr x0, 1f; ret; 1: .quad 0x1122334455667788
+	{ "ldr x literal", { 0x58000040, 0xd65f03c0, 0x55667788, 0x11223344 }, 0, 1, 0, RESULT_VALUE, 0x1122334455667788 },
+	// ldrsw x0, 1f; ret; 1: .word 0x80000000
+	{ "ldrsw literal", { 0x98000040, 0xd65f03c0, 0x80000000 }, 0, 1, 0, RESULT_VALUE, 0xffffffff80000000 },
+	// adr x0, 1f; ret; 1: nop
+	{ "adr", { 0x10000040, 0xd65f03c0, 0xd503201f }, 0, 1, 0, RESULT_CODE, 2 },
+	// adrp x0, #0x1000; ret
+	{ "adrp", { 0xb0000000, 0xd65f03c0 }, 0, 1, 0, RESULT_PAGE, 0x1000 },
+};
+
+#else
+
+#define TestEmitBlock LHAArch32EmitBlock
+
+static bool TestRun(uintptr_t pc, uintptr_t sentinel, uint64_t arg, uint64_t *result) {
+	/**
+	 * Run ARM mode AArch32 code from `pc` until it returns to `sentinel`.
+	 */
+	
+	uint32_t r[16] = { arg };
+	uint32_t nzcv = 0;
+	r[14] = sentinel;
+	
+	for (int step = 0; step < TEST_MAX_STEPS; step++) {
+		if (pc == sentinel) {
+			*result = r[0];
+			return true;
+		}
+		
+		uint32_t ins;
+		
+		if (!TestFetch(pc, &ins)) {
+			return false;
+		}
+		
+		uintptr_t next = pc + 4;
+		uint32_t cond = ins >> 28, rd = (ins >> 12) & 0xf, rn = (ins >> 16) & 0xf, rm = ins & 0xf;
+		
+		// Reading the PC gives the address of the instruction plus 8
+		r[15] = pc + 8;
+		
+		if (!TestCondition(cond, nzcv)) {
+			// Condition failed
+		}
+		else if ((ins & 0x0fffffff) == 0x0320f000) {
+			// nop
+		}
+		else if ((ins & 0x0ffffff0) == 0x012fff10) {
+			// bx
+			if (r[rm] & 1) {
+				return false;
+			}
+			
+			next = r[rm];
+		}
+		else if ((ins & 0x0e000000) == 0x0a000000) {
+			// b, bl
+			if ((ins >> 24) & 1) {
+				r[14] = pc + 4;
+			}
+			
+			next = pc + 8 + ((int32_t) (ins << 8) >> 6);
+		}
+		else if ((ins & 0x0f7f0000) == 0x051f0000) {
+			// ldr (literal), which might load the PC
+			uint32_t addr = (r[15] & ~3) + (((ins >> 23) & 1) ? (ins & 0xfff) : -(ins & 0xfff));
+			uint32_t value = *(uint32_t *) (uintptr_t) addr;
+			
+			if (rd == 15) {
+				if (value & 1) {
+					return false;
+				}
+				
+				next = value;
+			}
+			else {
+				r[rd] = value;
+			}
+		}
+		else if ((ins & 0x0fef0ff0) == 0x01a00000 && rd != 15) {
+			// mov (register)
+			r[rd] = r[rm];
+		}
+		else if ((ins & 0x0e000000) == 0x02000000 && rd != 15) {
+			// add, sub, mov, cmp (immediate)
+			uint32_t imm = LHAArch32ExpandImm(ins & 0xfff);
+			uint32_t a = rn == 15 ? r[15] & ~3 : r[rn];
+			
+			switch ((ins >> 21) & 0xf) {
+				case 0x2: r[rd] = a - imm; break;
+				case 0x4: r[rd] = a + imm; break;
+				case 0xa: nzcv = TestSubFlags(a, imm, 32); break;
+				case 0xd: r[rd] = imm; break;
+				default: return false;
+			}
+		}
+		else {
+			fprintf(stderr, "Can't run instruction %08x at <%p>\n", ins, (void *) pc);
+			return false;
+		}
+		
+		pc = next;
+	}
+	
+	return false;
+}
+
+static const RelocCase gRelocCases[] = {
+	// cmp r0, #0; beq 1f; mov r0, #1; bx lr; 1: mov r0, #2; bx lr
+	{ "beq taken", { 0xe3500000, 0x0a000001, 0xe3a00001, 0xe12fff1e, 0xe3a00002, 0xe12fff1e }, 0, 2, 0, RESULT_VALUE, 2 },
+	{ "beq not taken", { 0xe3500000, 0x0a000001, 0xe3a00001, 0xe12fff1e, 0xe3a00002, 0xe12fff1e }, 0, 2, 5, RESULT_VALUE, 1 },
+	// b 1f; mov r0, #7; bx lr; 1: mov r0, #8; bx lr
+	{ "b", { 0xea000001, 0xe3a00007, 0xe12fff1e, 0xe3a00008, 0xe12fff1e }, 0, 1, 0, RESULT_VALUE, 8 },
+	// mov r12, lr; bl 2f; add r0, r0, #1; bx r12; 2: mov r0, #41; bx lr
+	{ "bl", { 0xe1a0c00e, 0xeb000001, 0xe2800001, 0xe12fff1c, 0xe3a00029, 0xe12fff1e }, 0, 2, 0, RESULT_VALUE, 42 },
+	// mov r12, lr; cmp r0, #0; bleq 2f; add r0, r0, #1; bx r12; 2: mov r0, #41; bx lr
+	{ "bleq taken", { 0xe1a0c00e, 0xe3500000, 0x0b000001, 0xe2800001, 0xe12fff1c, 0xe3a00029, 0xe12fff1e }, 0, 3, 0, RESULT_VALUE, 42 },
+	{ "bleq not taken", { 0xe1a0c00e, 0xe3500000, 0x0b000001, 0xe2800001, 0xe12fff1c, 0xe3a00029, 0xe12fff1e }, 0, 3, 5, RESULT_VALUE, 6 },
+	// cmp r0, #3; bgt 1f; add r0, r0, #10; 1: add r0, r0, #1; bx lr
+	{ "bgt inside block taken", { 0xe3500003, 0xca000000, 0xe280000a, 0xe2800001, 0xe12fff1e }, 0, 4, 5, RESULT_VALUE, 6 },
+	{ "bgt inside block not taken", { 0xe3500003, 0xca000000, 0xe280000a, 0xe2800001, 0xe12fff1e }, 0, 4, 1, RESULT_VALUE, 12 },
+	// ldr r0, 1f; bx lr; 1: .word 0x11223344
+	{ "ldr literal", { 0xe59f0000, 0xe12fff1e, 0x11223344 }, 0, 1, 0, RESULT_VALUE, 0x11223344 },
+	// b 2f; 1: .word 0x55667788; 2: ldr r0, 1b; bx lr
+	{ "ldr literal backwards", { 0xea000000, 0x55667788, 0xe51f000c, 0xe12fff1e }, 2, 1, 0, RESULT_VALUE, 0x55667788 },
+	// adr r0, 1f; bx lr; 1: nop
+	{ "adr", { 0xe28f0000, 0xe12fff1e, 0xe320f000 }, 0, 1, 0, RESULT_CODE, 2 },
+	// 1: nop; adr r0, 1b; bx lr
+	{ "adr backwards", { 0xe320f000, 0xe24f000c, 0xe12fff1e }, 1, 1, 0, RESULT_CODE, 0 },
+};
+
+#endif
+
+static uint8_t *TestRelocate(uint32_t *old_block, size_t block_size, uint8_t *out) {
+	/**
+	 * The same as LHRewriteAArch64Block or LHRewriteAArch32Block, but the
+	 * trampoline goes to `out`.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	size_t positions[block_size];
+	
+	TestEmitBlock(&code, &data, old_block, block_size, 0, positions);
+	size_t code_size = LHStreamTell(&code);
+	
+	LHStreamInit(&code);
+	LHStreamInit(&data);
+	TestEmitBlock(&code, &data, old_block, block_size, code_size, positions);
+	
+	if (code.overflow || data.overflow) {
+		return NULL;
+	}
+	
+	memcpy(out, code.data, LHStreamTell(&code));
+	memcpy(out + LHStreamTell(&code), data.data, LHStreamTell(&data));
+	
+	return out;
+}
+
+int main(void) {
+	// AArch32 addresses have to fit in 32 bits even when testing on a 64-bit
+	// host
+	uint8_t *memory = gTestMemory = mmap((void *) 0x40000000, TEST_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	
+	if (memory == MAP_FAILED || (uint64_t) (uintptr_t) memory + TEST_MEMORY_SIZE > 0x100000000) {
+		fprintf(stderr, "Could not map memory below 4 GiB\n");
+		return 1;
+	}
+	
+	// Returning here ends the run
+	uintptr_t sentinel = (uintptr_t) memory;
+	uint32_t *code = (uint32_t *) (memory + TEST_CODE_OFFSET);
+	
+	for (size_t i = 0; i < sizeof gRelocCases / sizeof *gRelocCases; i++) {
+		const RelocCase *test = &gRelocCases[i];
+		
+		memset(memory + TEST_CODE_OFFSET, 0, TEST_MEMORY_SIZE - TEST_CODE_OFFSET);
+		memcpy(code, test->code, sizeof test->code);
+		
+		uint8_t *trampoline = TestRelocate(code + test->entry, test->block, memory + TEST_TRAMPOLINE_OFFSET);
+		uint64_t expected = test->result, result;
+		
+		if (test->kind == RESULT_CODE) {
+			expected = (uintptr_t) &code[test->result];
+		}
+		else if (test->kind == RESULT_PAGE) {
+			expected = ((uintptr_t) code & ~(uintptr_t) 0xfff) + test->result;
+		}
+		
+		bool ran = trampoline && TestRun((uintptr_t) trampoline, sentinel, test->arg, &result);
+		
+		// The original code has to give the same result too
+		uint64_t direct;
+		bool ran_direct = TestRun((uintptr_t) (code + test->entry), sentinel, test->arg, &direct);
+		
+		if (!ran || !ran_direct || result != expected || direct != expected) {
+			fprintf(stderr, "%s: expected %" PRIx64 ", got %" PRIx64 " from the trampoline and %" PRIx64 " directly\n", test->name, expected, ran ? result : 0, ran_direct ? direct : 0);
+			gTestFailures++;
+		}
+	}
+	
+	return TEST_RESULT();
+}
@@ -0,0 +1,31 @@
+/**
+ * A small shared object for the Leaf tests. Each global exercises a
+ * different kind of relocation.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *greeting = "hello"; // RELATIVE
+size_t (*strlen_ptr)(const char *) = strlen; // GLOB_DAT or 64
+int counter = 0;
+int *counter_ptr = &counter;
+
+// A symbol without a size near the very end, like _end
+__asm__(".globl synth_end\n.pushsection .bss.zzz, \"aw\", @nobits\nsynth_end:\n.skip 16\n.popsection");
+
+__attribute__((constructor)) static void synth_init(void) {
+	counter = 42;
+}
+
+int synth_add(int a, int b) {
+	return a + b + *counter_ptr;
+}
+
+size_t synth_len(void) {
+	// snprintf() and strlen() go through the PLT (JUMP_SLOT)
+	char buf[64];
+	snprintf(buf, sizeof buf, "%s!", greeting);
+	return strlen_ptr(buf) + strlen(buf);
+}
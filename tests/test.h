@@ -0,0 +1,48 @@
+/**
+ * Tiny helpers shared by the host tests.
+ */
+
+#ifndef KN_TEST_HEADER
+#define KN_TEST_HEADER
+
+// Leaf and LeafHook both need this before any system header
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// LeafHook backend for the host, like util.h picks for the shim, unless the
+// test asked for a particular one
+#if defined(LH_AARCH64) || defined(LH_AARCH32) || defined(LH_X86) || defined(LH_X86_64)
+#elif defined(__arm__)
+#define LH_AARCH32
+#elif defined(__aarch64__)
+#define LH_AARCH64
+#elif defined(__i386__)
+#define LH_X86
+#elif defined(__x86_64__)
+#define LH_X86_64
+#endif
+
+// Not every test uses these, so they're marked to not warn
+static int gTestFailures __attribute__((unused));
+
+#define TEST_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		gTestFailures++; \
+	} \
+} while (0)
+
+#define TEST_RESULT() (gTestFailures ? (fprintf(stderr, "%d checks failed\n", gTestFailures), 1) : 0)
+
+static inline uint64_t TestTimeNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif